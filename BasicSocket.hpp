@@ -0,0 +1,240 @@
+/** \file	BasicSocket.hpp
+ * \author		Jimmy van den Berg at Flow Engineering
+ * \brief		BaseSocket with compile time register size, buffer size,
+ * 				transport and feature set.
+ * \details 	FlowSerial::BasicSocket owns its register and returned data
+ * 				buffer and sends through a transport policy instead of a
+ * 				derived class. BaseSocket still reaches the transport
+ * 				through its virtual functions.
+ */
+
+#ifndef _FLOWSERIAL_BASICSOCKET_HPP_
+#define _FLOWSERIAL_BASICSOCKET_HPP_
+
+#include "FlowSerial.hpp"
+#include <CircularBuffer>
+#include <string.h>
+#include <type_traits>
+#include <utility>
+
+namespace FlowSerial{
+	/**
+	 * @brief      Optional parts of the protocol a BasicSocket uses.
+	 */
+	enum class Feature : uint8_t{
+		// BaseSocket::readAsync and BaseSocket::sendTaggedReadRequest.
+		taggedReads,
+		// BaseSocket::setWideMode.
+		wide,
+		// BaseSocket::subscribe.
+		subscriptions,
+		// BaseSocket::writeReliable.
+		reliableWrites,
+		// BaseSocket::setCompression.
+		compression,
+		// BaseSocket::writeBulk.
+		bulk
+	};
+
+	namespace Detail{
+		template<Feature F, Feature... Features>
+		struct HasFeature;
+		template<Feature F>
+		struct HasFeature<F>{
+			static const bool value = false;
+		};
+		template<Feature F, Feature G, Feature... Rest>
+		struct HasFeature<F, G, Rest...>{
+			static const bool value = F == G || HasFeature<F, Rest...>::value;
+		};
+		// Detects the optional members of a transport policy.
+		template<class T>
+		struct HasWriteVector{
+			template<class U>
+			static auto test(int) -> decltype(std::declval<U&>().writeVector(static_cast<const IoVector*>(nullptr), size_t()), std::true_type());
+			template<class>
+			static std::false_type test(...);
+			static const bool value = decltype(test<T>(0))::value;
+		};
+		template<class T>
+		struct HasReceive{
+			template<class U>
+			static auto test(int) -> decltype(std::declval<U&>().receive(static_cast<uint8_t*>(nullptr), size_t(), uint32_t()), std::true_type());
+			template<class>
+			static std::false_type test(...);
+			static const bool value = decltype(test<T>(0))::value;
+		};
+	}
+
+	/**
+	 * @brief      BaseSocket with a register of RegisterSize bytes and a
+	 *             transport policy.
+	 * @details    Transport must have a member
+	 *             `void write(const uint8_t data[], size_t size)`. Optional
+	 *             members are `void writeVector(const IoVector vectors[],
+	 *             size_t count)`, used instead of flattening frames, and
+	 *             `size_t receive(uint8_t buffer[], size_t size, uint32_t
+	 *             timeout)` that waits up to timeout microseconds for data.
+	 *             With receive present BaseSocket::read works out of the box.
+	 *
+	 *             Register fields are accessed through the templated
+	 *             accessors. Their bounds are checked at compile time.
+	 *
+	 *             Features lists the optional parts of the protocol the
+	 *             socket uses. Calling a function of a feature that is not
+	 *             listed through the BasicSocket is a compile error. No
+	 *             features means all of them. This only guards the
+	 *             interface of BasicSocket: the code and state of every
+	 *             feature stay part of BaseSocket, and calls through a
+	 *             BaseSocket reference are not checked.
+	 *
+	 *             Replies to untagged reads go into a buffer of RxCapacity
+	 *             bytes, the buffer of BaseSocket is not used. A program
+	 *             with only BasicSocket instances can define
+	 *             FLOW_SERIAL_RETURN_BUFFER_SIZE as 1 to save its memory.
+	 *
+	 * @tparam     RegisterSize  Size of the own register in bytes.
+	 * @tparam     RxCapacity    Size of the buffer for replies to untagged
+	 *                           reads, see BaseSocket::getReturnedData.
+	 * @tparam     Transport     The transport policy.
+	 * @tparam     Features      The features used, see FlowSerial::Feature.
+	 */
+	template<size_t RegisterSize, size_t RxCapacity, class Transport, Feature... Features>
+	class BasicSocket final : public BaseSocket{
+		static_assert(RxCapacity > 0, "FlowSerial: the returned data buffer needs room");
+	public:
+		static const size_t registerSize = RegisterSize;
+		static const size_t rxCapacity = RxCapacity;
+		/**
+		 * @brief      True when the socket uses feature F.
+		 */
+		template<Feature F>
+		static constexpr bool uses(){
+			return sizeof...(Features) == 0 || Detail::HasFeature<F, Features...>::value;
+		}
+		/**
+		 * @brief      Constructor. The register is zero initialised.
+		 *
+		 * @param      args  Passed to the constructor of Transport.
+		 */
+		template<typename... Args>
+		explicit BasicSocket(Args&&... args):
+			BaseSocket(registerStorage, RegisterSize),
+			transport(std::forward<Args>(args)...)
+		{
+			memset(registerStorage, 0, sizeof(registerStorage));
+		}
+		/**
+		 * @brief      Copies a value into the own register.
+		 *
+		 * @tparam     Address  Location of the value in the register.
+		 */
+		template<size_t Address, typename T>
+		void set(const T& value){
+			static_assert(Address + sizeof(T) <= RegisterSize, "FlowSerial: field does not fit in the register");
+			memcpy(&registerStorage[Address], &value, sizeof(T));
+		}
+		/**
+		 * @brief      Copies a value out of the own register.
+		 *
+		 * @tparam     Address  Location of the value in the register.
+		 */
+		template<size_t Address, typename T>
+		T get() const{
+			static_assert(Address + sizeof(T) <= RegisterSize, "FlowSerial: field does not fit in the register");
+			T value;
+			memcpy(&value, &registerStorage[Address], sizeof(T));
+			return value;
+		}
+		/**
+		 * @brief      Writes a region of the own register to the same
+		 *             location in the register of the peer.
+		 *
+		 * @tparam     Address  Start of the region.
+		 * @tparam     Size     Size of the region.
+		 */
+		template<size_t Address, size_t Size>
+		void writeRegion(){
+			static_assert(Address + Size <= RegisterSize, "FlowSerial: region does not fit in the register");
+			write(Address, &registerStorage[Address], Size);
+		}
+		/**
+		 * @brief      Input the received data here. See
+		 *             BaseSocket::handleData.
+		 */
+		bool receive(const uint8_t data[], size_t arraySize){
+			return handleData(data, arraySize);
+		}
+		int sendTaggedReadRequest(size_t startAddress, uint8_t returnData[], size_t size){
+			static_assert(uses<Feature::taggedReads>(), "FlowSerial: Feature::taggedReads is not enabled");
+			return BaseSocket::sendTaggedReadRequest(startAddress, returnData, size);
+		}
+		int readAsync(size_t startAddress, uint8_t returnData[], size_t size, ReadCallback callback = nullptr, void* context = nullptr){
+			static_assert(uses<Feature::taggedReads>(), "FlowSerial: Feature::taggedReads is not enabled");
+			return BaseSocket::readAsync(startAddress, returnData, size, callback, context);
+		}
+		void setWideMode(bool enable){
+			static_assert(uses<Feature::wide>(), "FlowSerial: Feature::wide is not enabled");
+			BaseSocket::setWideMode(enable);
+		}
+		int subscribe(size_t startAddress, uint8_t destination[], size_t size, uint16_t period, bool onChange = false, ReadCallback callback = nullptr, void* context = nullptr){
+			static_assert(uses<Feature::subscriptions>(), "FlowSerial: Feature::subscriptions is not enabled");
+			return BaseSocket::subscribe(startAddress, destination, size, period, onChange, callback, context);
+		}
+		bool writeReliable(size_t startAddress, const uint8_t data[], size_t size){
+			static_assert(uses<Feature::reliableWrites>(), "FlowSerial: Feature::reliableWrites is not enabled");
+			return BaseSocket::writeReliable(startAddress, data, size);
+		}
+		void setCompression(bool enable){
+			static_assert(uses<Feature::compression>(), "FlowSerial: Feature::compression is not enabled");
+			BaseSocket::setCompression(enable);
+		}
+		bool writeBulk(size_t startAddress, const uint8_t data[], size_t size){
+			static_assert(uses<Feature::bulk>(), "FlowSerial: Feature::bulk is not enabled");
+			return BaseSocket::writeBulk(startAddress, data, size);
+		}
+		size_t returnDataSize() final{
+			return returnedData.getStored();
+		}
+		size_t getReturnedData(uint8_t dataReturn[], size_t size) final{
+			return returnedData.get(dataReturn, size);
+		}
+		void clearReturnedData() final{
+			returnedData.clearAll();
+		}
+		Transport transport;
+	protected:
+		void writeToInterface(const uint8_t data[], size_t arraySize) final{
+			transport.write(data, arraySize);
+		}
+		void writeVectorToInterface(const IoVector vectors[], size_t count) final{
+			writeVector(vectors, count, std::integral_constant<bool, Detail::HasWriteVector<Transport>::value>());
+		}
+		void receiveFromInterface(uint32_t timeout) final{
+			receive(timeout, std::integral_constant<bool, Detail::HasReceive<Transport>::value>());
+		}
+		bool storeReturnedData(const uint8_t data[], size_t size) final{
+			bool fits = RxCapacity - returnedData.getStored() >= size;
+			returnedData.set(data, size);
+			return fits;
+		}
+	private:
+		void writeVector(const IoVector vectors[], size_t count, std::true_type){
+			transport.writeVector(vectors, count);
+		}
+		void writeVector(const IoVector vectors[], size_t count, std::false_type){
+			BaseSocket::writeVectorToInterface(vectors, count);
+		}
+		void receive(uint32_t timeout, std::true_type){
+			uint8_t buffer[256];
+			size_t size = transport.receive(buffer, sizeof(buffer), timeout);
+			handleData(buffer, size);
+		}
+		void receive(uint32_t timeout, std::false_type){
+			BaseSocket::receiveFromInterface(timeout);
+		}
+		uint8_t registerStorage[RegisterSize];
+		CircularBuffer<uint8_t, RxCapacity> returnedData;
+	};
+}
+#endif //_FLOWSERIAL_BASICSOCKET_HPP_
@@ -0,0 +1,207 @@
+/** \file	Checksum.cpp
+ * \author		Jimmy van den Berg at Flow Engineering
+ * \brief		Checksum kernels used by the FlowSerial encoder and parser.
+ */
+
+#include "Checksum.hpp"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define _FLOW_SERIAL_CHECKSUM_SSE2_
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define _FLOW_SERIAL_CHECKSUM_NEON_
+#endif
+
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include <string.h>
+
+namespace FlowSerial{
+
+	uint16_t additiveChecksumScalar(uint16_t checksum, const uint8_t data[], size_t size){
+		for (size_t i = 0; i < size; ++i){
+			checksum += data[i];
+		}
+		return checksum;
+	}
+
+	uint16_t additiveChecksum(uint16_t checksum, const uint8_t data[], size_t size){
+		// Frames are mostly short. It is not worth setting up vector
+		// registers for a few bytes.
+		if(size < 32){
+			return additiveChecksumScalar(checksum, data, size);
+		}
+		size_t i = 0;
+		// Only the lower 16 bits of the sum matter, so the wider accumulators
+		// are allowed to wrap.
+		#if defined(__AVX2__)
+		const __m256i zero = _mm256_setzero_si256();
+		__m256i sum = _mm256_setzero_si256();
+		for (; i + 32 <= size; i += 32){
+			__m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&data[i]));
+			sum = _mm256_add_epi64(sum, _mm256_sad_epu8(block, zero));
+		}
+		__m128i half = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+		half = _mm_add_epi64(half, _mm_unpackhi_epi64(half, half));
+		checksum += static_cast<uint16_t>(_mm_cvtsi128_si32(half));
+		#elif defined(_FLOW_SERIAL_CHECKSUM_SSE2_)
+		const __m128i zero = _mm_setzero_si128();
+		__m128i sum = _mm_setzero_si128();
+		for (; i + 16 <= size; i += 16){
+			__m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&data[i]));
+			sum = _mm_add_epi64(sum, _mm_sad_epu8(block, zero));
+		}
+		sum = _mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum));
+		checksum += static_cast<uint16_t>(_mm_cvtsi128_si32(sum));
+		#elif defined(_FLOW_SERIAL_CHECKSUM_NEON_)
+		uint32x4_t sum = vdupq_n_u32(0);
+		for (; i + 16 <= size; i += 16){
+			sum = vpadalq_u16(sum, vpaddlq_u8(vld1q_u8(&data[i])));
+		}
+		checksum += static_cast<uint16_t>(
+			vgetq_lane_u32(sum, 0) + vgetq_lane_u32(sum, 1) +
+			vgetq_lane_u32(sum, 2) + vgetq_lane_u32(sum, 3));
+		#endif
+		return additiveChecksumScalar(checksum, &data[i], size - i);
+	}
+
+	uint16_t crc16CcittScalar(uint16_t crc, const uint8_t data[], size_t size){
+		for (size_t i = 0; i < size; ++i){
+			crc ^= static_cast<uint16_t>(data[i]) << 8;
+			for (int bit = 0; bit < 8; ++bit){
+				crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+			}
+		}
+		return crc;
+	}
+
+	uint32_t crc32cScalar(uint32_t crc, const uint8_t data[], size_t size){
+		crc = ~crc;
+		for (size_t i = 0; i < size; ++i){
+			crc ^= data[i];
+			for (int bit = 0; bit < 8; ++bit){
+				crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+			}
+		}
+		return ~crc;
+	}
+
+	#ifndef ARDUINO
+	namespace{
+		// table[k][n] is the CRC of byte n followed by k zero bytes.
+		struct Crc16Tables{
+			uint16_t table[8][256];
+			Crc16Tables(){
+				for (unsigned int n = 0; n < 256; ++n){
+					uint8_t byte = n;
+					table[0][n] = crc16CcittScalar(0, &byte, 1);
+				}
+				for (unsigned int k = 1; k < 8; ++k){
+					for (unsigned int n = 0; n < 256; ++n){
+						uint16_t previous = table[k - 1][n];
+						table[k][n] = (previous << 8) ^ table[0][previous >> 8];
+					}
+				}
+			}
+		};
+		struct Crc32cTables{
+			uint32_t table[8][256];
+			Crc32cTables(){
+				for (unsigned int n = 0; n < 256; ++n){
+					uint32_t crc = n;
+					for (int bit = 0; bit < 8; ++bit){
+						crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+					}
+					table[0][n] = crc;
+				}
+				for (unsigned int k = 1; k < 8; ++k){
+					for (unsigned int n = 0; n < 256; ++n){
+						uint32_t previous = table[k - 1][n];
+						table[k][n] = (previous >> 8) ^ table[0][previous & 0xFF];
+					}
+				}
+			}
+		};
+		// Built on first use.
+		const Crc16Tables& crc16Tables(){
+			static const Crc16Tables tables;
+			return tables;
+		}
+		#if !defined(__SSE4_2__) && !defined(__ARM_FEATURE_CRC32)
+		const Crc32cTables& crc32cTables(){
+			static const Crc32cTables tables;
+			return tables;
+		}
+		#endif
+	}
+	#endif
+
+	uint16_t crc16Ccitt(uint16_t crc, const uint8_t data[], size_t size){
+		#ifdef ARDUINO
+		return crc16CcittScalar(crc, data, size);
+		#else
+		const uint16_t (&t)[8][256] = crc16Tables().table;
+		size_t i = 0;
+		for (; i + 8 <= size; i += 8){
+			crc = t[7][data[i] ^ (crc >> 8)] ^ t[6][data[i + 1] ^ (crc & 0xFF)] ^
+				t[5][data[i + 2]] ^ t[4][data[i + 3]] ^ t[3][data[i + 4]] ^
+				t[2][data[i + 5]] ^ t[1][data[i + 6]] ^ t[0][data[i + 7]];
+		}
+		for (; i < size; ++i){
+			crc = (crc << 8) ^ t[0][(crc >> 8) ^ data[i]];
+		}
+		return crc;
+		#endif
+	}
+
+	uint32_t crc32c(uint32_t crc, const uint8_t data[], size_t size){
+		#ifdef ARDUINO
+		return crc32cScalar(crc, data, size);
+		#else
+		crc = ~crc;
+		size_t i = 0;
+		#if defined(__SSE4_2__)
+		#if defined(__x86_64__) || defined(_M_X64)
+		uint64_t wide = crc;
+		for (; i + 8 <= size; i += 8){
+			uint64_t block;
+			memcpy(&block, &data[i], sizeof(block));
+			wide = _mm_crc32_u64(wide, block);
+		}
+		crc = static_cast<uint32_t>(wide);
+		#endif
+		for (; i < size; ++i){
+			crc = _mm_crc32_u8(crc, data[i]);
+		}
+		#elif defined(__ARM_FEATURE_CRC32)
+		for (; i + 8 <= size; i += 8){
+			uint64_t block;
+			memcpy(&block, &data[i], sizeof(block));
+			crc = __crc32cd(crc, block);
+		}
+		for (; i < size; ++i){
+			crc = __crc32cb(crc, data[i]);
+		}
+		#else
+		const uint32_t (&t)[8][256] = crc32cTables().table;
+		for (; i + 8 <= size; i += 8){
+			// The tables assume little endian lanes, so assemble by hand.
+			uint32_t low = crc ^ (data[i] | (data[i + 1] << 8) | (data[i + 2] << 16) | (static_cast<uint32_t>(data[i + 3]) << 24));
+			crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24] ^
+				t[3][data[i + 4]] ^ t[2][data[i + 5]] ^ t[1][data[i + 6]] ^ t[0][data[i + 7]];
+		}
+		for (; i < size; ++i){
+			crc = (crc >> 8) ^ t[0][(crc ^ data[i]) & 0xFF];
+		}
+		#endif
+		return ~crc;
+		#endif
+	}
+}
@@ -0,0 +1,68 @@
+/** \file	Checksum.hpp
+ * \author		Jimmy van den Berg at Flow Engineering
+ * \brief		Checksum kernels used by the FlowSerial encoder and parser.
+ * \details 	The default FlowSerial checksum is the sum of all frame bytes
+ * 				modulo 2^16. Since this is a plain sum it is computed on
+ * 				blocks with SIMD instructions when the target supports them.
+ * 				CRC-16-CCITT and CRC-32C are available as stronger
+ * 				alternatives, see FlowSerial::BaseSocket::setIntegrity.
+ */
+
+#ifndef _FLOWSERIAL_CHECKSUM_HPP_
+#define _FLOWSERIAL_CHECKSUM_HPP_
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace FlowSerial{
+	/**
+	 * @brief      Adds a block of bytes to a running FlowSerial checksum.
+	 * @details    Uses AVX2, SSE2 or NEON when the compiler targets them and
+	 *             falls back to a byte loop otherwise. All paths give the same
+	 *             result.
+	 *
+	 * @param[in]  checksum  Checksum of everything before data.
+	 * @param[in]  data      The data
+	 * @param[in]  size      Number of bytes in data.
+	 *
+	 * @return     checksum plus the sum of all bytes in data, modulo 2^16.
+	 */
+	uint16_t additiveChecksum(uint16_t checksum, const uint8_t data[], size_t size);
+	/**
+	 * @brief      Scalar reference of FlowSerial::additiveChecksum.
+	 */
+	uint16_t additiveChecksumScalar(uint16_t checksum, const uint8_t data[], size_t size);
+	/**
+	 * @brief      Adds a block of bytes to a running CRC-16-CCITT.
+	 * @details    Polynomial 0x1021, not reflected, no final xor. Start with
+	 *             0xFFFF. Uses slicing-by-8 tables, or a bit loop on Arduino
+	 *             where they do not fit in memory.
+	 *
+	 * @param[in]  crc   CRC of everything before data.
+	 * @param[in]  data  The data
+	 * @param[in]  size  Number of bytes in data.
+	 */
+	uint16_t crc16Ccitt(uint16_t crc, const uint8_t data[], size_t size);
+	/**
+	 * @brief      Bit by bit reference of FlowSerial::crc16Ccitt.
+	 */
+	uint16_t crc16CcittScalar(uint16_t crc, const uint8_t data[], size_t size);
+	/**
+	 * @brief      Adds a block of bytes to a running CRC-32C (Castagnoli).
+	 * @details    Reflected polynomial 0x82F63B78 with the usual inversion
+	 *             before and after, so start with 0 and pass the result of
+	 *             the previous block to continue. Uses the SSE4.2 or ARMv8
+	 *             CRC instructions when the compiler targets them and
+	 *             slicing-by-8 tables otherwise.
+	 *
+	 * @param[in]  crc   CRC of everything before data.
+	 * @param[in]  data  The data
+	 * @param[in]  size  Number of bytes in data.
+	 */
+	uint32_t crc32c(uint32_t crc, const uint8_t data[], size_t size);
+	/**
+	 * @brief      Bit by bit reference of FlowSerial::crc32c.
+	 */
+	uint32_t crc32cScalar(uint32_t crc, const uint8_t data[], size_t size);
+}
+#endif //_FLOWSERIAL_CHECKSUM_HPP_
@@ -0,0 +1,99 @@
+/** \file	ConcurrentSocket.cpp
+ * \author		Jimmy van den Berg at Flow Engineering
+ * \brief		BaseSocket that may be used from several threads.
+ */
+
+#ifndef ARDUINO
+
+#include "ConcurrentSocket.hpp"
+#include <stdexcept>
+#include <thread>
+
+using namespace std;
+
+namespace FlowSerial{
+
+	ConcurrentSocket::ConcurrentSocket(uint8_t* iflowRegister, size_t iregisterLength):
+		BaseSocket(iflowRegister, iregisterLength)
+	{
+		// Replies go through the transmit queue, which coalesces already.
+		coalesceReplies = false;
+		// Writes are split so every frame takes one slot.
+		maxFramePayload = FLOW_SERIAL_TX_QUEUE_SLOT_SIZE - 2 - maxHeaderArguments - 4;
+	}
+
+	size_t ConcurrentSocket::flushTransmitQueue(){
+		ioThread.store(this_thread::get_id(), memory_order_relaxed);
+		size_t frames = 0;
+		size_t stored = 0;
+		size_t next;
+		while((next = transmitQueue.peekSize()) > 0){
+			if(stored + next > sizeof(coalesceBuffer)){
+				writeToInterface(coalesceBuffer, stored);
+				stored = 0;
+			}
+			stored += transmitQueue.pop(&coalesceBuffer[stored]);
+			++frames;
+		}
+		if(stored > 0){
+			writeToInterface(coalesceBuffer, stored);
+		}
+		return frames;
+	}
+
+	size_t ConcurrentSocket::returnDataSize(){
+		return returnedData.size();
+	}
+
+	size_t ConcurrentSocket::getReturnedData(uint8_t dataReturn[], size_t size){
+		return returnedData.pop(dataReturn, size);
+	}
+
+	void ConcurrentSocket::clearReturnedData(){
+		returnedData.clear();
+	}
+
+	uint32_t ConcurrentSocket::remoteWriteGeneration() const{
+		return generation.load(memory_order_acquire);
+	}
+
+	void ConcurrentSocket::writeVectorToInterface(const IoVector vectors[], size_t count){
+		size_t frameSize = 0;
+		for (size_t i = 0; i < count; ++i){
+			frameSize += vectors[i].size;
+		}
+		if(frameSize > FLOW_SERIAL_TX_QUEUE_SLOT_SIZE){
+			if(this_thread::get_id() != ioThread.load(memory_order_relaxed)){
+				throw length_error("FlowSerial: frame does not fit in FLOW_SERIAL_TX_QUEUE_SLOT_SIZE");
+			}
+			// A reply larger than a slot, e.g. to a wide read. Only this
+			// thread writes to the interface, so it can skip the queue once
+			// the frames before it are out.
+			flushTransmitQueue();
+			for (size_t i = 0; i < count; ++i){
+				writeToInterface(vectors[i].data, vectors[i].size);
+			}
+			return;
+		}
+		while(!transmitQueue.tryPush(vectors, count)){
+			if(this_thread::get_id() == ioThread.load(memory_order_relaxed)){
+				// The queue is full and this thread is the one that drains
+				// it, e.g. replies sent from handleData. Make room here.
+				flushTransmitQueue();
+			}
+			else{
+				this_thread::yield();
+			}
+		}
+	}
+
+	bool ConcurrentSocket::storeReturnedData(const uint8_t data[], size_t size){
+		return returnedData.push(data, size) == size;
+	}
+
+	void ConcurrentSocket::remoteWriteApplied(size_t startAddress, size_t size){
+		generation.store(generation.load(memory_order_relaxed) + 1, memory_order_release);
+	}
+}
+
+#endif //ARDUINO
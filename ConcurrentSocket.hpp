@@ -0,0 +1,292 @@
+/** \file	ConcurrentSocket.hpp
+ * \author		Jimmy van den Berg at Flow Engineering
+ * \brief		BaseSocket that may be used from several threads.
+ * \details 	One I/O thread runs the link. Any number of application
+ * 				threads queue frames and take returned data without locks.
+ */
+
+#ifndef _FLOWSERIAL_CONCURRENTSOCKET_HPP_
+#define _FLOWSERIAL_CONCURRENTSOCKET_HPP_
+
+#include "FlowSerial.hpp"
+#include <atomic>
+#include <string.h>
+#include <thread>
+
+#ifndef FLOW_SERIAL_TX_QUEUE_SLOTS
+/**
+ * Number of frames the transmit queue of FlowSerial::ConcurrentSocket holds.
+ * Must be a power of two.
+ */
+#define FLOW_SERIAL_TX_QUEUE_SLOTS 64
+#endif
+
+#ifndef FLOW_SERIAL_TX_QUEUE_SLOT_SIZE
+/**
+ * Largest frame the transmit queue of FlowSerial::ConcurrentSocket holds. The
+ * default fits every frame with up to 255 payload bytes, also with the most
+ * header arguments and a CRC-32C.
+ */
+#define FLOW_SERIAL_TX_QUEUE_SLOT_SIZE (2 + FlowSerial::BaseSocket::maxHeaderArguments + 255 + 4)
+#endif
+
+#ifndef FLOW_SERIAL_RX_RING_SIZE
+/**
+ * Capacity of the returned data ring of FlowSerial::ConcurrentSocket. Must be
+ * a power of two.
+ */
+#define FLOW_SERIAL_RX_RING_SIZE 4096
+#endif
+
+namespace FlowSerial{
+
+	/**
+	 * @brief      Lock-free byte ring for one producer and one consumer
+	 *             thread.
+	 * @details    The producer publishes its writes with a release store of
+	 *             the head. The consumer acquires the head before reading, so
+	 *             it always sees complete data. The same holds the other way
+	 *             for the tail.
+	 *
+	 * @tparam     Capacity  Size in bytes. Must be a power of two.
+	 */
+	template<size_t Capacity>
+	class SpscByteRing{
+		static_assert((Capacity & (Capacity - 1)) == 0, "FlowSerial: capacity must be a power of two");
+	public:
+		/**
+		 * @brief      Producer only. Appends as much of data as fits.
+		 *
+		 * @return     Number of bytes appended.
+		 */
+		size_t push(const uint8_t data[], size_t size){
+			size_t head = this->head.load(memory_order_relaxed);
+			size_t tail = this->tail.load(memory_order_acquire);
+			size_t free = Capacity - (head - tail);
+			if(size > free){
+				size = free;
+			}
+			copy(&buffer[0], head, data, size);
+			this->head.store(head + size, memory_order_release);
+			return size;
+		}
+		/**
+		 * @brief      Consumer only. Takes up to size bytes.
+		 *
+		 * @return     Number of bytes taken.
+		 */
+		size_t pop(uint8_t data[], size_t size){
+			size_t tail = this->tail.load(memory_order_relaxed);
+			size_t head = this->head.load(memory_order_acquire);
+			if(size > head - tail){
+				size = head - tail;
+			}
+			for (size_t done = 0; done < size;){
+				size_t index = (tail + done) & (Capacity - 1);
+				size_t run = Capacity - index < size - done ? Capacity - index : size - done;
+				memcpy(&data[done], &buffer[index], run);
+				done += run;
+			}
+			this->tail.store(tail + size, memory_order_release);
+			return size;
+		}
+		/**
+		 * @brief      Consumer only. Drops all stored bytes.
+		 */
+		void clear(){
+			tail.store(head.load(memory_order_acquire), memory_order_release);
+		}
+		/**
+		 * @brief      Number of stored bytes. Exact for the consumer.
+		 */
+		size_t size() const{
+			return head.load(memory_order_acquire) - tail.load(memory_order_acquire);
+		}
+	private:
+		void copy(uint8_t* ring, size_t head, const uint8_t data[], size_t size){
+			for (size_t done = 0; done < size;){
+				size_t index = (head + done) & (Capacity - 1);
+				size_t run = Capacity - index < size - done ? Capacity - index : size - done;
+				memcpy(&ring[index], &data[done], run);
+				done += run;
+			}
+		}
+		uint8_t buffer[Capacity];
+		// Head and tail on their own cache lines so the two threads do not
+		// bounce one line between them.
+		alignas(64) atomic<size_t> head{0};
+		alignas(64) atomic<size_t> tail{0};
+	};
+
+	/**
+	 * @brief      Bounded lock-free queue of frames for many producer threads
+	 *             and one consumer thread.
+	 * @details    Every slot has a sequence number that tells whether it is
+	 *             free or holds a published frame. Producers claim a slot
+	 *             with a compare and swap, copy the frame in and publish it
+	 *             with a release store of the sequence. The consumer acquires
+	 *             the sequence before reading the frame.
+	 *
+	 * @tparam     Slots     Number of frames. Must be a power of two.
+	 * @tparam     SlotSize  Largest frame in bytes.
+	 */
+	template<size_t Slots, size_t SlotSize>
+	class MpscFrameQueue{
+		static_assert((Slots & (Slots - 1)) == 0, "FlowSerial: slots must be a power of two");
+	public:
+		MpscFrameQueue(){
+			for (size_t i = 0; i < Slots; ++i){
+				slots[i].sequence.store(i, memory_order_relaxed);
+			}
+		}
+		/**
+		 * @brief      Any thread. Copies the vectors into a free slot as one
+		 *             frame.
+		 *
+		 * @return     False when the queue is full or the frame is bigger than
+		 *             SlotSize.
+		 */
+		bool tryPush(const IoVector vectors[], size_t count){
+			size_t frameSize = 0;
+			for (size_t i = 0; i < count; ++i){
+				frameSize += vectors[i].size;
+			}
+			if(frameSize > SlotSize){
+				return false;
+			}
+			size_t position = enqueuePosition.load(memory_order_relaxed);
+			Slot* slot;
+			while(true){
+				slot = &slots[position & (Slots - 1)];
+				size_t sequence = slot->sequence.load(memory_order_acquire);
+				intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+				if(difference == 0){
+					if(enqueuePosition.compare_exchange_weak(position, position + 1, memory_order_relaxed)){
+						break;
+					}
+				}
+				else if(difference < 0){
+					return false;
+				}
+				else{
+					position = enqueuePosition.load(memory_order_relaxed);
+				}
+			}
+			slot->size = 0;
+			for (size_t i = 0; i < count; ++i){
+				memcpy(&slot->data[slot->size], vectors[i].data, vectors[i].size);
+				slot->size += vectors[i].size;
+			}
+			slot->sequence.store(position + 1, memory_order_release);
+			return true;
+		}
+		/**
+		 * @brief      Consumer only. Size of the next frame.
+		 *
+		 * @return     0 when the queue is empty.
+		 */
+		size_t peekSize(){
+			Slot& slot = slots[dequeuePosition & (Slots - 1)];
+			if(slot.sequence.load(memory_order_acquire) != dequeuePosition + 1){
+				return 0;
+			}
+			return slot.size;
+		}
+		/**
+		 * @brief      Consumer only. Copies the next frame into out and frees
+		 *             its slot. Call MpscFrameQueue::peekSize first, out must
+		 *             hold that many bytes.
+		 *
+		 * @return     Size of the frame or 0 when the queue is empty.
+		 */
+		size_t pop(uint8_t out[]){
+			Slot& slot = slots[dequeuePosition & (Slots - 1)];
+			if(slot.sequence.load(memory_order_acquire) != dequeuePosition + 1){
+				return 0;
+			}
+			size_t size = slot.size;
+			memcpy(out, slot.data, size);
+			slot.sequence.store(dequeuePosition + Slots, memory_order_release);
+			++dequeuePosition;
+			return size;
+		}
+	private:
+		struct Slot{
+			atomic<size_t> sequence;
+			size_t size;
+			uint8_t data[SlotSize];
+		};
+		Slot slots[Slots];
+		alignas(64) atomic<size_t> enqueuePosition{0};
+		alignas(64) size_t dequeuePosition = 0;
+	};
+
+	/**
+	 * @brief      BaseSocket for one I/O thread and many application threads.
+	 * @details    Threading rules:
+	 *             - BaseSocket::write and BaseSocket::sendReadRequest may be
+	 *               called from any thread. Frames go into a lock-free
+	 *               multi-producer queue. When it is full the caller yields
+	 *               until there is room. BaseSocket::write splits data in
+	 *               frames that fit in FLOW_SERIAL_TX_QUEUE_SLOT_SIZE. Larger
+	 *               replies sent by the I/O thread bypass the queue.
+	 *             - The I/O thread calls BaseSocket::handleData and
+	 *               ConcurrentSocket::flushTransmitQueue. Only the latter
+	 *               calls BaseSocket::writeToInterface, so the derived class
+	 *               never sees concurrent writes. When the queue is full
+	 *               while the I/O thread sends, for example replies from
+	 *               handleData, it drains the queue itself. Call
+	 *               flushTransmitQueue once before the first handleData so
+	 *               the I/O thread is known.
+	 *             - Data of untagged read replies goes through a lock-free
+	 *               single-producer single-consumer ring. One consumer thread
+	 *               may call returnDataSize, getReturnedData and
+	 *               clearReturnedData.
+	 *             - Everything else, like tagged reads, change tracking and
+	 *               batching, belongs to the I/O thread. Do not enable
+	 *               BaseSocket::setBatching; the queue already coalesces.
+	 *
+	 *             Memory ordering of remote writes: the I/O thread copies
+	 *             remote writes into BaseSocket::flowRegister with plain
+	 *             stores and then increments a generation counter with a
+	 *             release store. A thread that reads a new value from
+	 *             ConcurrentSocket::remoteWriteGeneration (an acquire load)
+	 *             sees every remote write applied before it. This does not
+	 *             stop a write from landing while the register is being read.
+	 *             Use it to detect changes, not to get untorn values.
+	 */
+	class ConcurrentSocket : public BaseSocket{
+	public:
+		ConcurrentSocket(uint8_t* iflowRegister, size_t iregisterLength);
+		/**
+		 * @brief      I/O thread. Sends all queued frames. Consecutive frames
+		 *             are coalesced into writes of up to
+		 *             FLOW_SERIAL_TX_BUFFER_SIZE bytes.
+		 *
+		 * @return     Number of frames sent.
+		 */
+		size_t flushTransmitQueue();
+		size_t returnDataSize() override;
+		size_t getReturnedData(uint8_t dataReturn[], size_t size) override;
+		void clearReturnedData() override;
+		/**
+		 * @brief      Number of remote writes applied to
+		 *             BaseSocket::flowRegister so far. Loaded with acquire
+		 *             ordering, see the class description.
+		 */
+		uint32_t remoteWriteGeneration() const;
+	protected:
+		void writeVectorToInterface(const IoVector vectors[], size_t count) override;
+		bool storeReturnedData(const uint8_t data[], size_t size) override;
+		void remoteWriteApplied(size_t startAddress, size_t size) override;
+	private:
+		static_assert(FLOW_SERIAL_TX_QUEUE_SLOT_SIZE > 2 + maxHeaderArguments + 4, "FlowSerial: FLOW_SERIAL_TX_QUEUE_SLOT_SIZE must hold a header and a payload");
+		MpscFrameQueue<FLOW_SERIAL_TX_QUEUE_SLOTS, FLOW_SERIAL_TX_QUEUE_SLOT_SIZE> transmitQueue;
+		SpscByteRing<FLOW_SERIAL_RX_RING_SIZE> returnedData;
+		atomic<uint32_t> generation{0};
+		// Thread that last called flushTransmitQueue.
+		atomic<thread::id> ioThread{thread::id()};
+		uint8_t coalesceBuffer[FLOW_SERIAL_TX_BUFFER_SIZE > FLOW_SERIAL_TX_QUEUE_SLOT_SIZE ? FLOW_SERIAL_TX_BUFFER_SIZE : FLOW_SERIAL_TX_QUEUE_SLOT_SIZE];
+	};
+}
+#endif //_FLOWSERIAL_CONCURRENTSOCKET_HPP_
@@ -19,6 +19,17 @@
  */
 
 #include "FlowSerial.hpp"
+#include "Checksum.hpp"
+#include "FramePool.hpp"
+#include "PayloadCodec.hpp"
+#include <string.h>
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include <chrono>
+#include <stdexcept>
+#include <thread>
+#endif
 
 //#define _DEBUG_FLOW_SERIAL_
 #ifdef _DEBUG_FLOW_SERIAL_
@@ -32,14 +43,278 @@ namespace FlowSerial{
 	BaseSocket::BaseSocket(uint8_t* iflowRegister, size_t iregisterLength):
 		flowRegister(iflowRegister),
 		registerLength(iregisterLength)
-	{}
+	{
+		for (size_t i = 0; i < readStatusSlots; ++i){
+			readStatus[i].tag = static_cast<uint8_t>(i);
+			readStatus[i].status = ReadStatus::cancelled;
+		}
+	}
+
+	// Multi byte arguments are sent least significant byte first.
+	static inline void putUint16(uint8_t out[], uint16_t value){
+		out[0] = value & 0xFF;
+		out[1] = value >> 8;
+	}
+	static inline void putUint32(uint8_t out[], uint32_t value){
+		putUint16(&out[0], value & 0xFFFF);
+		putUint16(&out[2], value >> 16);
+	}
+	static inline uint16_t getUint16(const uint8_t in[]){
+		return in[0] | (in[1] << 8);
+	}
+	static inline uint32_t getUint32(const uint8_t in[]){
+		return getUint16(&in[0]) | (static_cast<uint32_t>(getUint16(&in[2])) << 16);
+	}
+
+	inline uint32_t BaseSocket::integrityUpdate(uint32_t state, const uint8_t data[], size_t size) const{
+		switch(integrity){
+			case Integrity::crc16:
+				return crc16Ccitt(state, data, size);
+			case Integrity::crc32c:
+				return crc32c(state, data, size);
+			default:
+				return additiveChecksum(state, data, size);
+		}
+	}
+	inline uint32_t BaseSocket::integrityUpdate(uint32_t state, uint8_t input) const{
+		// Header bytes come one at a time, keep the default cheap.
+		if(integrity == Integrity::additive){
+			return static_cast<uint16_t>(state + input);
+		}
+		return integrityUpdate(state, &input, 1);
+	}
+	void BaseSocket::setIntegrity(Integrity iintegrity){
+		integrity = iintegrity;
+		trailerSize = integrity == Integrity::crc32c ? 4 : 2;
+		const uint8_t startByte = 0xAA;
+		checksumAfterStart = integrityUpdate(integrity == Integrity::crc16 ? 0xFFFF : 0, &startByte, 1);
+		// A frame that is half way uses the old checksum. Drop it.
+		flowSerialState = State::idle;
+	}
+	Integrity BaseSocket::getIntegrity() const{
+		return integrity;
+	}
+	#ifndef ARDUINO
+	void BaseSocket::setCapture(CaptureSink* sink){
+		captureSink = sink;
+	}
+	void BaseSocket::captureFrame(CaptureEvent event){
+		if(captureSink == nullptr){
+			return;
+		}
+		IoVector vector = {&argumentBuffer[0], argumentBuffer.getStored()};
+		captureSink->capture(event, instruction, currentMicros(), &vector, 1);
+	}
+	#endif
+
+	size_t BaseSocket::headerArguments(Instruction instruction){
+		switch(instruction){
+			case Instruction::read:
+			case Instruction::write:
+				return 2;
+			case Instruction::returnRequestedData:
+				return 1;
+			case Instruction::readTagged:
+			case Instruction::returnTaggedData:
+				return 3;
+			case Instruction::writeWide:
+				return 6;
+			case Instruction::readWide:
+			case Instruction::returnWideData:
+			case Instruction::returnSubscribedData:
+				return 7;
+			case Instruction::subscribe:
+				return 10;
+			case Instruction::unsubscribe:
+				return 1;
+			case Instruction::writeReliable:
+			case Instruction::writeEncoded:
+				return 9;
+			case Instruction::returnEncodedData:
+				return 3;
+			case Instruction::acknowledgeWrite:
+				return 4;
+			case Instruction::rangeError:
+				return 8;
+			case Instruction::capabilities:
+				return 12;
+		}
+		return 0;
+	}
+
+	void BaseSocket::headerReceived(){
+		const uint8_t* header = &argumentBuffer[0];
+		switch(instruction){
+			case Instruction::write:
+				argumentsRemaining = header[1];
+				break;
+			case Instruction::returnRequestedData:
+				argumentsRemaining = header[0];
+				break;
+			case Instruction::returnTaggedData:
+				argumentsRemaining = header[2];
+				break;
+			case Instruction::writeWide:
+				argumentsRemaining = getUint16(&header[4]);
+				break;
+			case Instruction::returnWideData:
+			case Instruction::returnSubscribedData:
+				argumentsRemaining = getUint16(&header[5]);
+				break;
+			case Instruction::writeReliable:
+				argumentsRemaining = getUint16(&header[7]);
+				break;
+			case Instruction::writeEncoded:
+				argumentsRemaining = getUint16(&header[6]);
+				break;
+			case Instruction::returnEncodedData:
+				argumentsRemaining = header[1];
+				break;
+			default:
+				argumentsRemaining = 0;
+		}
+		if(argumentsRemaining > maxPayload){
+			// Does not fit in the argument buffer. Drop the frame.
+			statistics.framesDropped.add(1);
+			argumentsRemaining = 0;
+			flowSerialState = State::idle;
+		}
+		else if(argumentsRemaining == 0){
+			flowSerialState = State::argumentsReceived;
+		}
+	}
 
 	bool BaseSocket::handleData(const uint8_t* const data, size_t arraySize){
 		// By default return false. Return true when a frame has been
 		// successfully handled
 		bool ret = false;
-		for (unsigned int i = 0; i < arraySize; ++i){
-			uint8_t input = data[i];
+		#ifndef ARDUINO
+		if(captureSink != nullptr){
+			IoVector vector = {data, arraySize};
+			captureSink->capture(CaptureEvent::bytesReceived, Instruction::read, currentMicros(), &vector, 1);
+		}
+		#endif
+		// Replies to read requests that arrive in one chunk go out together.
+		bool wasBatching = batching;
+		if(coalesceReplies){
+			batching = true;
+		}
+		if(interByteTimeout > 0){
+			uint64_t now = currentMicros();
+			if(flowSerialState != State::idle && now - lastDataTime >= interByteTimeout){
+				// The rest of this frame is not coming.
+				#ifdef _DEBUG_FLOW_SERIAL_
+				cout << "inter-byte timeout, partial frame aborted" << endl;
+				#endif
+				statistics.frameTimeouts.add(1);
+				resync(flowSerialState != State::startByteReceived, trailerReceived);
+			}
+			lastDataTime = now;
+		}
+		size_t i = 0;
+		while(true){
+			// Bytes of a failed frame are scanned again before new data.
+			while(resyncStart < resyncEnd){
+				replaying = true;
+				size_t used = parse(&resyncBuffer[resyncStart], resyncEnd - resyncStart, ret);
+				replaying = false;
+				if(!resyncRestarted){
+					resyncStart += used;
+				}
+				resyncRestarted = false;
+			}
+			if(i == arraySize){
+				break;
+			}
+			i += parse(&data[i], arraySize - i, ret);
+			resyncRestarted = false;
+		}
+		// One cumulative acknowledgement for everything in this chunk.
+		if(acknowledgePending || negativePending){
+			uint8_t arguments[4];
+			arguments[0] = receiverSession;
+			putUint16(&arguments[1], expectedSequence);
+			arguments[3] = negativePending;
+			acknowledgePending = false;
+			negativePending = false;
+			sendFlowMessage(Instruction::acknowledgeWrite, arguments, sizeof(arguments), nullptr, 0);
+		}
+		if(coalesceReplies){
+			batching = wasBatching;
+			if(!batching){
+				flush();
+			}
+		}
+		return ret;
+	}
+	void BaseSocket::dropPartialFrame(){
+		if(flowSerialState != State::idle){
+			statistics.framesDropped.add(1);
+			flowSerialState = State::idle;
+		}
+	}
+	void BaseSocket::setResync(bool enable, uint32_t timeout){
+		// Without the buffer there is nothing to scan again.
+		resyncEnabled = enable && FLOW_SERIAL_RESYNC;
+		interByteTimeout = timeout;
+		lastDataTime = currentMicros();
+	}
+	bool BaseSocket::resync(bool instructionReceived, size_t checksumBytes){
+		flowSerialState = State::idle;
+		if(!resyncEnabled){
+			return false;
+		}
+		size_t from;
+		if(replaying){
+			// The frame was parsed from resyncBuffer itself. Its bytes are
+			// still there, continue after its start byte.
+			from = frameStart - resyncBuffer + 1;
+		}
+		else{
+			// Put the frame back together, without its start byte.
+			resyncEnd = 0;
+			if(instructionReceived){
+				resyncBuffer[resyncEnd++] = static_cast<uint8_t>(instruction);
+			}
+			for (size_t i = 0; i < argumentBuffer.getStored(); ++i){
+				resyncBuffer[resyncEnd++] = argumentBuffer[i];
+			}
+			for (size_t i = 0; i < checksumBytes; ++i){
+				resyncBuffer[resyncEnd++] = checksumReceived >> (8 * i);
+			}
+			from = 0;
+		}
+		while(from < resyncEnd && resyncBuffer[from] != 0xAA){
+			++from;
+		}
+		resyncStart = from;
+		resyncRestarted = true;
+		return resyncStart < resyncEnd;
+	}
+	size_t BaseSocket::parse(const uint8_t data[], size_t arraySize, bool& ret){
+		size_t i = 0;
+		while(i < arraySize){
+			// Bulk path. Once the header of a frame is known the number of
+			// payload bytes is known as well. Take the whole run at once
+			// instead of going through the state machine byte by byte.
+			if(flowSerialState == State::instructionReceived && argumentsRemaining > 0){
+				size_t run = arraySize - i;
+				if(run > argumentsRemaining){
+					run = argumentsRemaining;
+				}
+				argumentBuffer.set(&data[i], run);
+				checksum = integrityUpdate(checksum, &data[i], run);
+				argumentsRemaining -= run;
+				i += run;
+				#ifdef _DEBUG_FLOW_SERIAL_
+				cout << "argument bytes = " << argumentBuffer.getStored() << endl;
+				#endif
+				if(argumentsRemaining == 0){
+					flowSerialState = State::argumentsReceived;
+				}
+				continue;
+			}
+			uint8_t input = data[i++];
 			#ifdef _DEBUG_FLOW_SERIAL_
 			cout << "next byte in line is number : " << +input << endl;
 			#endif
@@ -49,55 +324,76 @@ namespace FlowSerial{
 						#ifdef _DEBUG_FLOW_SERIAL_
 						cout << "Start received" << endl;
 						#endif
-						checksum = 0xAA;
+						checksum = checksumAfterStart;
 						flowSerialState = State::startByteReceived;
+						argumentBuffer.clearAll();
+						trailerReceived = 0;
+						frameStart = &data[i - 1];
+						discarding = false;
+					}
+					else{
+						if(!discarding){
+							statistics.resyncs.add(1);
+							discarding = true;
+						}
+						statistics.bytesDiscarded.add(1);
 					}
 					break;
 				case State::startByteReceived:
-					flowSerialState = State::instructionReceived;
 					instruction = static_cast<Instruction>(input);
-					argumentBuffer.clearAll();
-					checksum += input;
+					if(headerArguments(instruction) == 0){
+						// Not an instruction this version knows.
+						statistics.framesDropped.add(1);
+						if(unknownInstructionHandler != nullptr){
+							unknownInstructionHandler(unknownInstructionContext, input);
+						}
+						if(resync(true, 0)){
+							return i;
+						}
+						break;
+					}
+					flowSerialState = State::instructionReceived;
+					argumentsRemaining = 0;
+					checksum = integrityUpdate(checksum, input);
 					#ifdef _DEBUG_FLOW_SERIAL_
 					cout << "instructionReceived" << endl;
 					#endif
 					break;
 				case State::instructionReceived:
+					// Only the header arguments arrive here. The payload is
+					// taken by the bulk path above.
 					argumentBuffer.set(&input, 1);
-					checksum += input;
+					checksum = integrityUpdate(checksum, input);
 					#ifdef _DEBUG_FLOW_SERIAL_
 					cout << "argument bytes = " << argumentBuffer.getStored() << endl;
 					#endif
-					switch(instruction){
-						case Instruction::read:
-							if(argumentBuffer.getStored() >= 2){
-								flowSerialState = State::argumentsReceived;
-							}
-							break;
-						case Instruction::write:
-							if(argumentBuffer.getStored() >= 2 && argumentBuffer.getStored() >= (argumentBuffer[1] + 2u)){
-								flowSerialState = State::argumentsReceived;
-							}
-							break;
-						case Instruction::returnRequestedData:
-							if(argumentBuffer.getStored() >= 1 && argumentBuffer.getStored() >= argumentBuffer[0] + 1u){
-								flowSerialState = State::argumentsReceived;
-							}
-							break;
+					if(argumentBuffer.getStored() >= headerArguments(instruction)){
+						headerReceived();
+						if(flowSerialState == State::idle && resync(true, 0)){
+							return i;
+						}
 					}
 					break;
 				case State::argumentsReceived:
+					// Every checksum byte but the last, least significant
+					// first. That is only the LSB for 16-bit checksums.
 					#ifdef _DEBUG_FLOW_SERIAL_
 					cout << "LSB received" << endl;
 					#endif
-					checksumReceived = input & 0xFF;
-					flowSerialState = State::lsbChecksumReceived;
+					if(trailerReceived == 0){
+						checksumReceived = 0;
+					}
+					checksumReceived |= static_cast<uint32_t>(input) << (8 * trailerReceived);
+					if(++trailerReceived == trailerSize - 1){
+						flowSerialState = State::lsbChecksumReceived;
+					}
 					break;
 				case State::lsbChecksumReceived:
 					#ifdef _DEBUG_FLOW_SERIAL_
 					cout << "MSB received" << endl;
 					#endif
-					checksumReceived |= (input << 8) & 0xFF00;
+					checksumReceived |= static_cast<uint32_t>(input) << (8 * trailerReceived);
+					++trailerReceived;
 					if(checksum == checksumReceived){
 						flowSerialState = State::checksumOk;
 						#ifdef _DEBUG_FLOW_SERIAL_
@@ -112,27 +408,35 @@ namespace FlowSerial{
 							"checksum:            " << checksum << '\n' <<
 							"!= checksumReceived: " << checksumReceived << endl;
 						#endif
-						flowSerialState = State::idle;
+						statistics.checksumFailures.add(1);
+						#ifndef ARDUINO
+						captureFrame(CaptureEvent::checksumFailure);
+						#endif
+						// Might have been an acknowledged write, ask for it.
+						negativePending |= reliableReceiving;
+						if(resync(true, trailerReceived)){
+							return i;
+						}
 						break;
 					}
 				case State::checksumOk:
-					uint8_t* ArgCopyPointer;
-					uint8_t* flowRegPointer;
 					switch(instruction){
 						case Instruction::read:
 							#ifdef _DEBUG_FLOW_SERIAL_
 							cout << "received Instruction::read request" << endl;
 							#endif
+							if(!inRegister(argumentBuffer[0], argumentBuffer[1])){
+								sendRangeError(Instruction::read, 0, argumentBuffer[0], argumentBuffer[1]);
+								break;
+							}
 							returnData(&FlowSerial::BaseSocket::flowRegister[argumentBuffer[0]], argumentBuffer[1]);
 							break;
 						case Instruction::write:
 							#ifdef _DEBUG_FLOW_SERIAL_
 							cout << "received Instruction::write request" << endl;
 							#endif
-							ArgCopyPointer = &argumentBuffer[2];
-							flowRegPointer = &flowRegister[argumentBuffer[0]];
-							for (unsigned int i = 0; i < argumentBuffer[1]; ++i){
-								flowRegPointer[i] = ArgCopyPointer[i];
+							if(!applyRemoteWrite(argumentBuffer[0], &argumentBuffer[2], argumentBuffer[1])){
+								sendRangeError(Instruction::write, 0, argumentBuffer[0], argumentBuffer[1]);
 							}
 							break;
 						case Instruction::returnRequestedData:
@@ -142,7 +446,117 @@ namespace FlowSerial{
 								cout << +argumentBuffer[i+1] << endl;
 							}
 							#endif
-							inputBuffer.set(&argumentBuffer[1], argumentBuffer[0]);
+							deliverReturnedData(&argumentBuffer[1], argumentBuffer[0]);
+							break;
+						case Instruction::readTagged:
+							#ifdef _DEBUG_FLOW_SERIAL_
+							cout << "received Instruction::readTagged request" << endl;
+							#endif
+							returnTaggedData(argumentBuffer[0], argumentBuffer[1], argumentBuffer[2]);
+							break;
+						case Instruction::returnTaggedData:
+							#ifdef _DEBUG_FLOW_SERIAL_
+							cout << "Got tagged data for tag " << +argumentBuffer[0] << endl;
+							#endif
+							completeTaggedRead(argumentBuffer[0], argumentBuffer[1], &argumentBuffer[3], argumentBuffer[2]);
+							break;
+						case Instruction::writeWide:
+							#ifdef _DEBUG_FLOW_SERIAL_
+							cout << "received Instruction::writeWide request" << endl;
+							#endif
+							if(!applyRemoteWrite(getUint32(&argumentBuffer[0]), &argumentBuffer[6], getUint16(&argumentBuffer[4]))){
+								sendRangeError(Instruction::writeWide, 0, getUint32(&argumentBuffer[0]), getUint16(&argumentBuffer[4]));
+							}
+							break;
+						case Instruction::readWide:
+							#ifdef _DEBUG_FLOW_SERIAL_
+							cout << "received Instruction::readWide request" << endl;
+							#endif
+							returnWideData(argumentBuffer[0], getUint32(&argumentBuffer[1]), getUint16(&argumentBuffer[5]));
+							break;
+						case Instruction::returnWideData:
+							#ifdef _DEBUG_FLOW_SERIAL_
+							cout << "Got wide data for tag " << +argumentBuffer[0] << endl;
+							#endif
+							completeTaggedRead(argumentBuffer[0], getUint32(&argumentBuffer[1]), &argumentBuffer[7], getUint16(&argumentBuffer[5]));
+							break;
+						case Instruction::subscribe:
+							#ifdef _DEBUG_FLOW_SERIAL_
+							cout << "received Instruction::subscribe request" << endl;
+							#endif
+							serveSubscription(argumentBuffer[0], getUint32(&argumentBuffer[1]), getUint16(&argumentBuffer[5]), getUint16(&argumentBuffer[7]), argumentBuffer[9] != 0);
+							break;
+						case Instruction::unsubscribe:
+							#ifdef _DEBUG_FLOW_SERIAL_
+							cout << "received Instruction::unsubscribe request" << endl;
+							#endif
+							endServedSubscription(argumentBuffer[0]);
+							break;
+						case Instruction::returnSubscribedData:
+							#ifdef _DEBUG_FLOW_SERIAL_
+							cout << "Got subscribed data for id " << +argumentBuffer[0] << endl;
+							#endif
+							completeSubscription(argumentBuffer[0], getUint32(&argumentBuffer[1]), &argumentBuffer[7], getUint16(&argumentBuffer[5]));
+							break;
+						case Instruction::writeReliable:
+							#ifdef _DEBUG_FLOW_SERIAL_
+							cout << "received Instruction::writeReliable request" << endl;
+							#endif
+							receiveReliableWrite(argumentBuffer[0], getUint16(&argumentBuffer[1]), getUint32(&argumentBuffer[3]), &argumentBuffer[9], getUint16(&argumentBuffer[7]));
+							break;
+						case Instruction::acknowledgeWrite:
+							#ifdef _DEBUG_FLOW_SERIAL_
+							cout << "received Instruction::acknowledgeWrite" << endl;
+							#endif
+							receiveAcknowledgement(argumentBuffer[0], getUint16(&argumentBuffer[1]), argumentBuffer[3] != 0);
+							break;
+						case Instruction::writeEncoded:
+							#ifdef _DEBUG_FLOW_SERIAL_
+							cout << "received Instruction::writeEncoded request" << endl;
+							#endif
+							receiveEncodedWrite(getUint32(&argumentBuffer[0]), getUint16(&argumentBuffer[4]), argumentBuffer[8], &argumentBuffer[9], getUint16(&argumentBuffer[6]));
+							break;
+						case Instruction::returnEncodedData:
+							#ifdef _DEBUG_FLOW_SERIAL_
+							cout << "Got encoded requested data" << endl;
+							#endif
+							receiveEncodedData(argumentBuffer[0], argumentBuffer[2], &argumentBuffer[3], argumentBuffer[1]);
+							break;
+						case Instruction::rangeError:
+							#ifdef _DEBUG_FLOW_SERIAL_
+							cout << "Got a range error for instruction " << +argumentBuffer[0] << endl;
+							#endif
+							receiveRangeError(static_cast<Instruction>(argumentBuffer[0]), argumentBuffer[1], getUint32(&argumentBuffer[2]), getUint16(&argumentBuffer[6]));
+							break;
+						case Instruction::capabilities:{
+							#ifdef _DEBUG_FLOW_SERIAL_
+							cout << "Got capabilities of protocol version " << +argumentBuffer[1] << endl;
+							#endif
+							Capabilities peer;
+							peer.version = argumentBuffer[1];
+							peer.wide = argumentBuffer[2] & 0x01;
+							peer.compression = argumentBuffer[2] & 0x02;
+							peer.integrities = argumentBuffer[3];
+							peer.maxPayload = getUint16(&argumentBuffer[4]);
+							// Every peer takes 255 byte payloads, the protocol
+							// minimum. Less would stall BaseSocket::write.
+							if(peer.maxPayload < 0xFF){
+								peer.maxPayload = 0xFF;
+							}
+							peer.baudRate = getUint32(&argumentBuffer[6]);
+							receiveCapabilities(static_cast<NegotiationPhase>(argumentBuffer[0] & 0x03), peer, getUint16(&argumentBuffer[10]) * 1000);
+							break;
+						}
+					}
+					if(static_cast<size_t>(instruction) < Statistics::instructionSlots){
+						statistics.framesReceived[static_cast<size_t>(instruction)].add(1);
+						statistics.bytesReceived[static_cast<size_t>(instruction)].add(2 + argumentBuffer.getStored() + trailerSize);
+					}
+					#ifndef ARDUINO
+					captureFrame(CaptureEvent::frameReceived);
+					#endif
+					if(handOffPool != nullptr){
+						handOffFrame();
 					}
 					flowSerialState = State::idle;
 					ret = true;
@@ -151,13 +565,636 @@ namespace FlowSerial{
 					flowSerialState = State::idle;
 			}
 		}
-		return ret;
+		return i;
 	}
 	void BaseSocket::sendReadRequest(uint8_t startAddress, size_t nBytes){
-		sendFlowMessage(startAddress, nullptr, nBytes, Instruction::read);
+		uint8_t arguments[] = {startAddress, static_cast<uint8_t>(nBytes)};
+		sendFlowMessage(Instruction::read, arguments, sizeof(arguments), nullptr, 0);
+	}
+	int BaseSocket::sendTaggedReadRequest(size_t startAddress, uint8_t returnData[], size_t size){
+		return startTaggedRead(startAddress, returnData, size, false, nullptr, nullptr);
+	}
+	int BaseSocket::readAsync(size_t startAddress, uint8_t returnData[], size_t size, ReadCallback callback, void* context){
+		return startTaggedRead(startAddress, returnData, size, true, callback, context);
+	}
+	ReadStatus BaseSocket::getReadStatus(uint8_t tag){
+		if(isReadPending(tag)){
+			return ReadStatus::pending;
+		}
+		// Slots are shared by tags readStatusSlots apart, only the most
+		// recent of them is remembered.
+		const FinishedRead& finished = readStatus[tag % readStatusSlots];
+		return finished.tag == tag ? finished.status : ReadStatus::cancelled;
+	}
+	void BaseSocket::setReadTimeout(uint32_t timeout, uint8_t retries){
+		readTimeout = timeout;
+		readRetries = retries;
+		if(!adaptiveTimeout || !rttMeasured){
+			retransmissionTimeout = timeout;
+		}
+	}
+	bool BaseSocket::setAdaptiveTimeout(bool enable, uint32_t iminTimeout, uint32_t imaxTimeout){
+		if(iminTimeout > imaxTimeout){
+			#ifdef ARDUINO
+			return false;
+			#else
+			throw invalid_argument("FlowSerial: minimum timeout above the maximum");
+			#endif
+		}
+		adaptiveTimeout = enable;
+		minTimeout = iminTimeout;
+		maxTimeout = imaxTimeout;
+		rttMeasured = false;
+		smoothedRtt = 0;
+		rttVariation = 0;
+		retransmissionTimeout = readTimeout;
+		return true;
 	}
-	void BaseSocket::write(uint8_t startAddress, const uint8_t data[], size_t size){
-		sendFlowMessage(startAddress, data, size, Instruction::write);
+	uint32_t BaseSocket::getReadTimeout() const{
+		return retransmissionTimeout;
+	}
+	uint32_t BaseSocket::getSmoothedRtt() const{
+		return smoothedRtt;
+	}
+	uint32_t BaseSocket::getRttVariation() const{
+		return rttVariation;
+	}
+	void BaseSocket::sampleRtt(uint64_t rtt){
+		if(!adaptiveTimeout){
+			return;
+		}
+		uint32_t sample = rtt > 0xFFFFFFFF ? 0xFFFFFFFF : static_cast<uint32_t>(rtt);
+		if(!rttMeasured){
+			smoothedRtt = sample;
+			rttVariation = sample / 2;
+			rttMeasured = true;
+		}
+		else{
+			// RFC 6298 with alpha 1/8 and beta 1/4.
+			uint32_t deviation = sample > smoothedRtt ? sample - smoothedRtt : smoothedRtt - sample;
+			rttVariation = rttVariation - rttVariation / 4 + deviation / 4;
+			smoothedRtt = smoothedRtt - smoothedRtt / 8 + sample / 8;
+		}
+		uint64_t timeout = static_cast<uint64_t>(smoothedRtt) + 4 * static_cast<uint64_t>(rttVariation);
+		if(timeout < minTimeout){
+			timeout = minTimeout;
+		}
+		if(timeout > maxTimeout){
+			timeout = maxTimeout;
+		}
+		retransmissionTimeout = static_cast<uint32_t>(timeout);
+	}
+	uint32_t BaseSocket::backOff(uint32_t timeout) const{
+		if(!adaptiveTimeout){
+			return readTimeout;
+		}
+		return timeout > maxTimeout / 2 ? maxTimeout : timeout * 2;
+	}
+	void BaseSocket::read(uint8_t startAddress, uint8_t returnData[], size_t size){
+		uint32_t timeout = retransmissionTimeout;
+		for (unsigned int attempt = 0; attempt <= readRetries; ++attempt){
+			clearReturnedData();
+			untaggedReadRejected = false;
+			sendReadRequest(startAddress, size);
+			flush();
+			uint64_t sentTime = currentMicros();
+			uint64_t elapsed = 0;
+			while(elapsed < timeout){
+				receiveFromInterface(static_cast<uint32_t>(timeout - elapsed));
+				if(returnDataSize() >= size){
+					countReadLatency(currentMicros() - sentTime);
+					if(attempt == 0){
+						sampleRtt(currentMicros() - sentTime);
+					}
+					getReturnedData(returnData, size);
+					lastReadStatus = ReadStatus::done;
+					return;
+				}
+				if(untaggedReadRejected){
+					lastReadStatus = ReadStatus::outOfRange;
+					#ifdef ARDUINO
+					return;
+					#else
+					throw out_of_range("FlowSerial: read outside the register of the peer");
+					#endif
+				}
+				update();
+				elapsed = currentMicros() - sentTime;
+			}
+			statistics.readRetries.add(attempt < readRetries);
+			timeout = backOff(timeout);
+		}
+		statistics.readTimeouts.add(1);
+		lastReadStatus = ReadStatus::timeout;
+		#ifndef ARDUINO
+		throw runtime_error("FlowSerial: read timed out");
+		#endif
+	}
+	ReadStatus BaseSocket::getLastReadStatus() const{
+		return lastReadStatus;
+	}
+	bool BaseSocket::isReadPending(uint8_t tag){
+		return findTaggedRead(tag) != nullptr;
+	}
+	void BaseSocket::cancelRead(uint8_t tag){
+		TaggedRead* read = findTaggedRead(tag);
+		if(read != nullptr){
+			read->pending = false;
+			readStatus[tag % readStatusSlots] = {tag, ReadStatus::cancelled};
+		}
+	}
+	size_t BaseSocket::pendingReads(){
+		size_t ret = 0;
+		for (size_t i = 0; i < maxTaggedReads; ++i){
+			ret += taggedReads[i].pending;
+		}
+		return ret;
+	}
+	void BaseSocket::write(size_t startAddress, const uint8_t data[], size_t size){
+		// Split in as few frames as the chosen instruction allows.
+		while(size > 0){
+			if(compression){
+				size_t sent = writeEncodedFrame(startAddress, data, size);
+				if(sent > 0){
+					startAddress += sent;
+					data += sent;
+					size -= sent;
+					continue;
+				}
+			}
+			bool wide = wideMode || startAddress > 0xFF;
+			// Outside wide mode the peer may only take 255 byte payloads,
+			// also in the wide frames needed for high addresses. A
+			// negotiation tells how much it takes.
+			size_t frameSize = wideMode ? maxWidePayload : 0xFF;
+			if(frameSize > peerMaxPayload){
+				frameSize = peerMaxPayload;
+			}
+			if(frameSize > maxFramePayload){
+				frameSize = maxFramePayload;
+			}
+			if(frameSize > size){
+				frameSize = size;
+			}
+			if(wide){
+				uint8_t arguments[6];
+				putUint32(&arguments[0], static_cast<uint32_t>(startAddress));
+				putUint16(&arguments[4], static_cast<uint16_t>(frameSize));
+				sendFlowMessage(Instruction::writeWide, arguments, sizeof(arguments), data, frameSize);
+			}
+			else{
+				uint8_t arguments[] = {static_cast<uint8_t>(startAddress), static_cast<uint8_t>(frameSize)};
+				sendFlowMessage(Instruction::write, arguments, sizeof(arguments), data, frameSize);
+			}
+			startAddress += frameSize;
+			data += frameSize;
+			size -= frameSize;
+		}
+	}
+	bool BaseSocket::writeReliable(size_t startAddress, const uint8_t data[], size_t size){
+		size_t frameSize = FLOW_SERIAL_RELIABLE_PAYLOAD;
+		if(frameSize > peerMaxPayload){
+			frameSize = peerMaxPayload;
+		}
+		if(frameSize > maxFramePayload){
+			frameSize = maxFramePayload;
+		}
+		if((size + frameSize - 1) / frameSize > reliableWindow - reliableCount){
+			return false;
+		}
+		uint64_t now = currentMicros();
+		if(!sessionStarted){
+			// A restarted sender must not reuse the session id the peer
+			// still remembers, so the first one comes from the clock.
+			session = sessionSeeded ? session + 1 : static_cast<uint8_t>(now ^ (now >> 8));
+			sessionSeeded = true;
+			nextSequence = 0;
+			sessionStarted = true;
+		}
+		if(reliableCount == 0){
+			reliableSentTime = now;
+			reliableRetriesLeft = readRetries;
+		}
+		while(size > 0){
+			ReliableFrame& frame = reliableFrames[(reliableHead + reliableCount) % reliableSlots];
+			frame.sequence = nextSequence;
+			frame.startAddress = startAddress;
+			frame.size = size < frameSize ? size : frameSize;
+			memcpy(frame.data, data, frame.size);
+			// Only counted once sent, so a failing interface leaves the
+			// window as it was.
+			sendReliableFrame(frame);
+			++nextSequence;
+			++reliableCount;
+			startAddress += frame.size;
+			data += frame.size;
+			size -= frame.size;
+		}
+		return true;
+	}
+	size_t BaseSocket::unacknowledgedWrites() const{
+		return reliableCount;
+	}
+	void BaseSocket::sendReliableFrame(const ReliableFrame& frame){
+		uint8_t arguments[9];
+		arguments[0] = session;
+		putUint16(&arguments[1], frame.sequence);
+		putUint32(&arguments[3], frame.startAddress);
+		putUint16(&arguments[7], frame.size);
+		sendFlowMessage(Instruction::writeReliable, arguments, sizeof(arguments), frame.data, frame.size);
+	}
+	void BaseSocket::retransmitWrites(uint64_t now){
+		// The peer only takes frames in order, so everything after the
+		// first missing one has to go again.
+		for (size_t i = 0; i < reliableCount; ++i){
+			sendReliableFrame(reliableFrames[(reliableHead + i) % reliableSlots]);
+		}
+		statistics.writeRetransmits.add(reliableCount);
+		reliableSentTime = now;
+	}
+	void BaseSocket::receiveReliableWrite(uint8_t senderSession, uint16_t sequence, uint32_t startAddress, const uint8_t data[], size_t size){
+		if(!reliableReceiving || senderSession != receiverSession){
+			// The sender started over.
+			reliableReceiving = true;
+			receiverSession = senderSession;
+			expectedSequence = 0;
+		}
+		int16_t distance = static_cast<int16_t>(sequence - expectedSequence);
+		if(distance == 0){
+			// Still acknowledged, sending it again would not help.
+			if(!applyRemoteWrite(startAddress, data, size)){
+				sendRangeError(Instruction::writeReliable, 0, startAddress, size);
+			}
+			++expectedSequence;
+			acknowledgePending = true;
+		}
+		else if(distance < 0){
+			// Retransmission of a frame already applied. The acknowledgement
+			// was probably lost.
+			acknowledgePending = true;
+		}
+		else{
+			// A frame before this one is missing.
+			negativePending = true;
+		}
+	}
+	void BaseSocket::receiveAcknowledgement(uint8_t senderSession, uint16_t next, bool negative){
+		if(!sessionStarted || senderSession != session || reliableCount == 0){
+			return;
+		}
+		// Only acknowledgements inside the window are believed.
+		uint16_t acknowledged = next - reliableFrames[reliableHead].sequence;
+		if(acknowledged > reliableCount){
+			return;
+		}
+		reliableHead = (reliableHead + acknowledged) % reliableSlots;
+		reliableCount -= acknowledged;
+		uint64_t now = currentMicros();
+		if(acknowledged > 0){
+			reliableSentTime = now;
+			reliableRetriesLeft = readRetries;
+		}
+		if(negative && reliableCount > 0){
+			retransmitWrites(now);
+		}
+	}
+	size_t BaseSocket::writeEncodedFrame(size_t startAddress, const uint8_t data[], size_t size){
+		const size_t headerSize = 9;
+		// An encoded frame has to beat the plain write frames of the same
+		// data. The checksum is left out, it is the same for both.
+		uint8_t encoded[maxPayload < 0xFF ? maxPayload : 0xFF];
+		size_t consumed;
+		size_t encodedSize = runLengthEncode(data, size < maxWidePayload ? size : maxWidePayload, encoded, sizeof(encoded), consumed);
+		bool wide = wideMode || startAddress > 0xFF;
+		size_t plainFrames = wideMode ? 1 : (consumed + 0xFE) / 0xFF;
+		size_t plainCost = consumed + plainFrames * (wide ? 2 + 6 : 2 + 2);
+		if(consumed == 0 || 2 + headerSize + encodedSize >= plainCost){
+			return 0;
+		}
+		uint8_t arguments[headerSize];
+		putUint32(&arguments[0], startAddress);
+		putUint16(&arguments[4], consumed);
+		putUint16(&arguments[6], encodedSize);
+		arguments[8] = static_cast<uint8_t>(PayloadCodec::runLength);
+		sendFlowMessage(Instruction::writeEncoded, arguments, sizeof(arguments), encoded, encodedSize);
+		return consumed;
+	}
+	void BaseSocket::setCompression(bool enable){
+		compression = enable;
+	}
+	void BaseSocket::receiveEncodedWrite(uint32_t startAddress, size_t decodedSize, uint8_t codec, const uint8_t data[], size_t size){
+		if(codec != static_cast<uint8_t>(PayloadCodec::runLength) || runLengthDecodedSize(data, size) != decodedSize){
+			statistics.framesDropped.add(1);
+			return;
+		}
+		if(!inRegister(startAddress, decodedSize)){
+			sendRangeError(Instruction::writeEncoded, 0, startAddress, decodedSize);
+			return;
+		}
+		beginRemoteWrite(startAddress, decodedSize);
+		runLengthDecode(data, size, &flowRegister[startAddress], decodedSize);
+		endRemoteWrite(startAddress, decodedSize);
+	}
+	void BaseSocket::receiveEncodedData(size_t decodedSize, uint8_t codec, const uint8_t data[], size_t size){
+		if(codec != static_cast<uint8_t>(PayloadCodec::runLength) || runLengthDecodedSize(data, size) != decodedSize){
+			statistics.framesDropped.add(1);
+			return;
+		}
+		uint8_t decoded[0xFF];
+		runLengthDecode(data, size, decoded, decodedSize);
+		deliverReturnedData(decoded, decodedSize);
+	}
+	void BaseSocket::setWideMode(bool enable){
+		wideMode = enable;
+	}
+	void BaseSocket::setChangeTracking(uint8_t ilocalChanges[], uint8_t iremoteChanges[], size_t granule){
+		granuleShift = 0;
+		while((static_cast<size_t>(1) << granuleShift) < granule){
+			++granuleShift;
+		}
+		localChanges = ilocalChanges;
+		remoteChanges = iremoteChanges;
+		size_t bitmapSize = changeBitmapSize(registerLength, static_cast<size_t>(1) << granuleShift);
+		if(localChanges != nullptr){
+			memset(localChanges, 0, bitmapSize);
+		}
+		if(remoteChanges != nullptr){
+			memset(remoteChanges, 0, bitmapSize);
+		}
+	}
+	void BaseSocket::trackedWrite(size_t startAddress, const uint8_t data[], size_t size){
+		memcpy(&flowRegister[startAddress], data, size);
+		markChanged(localChanges, startAddress, size);
+		notifySubscriptions(startAddress, size);
+	}
+	void BaseSocket::markDirty(size_t startAddress, size_t size){
+		markChanged(localChanges, startAddress, size);
+		notifySubscriptions(startAddress, size);
+	}
+	size_t BaseSocket::sync(){
+		if(localChanges == nullptr){
+			return 0;
+		}
+		// Clean runs shorter than the overhead of a frame are sent along
+		// with their neighbours instead of starting a new frame.
+		const size_t frameOverhead = 6;
+		size_t frames = 0;
+		size_t runStart = 0;
+		size_t runEnd = 0;
+		bool inRun = false;
+		size_t granule;
+		size_t address = 0;
+		while(popChange(localChanges, address, runEnd, granule)){
+			if(inRun && address - runEnd <= frameOverhead){
+				runEnd = address + granule;
+				continue;
+			}
+			if(inRun){
+				write(runStart, &flowRegister[runStart], runEnd - runStart);
+				++frames;
+			}
+			inRun = true;
+			runStart = address;
+			runEnd = address + granule;
+		}
+		if(inRun){
+			write(runStart, &flowRegister[runStart], runEnd - runStart);
+			++frames;
+		}
+		return frames;
+	}
+	bool BaseSocket::isRemotelyChanged(size_t startAddress, size_t size){
+		if(remoteChanges == nullptr || size == 0){
+			return false;
+		}
+		size_t first = startAddress >> granuleShift;
+		size_t last = (startAddress + size - 1) >> granuleShift;
+		for (size_t granule = first; granule <= last; ++granule){
+			if(remoteChanges[granule / 8] & (1 << (granule % 8))){
+				return true;
+			}
+		}
+		return false;
+	}
+	bool BaseSocket::popRemoteChange(size_t& startAddress, size_t& size){
+		if(remoteChanges == nullptr){
+			return false;
+		}
+		if(!popChange(remoteChanges, startAddress, 0, size)){
+			return false;
+		}
+		// Extend the run while the following granules changed as well.
+		size_t next;
+		size_t granule;
+		while(popChange(remoteChanges, next, startAddress + size, granule)){
+			if(next != startAddress + size){
+				// Not adjacent. Put it back for the next call.
+				markChanged(remoteChanges, next, granule);
+				break;
+			}
+			size += granule;
+		}
+		return true;
+	}
+	void BaseSocket::clearRemoteChanges(){
+		if(remoteChanges != nullptr){
+			memset(remoteChanges, 0, changeBitmapSize(registerLength, static_cast<size_t>(1) << granuleShift));
+		}
+	}
+	void BaseSocket::serveSubscription(uint8_t id, uint32_t startAddress, uint16_t size, uint16_t period, bool onChange){
+		if(size == 0 || startAddress + static_cast<size_t>(size) > registerLength){
+			return;
+		}
+		ServedSubscription* slot = nullptr;
+		for (size_t i = 0; i < maxSubscriptions; ++i){
+			ServedSubscription& subscription = servedSubscriptions[i];
+			if(subscription.active && subscription.id == id){
+				slot = &subscription;
+				break;
+			}
+			if(!subscription.active && slot == nullptr){
+				slot = &subscription;
+			}
+		}
+		if(slot == nullptr){
+			return;
+		}
+		slot->active = true;
+		slot->id = id;
+		slot->startAddress = startAddress;
+		slot->size = size;
+		slot->onChange = onChange;
+		slot->period = static_cast<uint32_t>(period) * 1000;
+		// The first push goes out at the next update.
+		slot->changed = true;
+		slot->lastSent = currentMicros() - slot->period;
+	}
+	void BaseSocket::endServedSubscription(uint8_t id){
+		for (size_t i = 0; i < maxSubscriptions; ++i){
+			if(servedSubscriptions[i].id == id){
+				servedSubscriptions[i].active = false;
+			}
+		}
+	}
+	void BaseSocket::completeSubscription(uint8_t id, uint32_t startAddress, const uint8_t data[], size_t size){
+		if(id >= maxSubscriptions){
+			return;
+		}
+		HeldSubscription& subscription = heldSubscriptions[id];
+		if(!subscription.active || subscription.startAddress != startAddress || subscription.size != size){
+			return;
+		}
+		memcpy(subscription.destination, data, size);
+		if(subscription.callback != nullptr){
+			subscription.callback(subscription.context, id, ReadStatus::done);
+		}
+	}
+	void BaseSocket::notifySubscriptions(size_t startAddress, size_t size){
+		for (size_t i = 0; i < maxSubscriptions; ++i){
+			ServedSubscription& subscription = servedSubscriptions[i];
+			if(subscription.active && startAddress < subscription.startAddress + static_cast<size_t>(subscription.size)
+				&& subscription.startAddress < startAddress + size){
+				subscription.changed = true;
+			}
+		}
+	}
+	void BaseSocket::pushSubscriptions(uint64_t now){
+		for (size_t i = 0; i < maxSubscriptions; ++i){
+			ServedSubscription& subscription = servedSubscriptions[i];
+			if(!subscription.active || (subscription.onChange && !subscription.changed)
+				|| now - subscription.lastSent < subscription.period){
+				continue;
+			}
+			subscription.changed = false;
+			subscription.lastSent = now;
+			uint8_t arguments[7];
+			arguments[0] = subscription.id;
+			putUint32(&arguments[1], subscription.startAddress);
+			putUint16(&arguments[5], subscription.size);
+			sendFlowMessage(Instruction::returnSubscribedData, arguments, sizeof(arguments), &flowRegister[subscription.startAddress], subscription.size);
+		}
+	}
+	void BaseSocket::markChanged(uint8_t bitmap[], size_t startAddress, size_t size){
+		if(bitmap == nullptr || size == 0){
+			return;
+		}
+		size_t first = startAddress >> granuleShift;
+		size_t last = (startAddress + size - 1) >> granuleShift;
+		for (size_t granule = first; granule <= last; ++granule){
+			bitmap[granule / 8] |= 1 << (granule % 8);
+		}
+	}
+	bool BaseSocket::popChange(uint8_t bitmap[], size_t& startAddress, size_t from, size_t& size){
+		size_t granules = (registerLength + (static_cast<size_t>(1) << granuleShift) - 1) >> granuleShift;
+		size_t granule = (from + (static_cast<size_t>(1) << granuleShift) - 1) >> granuleShift;
+		while(granule < granules){
+			uint8_t bits = bitmap[granule / 8] >> (granule % 8);
+			if(bits == 0){
+				// Skip the rest of this byte of the bitmap at once.
+				granule = (granule / 8 + 1) * 8;
+				continue;
+			}
+			while((bits & 1) == 0){
+				bits >>= 1;
+				++granule;
+			}
+			bitmap[granule / 8] &= ~(1 << (granule % 8));
+			startAddress = granule << granuleShift;
+			size = static_cast<size_t>(1) << granuleShift;
+			if(startAddress + size > registerLength){
+				size = registerLength - startAddress;
+			}
+			return true;
+		}
+		return false;
+	}
+	Statistics BaseSocket::getStatistics() const{
+		Statistics ret;
+		for (size_t i = 0; i < Statistics::instructionSlots; ++i){
+			ret.framesReceived[i] = statistics.framesReceived[i].get();
+			ret.bytesReceived[i] = statistics.bytesReceived[i].get();
+			ret.framesSent[i] = statistics.framesSent[i].get();
+			ret.bytesSent[i] = statistics.bytesSent[i].get();
+		}
+		ret.checksumFailures = statistics.checksumFailures.get();
+		ret.framesDropped = statistics.framesDropped.get();
+		ret.resyncs = statistics.resyncs.get();
+		ret.bytesDiscarded = statistics.bytesDiscarded.get();
+		ret.frameTimeouts = statistics.frameTimeouts.get();
+		ret.returnBufferOverflows = statistics.returnBufferOverflows.get();
+		ret.readRetries = statistics.readRetries.get();
+		ret.readTimeouts = statistics.readTimeouts.get();
+		ret.writeRetransmits = statistics.writeRetransmits.get();
+		ret.writeFailures = statistics.writeFailures.get();
+		ret.framesHandedOff = statistics.framesHandedOff.get();
+		ret.handOffDrops = statistics.handOffDrops.get();
+		ret.rangeErrorsSent = statistics.rangeErrorsSent.get();
+		ret.rangeErrorsReceived = statistics.rangeErrorsReceived.get();
+		for (size_t i = 0; i < Statistics::latencyBuckets; ++i){
+			ret.readLatency[i] = statistics.readLatency[i].get();
+		}
+		const size_t bulk = static_cast<size_t>(TxLane::bulk);
+		const size_t control = static_cast<size_t>(TxLane::control);
+		ret.laneFramesSent[bulk] = statistics.laneFramesSent[bulk].get();
+		ret.laneBytesSent[bulk] = statistics.laneBytesSent[bulk].get();
+		ret.laneFramesSent[control] = 0;
+		ret.laneBytesSent[control] = 0;
+		for (size_t i = 0; i < Statistics::instructionSlots; ++i){
+			ret.laneFramesSent[control] += ret.framesSent[i];
+			ret.laneBytesSent[control] += ret.bytesSent[i];
+		}
+		ret.laneFramesSent[control] -= ret.laneFramesSent[bulk];
+		ret.laneBytesSent[control] -= ret.laneBytesSent[bulk];
+		for (size_t i = 0; i < Statistics::txLanes; ++i){
+			ret.laneQueuedBytes[i] = statistics.laneQueuedBytes[i].get();
+			for (size_t j = 0; j < Statistics::latencyBuckets; ++j){
+				ret.laneLatency[i][j] = statistics.laneLatency[i][j].get();
+			}
+		}
+		return ret;
+	}
+	void BaseSocket::resetStatistics(){
+		for (size_t i = 0; i < Statistics::instructionSlots; ++i){
+			statistics.framesReceived[i].reset();
+			statistics.bytesReceived[i].reset();
+			statistics.framesSent[i].reset();
+			statistics.bytesSent[i].reset();
+		}
+		statistics.checksumFailures.reset();
+		statistics.framesDropped.reset();
+		statistics.resyncs.reset();
+		statistics.bytesDiscarded.reset();
+		statistics.frameTimeouts.reset();
+		statistics.returnBufferOverflows.reset();
+		statistics.readRetries.reset();
+		statistics.readTimeouts.reset();
+		statistics.writeRetransmits.reset();
+		statistics.writeFailures.reset();
+		statistics.framesHandedOff.reset();
+		statistics.handOffDrops.reset();
+		statistics.rangeErrorsSent.reset();
+		statistics.rangeErrorsReceived.reset();
+		for (size_t i = 0; i < Statistics::latencyBuckets; ++i){
+			statistics.readLatency[i].reset();
+		}
+		for (size_t i = 0; i < Statistics::txLanes; ++i){
+			statistics.laneFramesSent[i].reset();
+			statistics.laneBytesSent[i].reset();
+			for (size_t j = 0; j < Statistics::latencyBuckets; ++j){
+				statistics.laneLatency[i][j].reset();
+			}
+		}
+	}
+	void BaseSocket::countReadLatency(uint64_t latency){
+		countLatency(statistics.readLatency, latency, 1);
+	}
+	void BaseSocket::countLatency(StatisticCounter buckets[], uint64_t latency, uint32_t frames){
+		size_t bucket = 0;
+		while(latency > 1 && bucket < Statistics::latencyBuckets - 1){
+			latency >>= 1;
+			++bucket;
+		}
+		buckets[bucket].add(frames);
 	}
 	size_t BaseSocket::returnDataSize(){
 		size_t ret = inputBuffer.getStored();
@@ -170,33 +1207,761 @@ namespace FlowSerial{
 		size_t ret = inputBuffer.get(dataReturn, size);
 		return ret;
 	}
+	void BaseSocket::setBatching(bool enable, size_t iflushThreshold, uint32_t iflushDeadline){
+		batching = enable;
+		flushThreshold = iflushThreshold;
+		flushDeadline = iflushDeadline;
+		if(!batching){
+			flush();
+		}
+	}
+	void BaseSocket::flush(){
+		if(txStored == 0){
+			return;
+		}
+		IoVector vector = {txBuffer, txStored};
+		countLatency(statistics.laneLatency[static_cast<size_t>(TxLane::control)], currentMicros() - txOldestFrameTime, txFrames);
+		txStored = 0;
+		txFrames = 0;
+		statistics.laneQueuedBytes[static_cast<size_t>(TxLane::control)].set(0);
+		writeVectorToInterface(&vector, 1);
+	}
+	void BaseSocket::update(){
+		uint64_t now = currentMicros();
+		for (size_t i = 0; i < maxTaggedReads; ++i){
+			TaggedRead& read = taggedReads[i];
+			if(!read.pending || !read.timed || now - read.sentTime < read.timeout){
+				continue;
+			}
+			if(read.retriesLeft > 0){
+				--read.retriesLeft;
+				read.sentTime = now;
+				read.timeout = backOff(read.timeout);
+				statistics.readRetries.add(1);
+				sendTaggedRead(read);
+			}
+			else{
+				statistics.readTimeouts.add(1);
+				finishTaggedRead(read, ReadStatus::timeout);
+			}
+		}
+		if(negotiationStatus == ReadStatus::pending && now - negotiationSentTime >= negotiationTimeout){
+			if(negotiationRetriesLeft > 0){
+				--negotiationRetriesLeft;
+				negotiationTimeout = backOff(negotiationTimeout);
+				sendCapabilities(negotiationConfirming ? NegotiationPhase::confirm : NegotiationPhase::offer);
+			}
+			else{
+				if(negotiationConfirming){
+					applySettings(baselineSettings);
+				}
+				finishNegotiation(ReadStatus::timeout);
+			}
+		}
+		if(awaitingConfirmation && now - confirmationStart >= confirmationWindow){
+			#ifdef _DEBUG_FLOW_SERIAL_
+			cout << "no confirmation of the negotiation, going back" << endl;
+			#endif
+			awaitingConfirmation = false;
+			applySettings(baselineSettings);
+		}
+		pushSubscriptions(now);
+		if(reliableCount > 0 && now - reliableSentTime >= retransmissionTimeout){
+			if(reliableRetriesLeft > 0){
+				--reliableRetriesLeft;
+				retransmitWrites(now);
+			}
+			else{
+				statistics.writeFailures.add(reliableCount);
+				reliableCount = 0;
+				sessionStarted = false;
+			}
+		}
+		if(txStored > 0 && flushDeadline > 0 && now - txOldestFrameTime >= flushDeadline){
+			flush();
+		}
+		if(bulkCount > 0){
+			sendBulk(now);
+		}
+	}
+	bool BaseSocket::writeBulk(size_t startAddress, const uint8_t data[], size_t size){
+		if(bulkCount == bulkQueue){
+			return false;
+		}
+		if(size == 0){
+			return true;
+		}
+		BulkTransfer& transfer = bulkTransfers[(bulkHead + bulkCount) % bulkQueue];
+		transfer.startAddress = startAddress;
+		transfer.data = data;
+		transfer.size = size;
+		transfer.queuedTime = currentMicros();
+		++bulkCount;
+		bulkBytes += size;
+		statistics.laneQueuedBytes[static_cast<size_t>(TxLane::bulk)].set(bulkBytes);
+		return true;
+	}
+	void BaseSocket::setFrameHandOff(FramePool* pool){
+		handOffPool = pool;
+	}
+	void BaseSocket::handOffFrame(){
+		#ifdef ARDUINO
+		size_t head = handOffHead;
+		bool full = head - handOffTail == handOffQueue;
+		#else
+		size_t head = handOffHead.load(memory_order_relaxed);
+		bool full = head - handOffTail.load(memory_order_acquire) == handOffQueue;
+		#endif
+		size_t size = argumentBuffer.getStored();
+		PooledFrame* frame = full || size > handOffPool->frameCapacity() ? nullptr : handOffPool->acquire();
+		if(frame == nullptr){
+			statistics.handOffDrops.add(1);
+			return;
+		}
+		frame->instruction = instruction;
+		frame->size = size;
+		memcpy(frame->data(), &argumentBuffer[0], size);
+		handOffFrames[head % handOffQueue] = frame;
+		#ifdef ARDUINO
+		handOffHead = head + 1;
+		#else
+		handOffHead.store(head + 1, memory_order_release);
+		#endif
+		statistics.framesHandedOff.add(1);
+	}
+	PooledFrame* BaseSocket::takeFrame(){
+		#ifdef ARDUINO
+		size_t tail = handOffTail;
+		if(tail == handOffHead){
+			return nullptr;
+		}
+		PooledFrame* frame = handOffFrames[tail % handOffQueue];
+		handOffTail = tail + 1;
+		#else
+		size_t tail = handOffTail.load(memory_order_relaxed);
+		if(tail == handOffHead.load(memory_order_acquire)){
+			return nullptr;
+		}
+		PooledFrame* frame = handOffFrames[tail % handOffQueue];
+		handOffTail.store(tail + 1, memory_order_release);
+		#endif
+		return frame;
+	}
+	void BaseSocket::setBulkBudget(size_t bytesPerUpdate, size_t chunkSize){
+		bulkBudget = bytesPerUpdate;
+		bulkChunk = chunkSize == 0 || chunkSize > 0xFF ? 0xFF : chunkSize;
+	}
+	size_t BaseSocket::pendingBulkBytes() const{
+		return bulkBytes;
+	}
+	void BaseSocket::sendBulk(uint64_t now){
+		// Control frames that wait for a batch go first. Bulk chunks skip
+		// the batching buffer, so nothing sent later queues behind them.
+		flush();
+		bool wasBatching = batching;
+		batching = false;
+		lane = TxLane::bulk;
+		size_t budget = bulkBudget;
+		do{
+			BulkTransfer& transfer = bulkTransfers[bulkHead];
+			size_t chunk = transfer.size < bulkChunk ? transfer.size : bulkChunk;
+			write(transfer.startAddress, transfer.data, chunk);
+			countLatency(statistics.laneLatency[static_cast<size_t>(TxLane::bulk)], now - transfer.queuedTime, 1);
+			transfer.startAddress += chunk;
+			transfer.data += chunk;
+			transfer.size -= chunk;
+			bulkBytes -= chunk;
+			budget = chunk < budget ? budget - chunk : 0;
+			if(transfer.size == 0){
+				bulkHead = (bulkHead + 1) % bulkQueue;
+				--bulkCount;
+			}
+		} while(budget > 0 && bulkCount > 0);
+		lane = TxLane::control;
+		batching = wasBatching;
+		statistics.laneQueuedBytes[static_cast<size_t>(TxLane::bulk)].set(bulkBytes);
+	}
+	int BaseSocket::subscribe(size_t startAddress, uint8_t destination[], size_t size, uint16_t period, bool onChange, ReadCallback callback, void* context){
+		if(size == 0 || size > maxPayload || startAddress > 0xFFFFFFFF){
+			return -1;
+		}
+		for (size_t id = 0; id < maxSubscriptions; ++id){
+			HeldSubscription& subscription = heldSubscriptions[id];
+			if(subscription.active){
+				continue;
+			}
+			subscription.active = true;
+			subscription.startAddress = startAddress;
+			subscription.size = size;
+			subscription.destination = destination;
+			subscription.callback = callback;
+			subscription.context = context;
+			uint8_t arguments[10];
+			arguments[0] = id;
+			putUint32(&arguments[1], startAddress);
+			putUint16(&arguments[5], size);
+			putUint16(&arguments[7], period);
+			arguments[9] = onChange;
+			sendFlowMessage(Instruction::subscribe, arguments, sizeof(arguments), nullptr, 0);
+			return id;
+		}
+		return -1;
+	}
+	void BaseSocket::unsubscribe(uint8_t id){
+		if(id >= maxSubscriptions || !heldSubscriptions[id].active){
+			return;
+		}
+		heldSubscriptions[id].active = false;
+		uint8_t arguments[] = {id};
+		sendFlowMessage(Instruction::unsubscribe, arguments, sizeof(arguments), nullptr, 0);
+	}
+	uint64_t BaseSocket::currentMicros(){
+		#ifdef ARDUINO
+		return micros();
+		#else
+		return chrono::duration_cast<chrono::microseconds>(
+			chrono::steady_clock::now().time_since_epoch()).count();
+		#endif
+	}
+	bool BaseSocket::applyRemoteWrite(size_t startAddress, const uint8_t data[], size_t size){
+		if(!inRegister(startAddress, size)){
+			return false;
+		}
+		beginRemoteWrite(startAddress, size);
+		memcpy(&flowRegister[startAddress], data, size);
+		endRemoteWrite(startAddress, size);
+		return true;
+	}
+	void BaseSocket::sendRangeError(Instruction rejected, uint8_t tag, size_t startAddress, size_t size){
+		#ifdef _DEBUG_FLOW_SERIAL_
+		cout << "request outside the register: " << startAddress << " + " << size << endl;
+		#endif
+		statistics.rangeErrorsSent.add(1);
+		uint8_t arguments[8];
+		arguments[0] = static_cast<uint8_t>(rejected);
+		arguments[1] = tag;
+		putUint32(&arguments[2], static_cast<uint32_t>(startAddress));
+		putUint16(&arguments[6], static_cast<uint16_t>(size));
+		sendFlowMessage(Instruction::rangeError, arguments, sizeof(arguments), nullptr, 0);
+	}
+	void BaseSocket::receiveRangeError(Instruction rejected, uint8_t tag, uint32_t startAddress, uint16_t size){
+		statistics.rangeErrorsReceived.add(1);
+		switch(rejected){
+			case Instruction::read:
+				untaggedReadRejected = true;
+				break;
+			case Instruction::readTagged:
+			case Instruction::readWide:{
+				TaggedRead* read = findTaggedRead(tag);
+				if(read != nullptr && read->startAddress == startAddress && read->size == size){
+					finishTaggedRead(*read, ReadStatus::outOfRange);
+				}
+				break;
+			}
+			default:
+				break;
+		}
+	}
+	void BaseSocket::beginRemoteWrite(size_t startAddress, size_t size){
+		#ifndef ARDUINO
+		if(snapshotSequences != nullptr && size > 0){
+			// Odd sequence: readers of these regions retry.
+			size_t firstRegion = startAddress / snapshotRegionSize;
+			size_t lastRegion = (startAddress + size - 1) / snapshotRegionSize;
+			for (size_t i = firstRegion; i <= lastRegion; ++i){
+				snapshotSequences[i].store(snapshotSequences[i].load(memory_order_relaxed) + 1, memory_order_relaxed);
+			}
+			atomic_thread_fence(memory_order_release);
+		}
+		#endif
+	}
+	void BaseSocket::endRemoteWrite(size_t startAddress, size_t size){
+		#ifndef ARDUINO
+		if(snapshotSequences != nullptr && size > 0){
+			size_t firstRegion = startAddress / snapshotRegionSize;
+			size_t lastRegion = (startAddress + size - 1) / snapshotRegionSize;
+			for (size_t i = firstRegion; i <= lastRegion; ++i){
+				snapshotSequences[i].store(snapshotSequences[i].load(memory_order_relaxed) + 1, memory_order_release);
+			}
+			if(snapshotGeneration != nullptr){
+				snapshotGeneration->fetch_add(1, memory_order_release);
+			}
+		}
+		#endif
+		markChanged(remoteChanges, startAddress, size);
+		notifySubscriptions(startAddress, size);
+		remoteWriteApplied(startAddress, size);
+		if(remoteWriteHandler != nullptr){
+			remoteWriteHandler(remoteWriteContext, startAddress, &flowRegister[startAddress], size);
+		}
+	}
+	#ifndef ARDUINO
+	void BaseSocket::setSnapshotRegions(atomic<uint32_t> sequences[], size_t regionSize, atomic<uint32_t>* generation){
+		snapshotSequences = sequences;
+		snapshotRegionSize = regionSize;
+		snapshotGeneration = generation;
+		if(snapshotSequences != nullptr){
+			for (size_t i = 0; i < snapshotRegionCount(registerLength, regionSize); ++i){
+				snapshotSequences[i].store(0, memory_order_relaxed);
+			}
+		}
+	}
+	void BaseSocket::readSnapshot(size_t startAddress, uint8_t out[], size_t size){
+		if(snapshotSequences == nullptr){
+			memcpy(out, &flowRegister[startAddress], size);
+			return;
+		}
+		seqlockRead(snapshotSequences, snapshotRegionSize, flowRegister, startAddress, out, size);
+	}
+	void seqlockRead(const atomic<uint32_t> sequences[], size_t regionSize, const uint8_t data[], size_t startAddress, uint8_t out[], size_t size){
+		if(size == 0){
+			return;
+		}
+		size_t firstRegion = startAddress / regionSize;
+		size_t lastRegion = (startAddress + size - 1) / regionSize;
+		// Sequences only grow, so an unchanged sum means no region changed.
+		while(true){
+			uint64_t before = 0;
+			bool writing = false;
+			for (size_t i = firstRegion; i <= lastRegion; ++i){
+				uint32_t sequence = sequences[i].load(memory_order_acquire);
+				writing |= (sequence & 1) != 0;
+				before += sequence;
+			}
+			if(writing){
+				this_thread::yield();
+				continue;
+			}
+			memcpy(out, &data[startAddress], size);
+			atomic_thread_fence(memory_order_acquire);
+			uint64_t after = 0;
+			for (size_t i = firstRegion; i <= lastRegion; ++i){
+				after += sequences[i].load(memory_order_relaxed);
+			}
+			if(after == before){
+				return;
+			}
+		}
+	}
+	#endif
+	void BaseSocket::deliverReturnedData(const uint8_t data[], size_t size){
+		if(returnedDataHandler != nullptr){
+			returnedDataHandler(returnedDataContext, -1, 0, data, size);
+		}
+		else if(!storeReturnedData(data, size)){
+			statistics.returnBufferOverflows.add(1);
+		}
+	}
+	void BaseSocket::setRemoteWriteHandler(RemoteWriteHandler handler, void* context){
+		remoteWriteHandler = handler;
+		remoteWriteContext = context;
+	}
+	void BaseSocket::setReturnedDataHandler(ReturnedDataHandler handler, void* context){
+		returnedDataHandler = handler;
+		returnedDataContext = context;
+	}
+	void BaseSocket::setUnknownInstructionHandler(UnknownInstructionHandler handler, void* context){
+		unknownInstructionHandler = handler;
+		unknownInstructionContext = context;
+	}
+	void BaseSocket::setCapabilities(const Capabilities& capabilities){
+		localCapabilities = capabilities;
+	}
+	bool BaseSocket::negotiate(NegotiationCallback callback, void* context){
+		if(negotiationStatus == ReadStatus::pending){
+			return false;
+		}
+		negotiationStatus = ReadStatus::pending;
+		negotiationCallback = callback;
+		negotiationContext = context;
+		negotiationConfirming = false;
+		negotiationRetriesLeft = readRetries;
+		negotiationTimeout = retransmissionTimeout;
+		sendCapabilities(NegotiationPhase::offer);
+		return true;
+	}
+	ReadStatus BaseSocket::getNegotiationStatus() const{
+		return negotiationStatus;
+	}
+	const Capabilities& BaseSocket::getAgreedCapabilities() const{
+		return agreedCapabilities;
+	}
+	void BaseSocket::sendCapabilities(NegotiationPhase phase){
+		uint8_t arguments[12];
+		arguments[0] = static_cast<uint8_t>(phase);
+		arguments[1] = localCapabilities.version;
+		arguments[2] = localCapabilities.wide | localCapabilities.compression << 1;
+		arguments[3] = localCapabilities.integrities;
+		putUint16(&arguments[4], localCapabilities.maxPayload);
+		putUint32(&arguments[6], interfaceRate() > 0 ? localCapabilities.baudRate : 0);
+		// How long the peer waits for the confirmation: every try of it,
+		// in milliseconds.
+		uint64_t commitWindow = 0;
+		uint32_t timeout = retransmissionTimeout;
+		for (uint8_t i = 0; i <= readRetries; ++i){
+			commitWindow += timeout;
+			timeout = backOff(timeout);
+		}
+		commitWindow = (commitWindow + 999) / 1000;
+		putUint16(&arguments[10], commitWindow > 0xFFFF ? 0xFFFF : commitWindow);
+		negotiationSentTime = currentMicros();
+		sendFlowMessage(Instruction::capabilities, arguments, sizeof(arguments), nullptr, 0);
+	}
+	void BaseSocket::receiveCapabilities(NegotiationPhase phase, const Capabilities& peer, uint32_t commitWindow){
+		switch(phase){
+			case NegotiationPhase::offer:{
+				if(awaitingConfirmation){
+					// The peer started over, it never switched.
+					awaitingConfirmation = false;
+					applySettings(baselineSettings);
+				}
+				agreementCommitted = false;
+				baselineSettings = currentSettings();
+				switchedCapabilities = agreeWith(peer);
+				sendCapabilities(NegotiationPhase::answer);
+				if(!applySettings(settingsFor(switchedCapabilities, peer.maxPayload))){
+					// The peer gets no confirmation through and goes back.
+					applySettings(baselineSettings);
+					return;
+				}
+				awaitingConfirmation = true;
+				confirmationStart = currentMicros();
+				confirmationWindow = static_cast<uint64_t>(commitWindow) + retransmissionTimeout;
+				break;
+			}
+			case NegotiationPhase::answer:{
+				if(negotiationStatus != ReadStatus::pending || negotiationConfirming){
+					// Late or repeated answer.
+					return;
+				}
+				if(negotiationRetriesLeft == readRetries){
+					sampleRtt(currentMicros() - negotiationSentTime);
+				}
+				baselineSettings = currentSettings();
+				switchedCapabilities = agreeWith(peer);
+				if(!applySettings(settingsFor(switchedCapabilities, peer.maxPayload))){
+					// Without a confirmation the peer goes back as well.
+					applySettings(baselineSettings);
+					finishNegotiation(ReadStatus::cancelled);
+					return;
+				}
+				negotiationConfirming = true;
+				negotiationRetriesLeft = readRetries;
+				negotiationTimeout = retransmissionTimeout;
+				sendCapabilities(NegotiationPhase::confirm);
+				break;
+			}
+			case NegotiationPhase::confirm:
+				if(awaitingConfirmation){
+					awaitingConfirmation = false;
+					agreementCommitted = true;
+					agreedCapabilities = switchedCapabilities;
+				}
+				// Repeated when the commit got lost.
+				if(agreementCommitted){
+					sendCapabilities(NegotiationPhase::commit);
+				}
+				break;
+			case NegotiationPhase::commit:
+				if(negotiationStatus == ReadStatus::pending && negotiationConfirming){
+					negotiationConfirming = false;
+					agreedCapabilities = switchedCapabilities;
+					finishNegotiation(ReadStatus::done);
+				}
+				break;
+		}
+	}
+	Capabilities BaseSocket::agreeWith(const Capabilities& peer) const{
+		// Both sides come to the same result, it only depends on the pair.
+		const Capabilities& local = localCapabilities;
+		Capabilities agreed;
+		agreed.version = local.version < peer.version ? local.version : peer.version;
+		agreed.wide = local.wide && peer.wide && agreed.version >= 3;
+		agreed.compression = local.compression && peer.compression && agreed.version >= 6;
+		agreed.integrities = local.integrities & peer.integrities;
+		agreed.maxPayload = local.maxPayload < peer.maxPayload ? local.maxPayload : peer.maxPayload;
+		agreed.baudRate = 0;
+		if(interfaceRate() > 0 && local.baudRate > 0 && peer.baudRate > 0){
+			agreed.baudRate = local.baudRate < peer.baudRate ? local.baudRate : peer.baudRate;
+		}
+		return agreed;
+	}
+	BaseSocket::LinkSettings BaseSocket::settingsFor(const Capabilities& agreed, size_t peerMax) const{
+		LinkSettings settings;
+		// Strongest check sum both know, additive when they share none.
+		for (uint8_t i = 0; i <= static_cast<uint8_t>(Integrity::crc32c); ++i){
+			if(agreed.integrities & (1 << i)){
+				settings.integrity = static_cast<Integrity>(i);
+			}
+		}
+		settings.wide = agreed.wide;
+		settings.compression = agreed.compression;
+		settings.peerMaxPayload = peerMax;
+		settings.baudRate = agreed.baudRate > 0 ? agreed.baudRate : interfaceRate();
+		return settings;
+	}
+	BaseSocket::LinkSettings BaseSocket::currentSettings() const{
+		LinkSettings settings;
+		settings.integrity = integrity;
+		settings.wide = wideMode;
+		settings.compression = compression;
+		settings.peerMaxPayload = peerMaxPayload;
+		settings.baudRate = interfaceRate();
+		return settings;
+	}
+	bool BaseSocket::applySettings(const LinkSettings& settings){
+		// Frames sent so far go out with the old settings, they have to be
+		// on the line before anything changes.
+		flush();
+		setIntegrity(settings.integrity);
+		wideMode = settings.wide;
+		compression = settings.compression;
+		peerMaxPayload = settings.peerMaxPayload;
+		#ifdef _DEBUG_FLOW_SERIAL_
+		cout << "switching to integrity " << +static_cast<uint8_t>(settings.integrity) << ", wide " << settings.wide << ", compression " << settings.compression << ", baud rate " << settings.baudRate << endl;
+		#endif
+		if(settings.baudRate > 0 && settings.baudRate != interfaceRate()){
+			return changeInterfaceRate(settings.baudRate);
+		}
+		return true;
+	}
+	void BaseSocket::finishNegotiation(ReadStatus status){
+		negotiationStatus = status;
+		if(negotiationCallback != nullptr){
+			negotiationCallback(negotiationContext, negotiationStatus, agreedCapabilities);
+		}
+	}
+	bool BaseSocket::storeReturnedData(const uint8_t data[], size_t size){
+		bool fits = FLOW_SERIAL_RETURN_BUFFER_SIZE - inputBuffer.getStored() >= size;
+		inputBuffer.set(data, size);
+		return fits;
+	}
+	void BaseSocket::remoteWriteApplied(size_t startAddress, size_t size){}
+	bool BaseSocket::changeInterfaceRate(uint32_t baudRate){
+		return false;
+	}
+	uint32_t BaseSocket::interfaceRate() const{
+		return 0;
+	}
+	void BaseSocket::receiveFromInterface(uint32_t timeout){
+		#ifndef ARDUINO
+		throw logic_error("FlowSerial: receiveFromInterface is not implemented by this socket");
+		#endif
+	}
 	void BaseSocket::returnData(const uint8_t data[], size_t arraySize){
-		sendFlowMessage(0, data, arraySize, Instruction::returnRequestedData);
+		if(compression && arraySize > 3){
+			// Worth it when it saves more than the two extra arguments.
+			uint8_t encoded[0xFF];
+			size_t consumed;
+			size_t encodedSize = runLengthEncode(data, arraySize, encoded, arraySize - 3, consumed);
+			if(consumed == arraySize){
+				uint8_t arguments[] = {static_cast<uint8_t>(arraySize), static_cast<uint8_t>(encodedSize), static_cast<uint8_t>(PayloadCodec::runLength)};
+				sendFlowMessage(Instruction::returnEncodedData, arguments, sizeof(arguments), encoded, encodedSize);
+				return;
+			}
+		}
+		uint8_t arguments[] = {static_cast<uint8_t>(arraySize)};
+		sendFlowMessage(Instruction::returnRequestedData, arguments, sizeof(arguments), data, arraySize);
 	}
 	void BaseSocket::returnData(uint8_t data){
-		sendFlowMessage(0, &data, 1, Instruction::returnRequestedData);
+		returnData(&data, 1);
+	}
+	void BaseSocket::returnTaggedData(uint8_t tag, uint8_t startAddress, uint8_t size){
+		if(!inRegister(startAddress, size)){
+			sendRangeError(Instruction::readTagged, tag, startAddress, size);
+			return;
+		}
+		uint8_t arguments[] = {tag, startAddress, size};
+		sendFlowMessage(Instruction::returnTaggedData, arguments, sizeof(arguments), &flowRegister[startAddress], size);
+	}
+	void BaseSocket::returnWideData(uint8_t tag, uint32_t startAddress, uint16_t size){
+		if(!inRegister(startAddress, size)){
+			sendRangeError(Instruction::readWide, tag, startAddress, size);
+			return;
+		}
+		uint8_t arguments[7];
+		arguments[0] = tag;
+		putUint32(&arguments[1], startAddress);
+		putUint16(&arguments[5], size);
+		sendFlowMessage(Instruction::returnWideData, arguments, sizeof(arguments), &flowRegister[startAddress], size);
+	}
+	BaseSocket::TaggedRead* BaseSocket::findTaggedRead(uint8_t tag){
+		for (size_t i = 0; i < maxTaggedReads; ++i){
+			if(taggedReads[i].pending && taggedReads[i].tag == tag){
+				return &taggedReads[i];
+			}
+		}
+		return nullptr;
+	}
+	void BaseSocket::completeTaggedRead(uint8_t tag, uint32_t startAddress, const uint8_t data[], size_t size){
+		TaggedRead* read = findTaggedRead(tag);
+		// Drop replies that do not answer the request they claim to, e.g.
+		// a late reply of a cancelled read whose tag got reused.
+		if(read == nullptr || read->startAddress != startAddress || read->size != size){
+			return;
+		}
+		memcpy(read->returnData, data, size);
+		countReadLatency(currentMicros() - read->sentTime);
+		if(read->retriesLeft == readRetries){
+			sampleRtt(currentMicros() - read->sentTime);
+		}
+		if(returnedDataHandler != nullptr){
+			returnedDataHandler(returnedDataContext, tag, startAddress, data, size);
+		}
+		finishTaggedRead(*read, ReadStatus::done);
+	}
+	int BaseSocket::startTaggedRead(size_t startAddress, uint8_t returnData[], size_t size, bool timed, ReadCallback callback, void* context){
+		// The reply has to fit in one frame.
+		if(size > maxPayload || size > maxWidePayload){
+			return -1;
+		}
+		TaggedRead* slot = nullptr;
+		for (size_t i = 0; i < maxTaggedReads; ++i){
+			if(!taggedReads[i].pending){
+				slot = &taggedReads[i];
+				break;
+			}
+		}
+		if(slot == nullptr){
+			return -1;
+		}
+		// Skip tags that are still in flight so replies stay unambiguous.
+		while(isReadPending(nextTag)){
+			++nextTag;
+		}
+		slot->pending = true;
+		slot->tag = nextTag++;
+		slot->startAddress = static_cast<uint32_t>(startAddress);
+		slot->size = static_cast<uint16_t>(size);
+		slot->wide = wideMode || startAddress > 0xFF || size > 0xFF;
+		slot->returnData = returnData;
+		slot->timed = timed;
+		slot->retriesLeft = readRetries;
+		slot->timeout = retransmissionTimeout;
+		slot->callback = callback;
+		slot->context = context;
+		slot->sentTime = currentMicros();
+		sendTaggedRead(*slot);
+		return slot->tag;
+	}
+	void BaseSocket::sendTaggedRead(const TaggedRead& read){
+		if(read.wide){
+			uint8_t arguments[7];
+			arguments[0] = read.tag;
+			putUint32(&arguments[1], read.startAddress);
+			putUint16(&arguments[5], read.size);
+			sendFlowMessage(Instruction::readWide, arguments, sizeof(arguments), nullptr, 0);
+		}
+		else{
+			uint8_t arguments[] = {read.tag, static_cast<uint8_t>(read.startAddress), static_cast<uint8_t>(read.size)};
+			sendFlowMessage(Instruction::readTagged, arguments, sizeof(arguments), nullptr, 0);
+		}
+	}
+	void BaseSocket::finishTaggedRead(TaggedRead& read, ReadStatus status){
+		// Free the slot first so the callback can start new reads.
+		read.pending = false;
+		readStatus[read.tag % readStatusSlots] = {read.tag, status};
+		if(read.callback != nullptr){
+			read.callback(read.context, read.tag, status);
+		}
+	}
+
+	void BaseSocket::writeVectorToInterface(const IoVector vectors[], size_t count){
+		if(count == 1){
+			writeToInterface(vectors[0].data, vectors[0].size);
+			return;
+		}
+		// Flatten the frame so the interface still gets it in one call.
+		// Frames that do not fit go out in full chunks of flat, in order.
+		uint8_t flat[maxFlatFrameSize];
+		size_t flatSize = 0;
+		for (size_t i = 0; i < count; ++i){
+			const uint8_t* data = vectors[i].data;
+			size_t size = vectors[i].size;
+			while(size > 0){
+				size_t part = sizeof(flat) - flatSize < size ? sizeof(flat) - flatSize : size;
+				memcpy(&flat[flatSize], data, part);
+				flatSize += part;
+				data += part;
+				size -= part;
+				if(flatSize == sizeof(flat)){
+					writeToInterface(flat, flatSize);
+					flatSize = 0;
+				}
+			}
+		}
+		if(flatSize > 0){
+			writeToInterface(flat, flatSize);
+		}
+	}
+
+	void BaseSocket::sendFlowMessage(Instruction instruction, const uint8_t arguments[], size_t argumentsSize, const uint8_t data[], size_t dataSize){
+		uint8_t header[2 + maxHeaderArguments];
+		size_t headerSize = 0;
+		header[headerSize++] = 0xAA;
+		header[headerSize++] = static_cast<uint8_t>(instruction);
+		memcpy(&header[headerSize], arguments, argumentsSize);
+		headerSize += argumentsSize;
+		uint32_t checksum = integrityUpdate(checksumAfterStart, &header[1], headerSize - 1);
+		// The payload is sent straight from the caller's buffer or the
+		// register. Only the header and trailer are built here.
+		IoVector vectors[3];
+		size_t count = 0;
+		vectors[count++] = {header, headerSize};
+		if(data != nullptr && dataSize > 0){
+			checksum = integrityUpdate(checksum, data, dataSize);
+			vectors[count++] = {data, dataSize};
+		}
+		uint8_t trailer[4];
+		putUint32(trailer, checksum);
+		vectors[count++] = {trailer, trailerSize};
+		if(static_cast<size_t>(instruction) < Statistics::instructionSlots){
+			statistics.framesSent[static_cast<size_t>(instruction)].add(1);
+			statistics.bytesSent[static_cast<size_t>(instruction)].add(headerSize + dataSize + trailerSize);
+		}
+		#ifndef ARDUINO
+		if(captureSink != nullptr){
+			captureSink->capture(CaptureEvent::frameSent, instruction, currentMicros(), vectors, count);
+		}
+		#endif
+		sendFrame(vectors, count);
 	}
 
-	void BaseSocket::sendFlowMessage(uint8_t startAddress, const uint8_t data[], size_t arraySize, Instruction instruction){
-		uint16_t checksum = 0xAA + static_cast<char>(instruction);
-		size_t outIndex = 0;
-		uint8_t charOut[1024];
-		charOut[outIndex++] = 0xAA;
-		charOut[outIndex++] = static_cast<uint8_t>(instruction);
-		if(instruction == Instruction::write || instruction == Instruction::read){
-			charOut[outIndex++] = startAddress;
-			checksum += startAddress;
-		}
-		charOut[outIndex++] = static_cast<uint8_t>(arraySize);
-		checksum += static_cast<uint8_t>(arraySize);
-		if(data != NULL){
-			for (unsigned int i = 0; i < arraySize; ++i){
-				charOut[outIndex++] = data[i];
-				checksum += data[i];
-			}
-		}
-		charOut[outIndex++] = checksum & 0xFF;
-		charOut[outIndex++] = checksum >> 8;
-		writeToInterface(charOut, outIndex);
+	void BaseSocket::sendFrame(const IoVector vectors[], size_t count){
+		size_t frameSize = 0;
+		for (size_t i = 0; i < count; ++i){
+			frameSize += vectors[i].size;
+		}
+		// Control frames are all the others, see getStatistics.
+		if(lane == TxLane::bulk){
+			statistics.laneFramesSent[static_cast<size_t>(TxLane::bulk)].add(1);
+			statistics.laneBytesSent[static_cast<size_t>(TxLane::bulk)].add(frameSize);
+		}
+		if(!batching){
+			writeVectorToInterface(vectors, count);
+			return;
+		}
+		if(txStored + frameSize > txBufferSize){
+			flush();
+			if(frameSize > txBufferSize){
+				// Does not fit at all. Keep the order and send it on its own.
+				writeVectorToInterface(vectors, count);
+				return;
+			}
+		}
+		if(txStored == 0){
+			txOldestFrameTime = currentMicros();
+		}
+		++txFrames;
+		for (size_t i = 0; i < count; ++i){
+			if(vectors[i].size > 0){
+				memcpy(&txBuffer[txStored], vectors[i].data, vectors[i].size);
+				txStored += vectors[i].size;
+			}
+		}
+		statistics.laneQueuedBytes[static_cast<size_t>(TxLane::control)].set(txStored);
+		if(txStored >= flushThreshold){
+			flush();
+		}
 	}
 }
@@ -24,9 +24,160 @@
 #include <stdint.h>
 #include <CircularBuffer>
 #include <LinearBuffer>
+#ifndef ARDUINO
+#include <atomic>
+#endif
 
 using namespace std;
 
+#ifndef FLOW_SERIAL_MAX_PAYLOAD
+/**
+ * Largest payload a received frame may carry. Frames with a bigger payload
+ * are dropped. Raise this, up to 65535, to receive long frames of the wide
+ * instructions. See FlowSerial::BaseSocket::setWideMode.
+ */
+#define FLOW_SERIAL_MAX_PAYLOAD 255
+#endif
+
+#ifndef FLOW_SERIAL_RETURN_BUFFER_SIZE
+/**
+ * Capacity of the returned data buffer of untagged reads. See
+ * FlowSerial::BaseSocket::getReturnedData.
+ */
+#define FLOW_SERIAL_RETURN_BUFFER_SIZE 256
+#endif
+
+/*
+ * The sizes below are storage inside every BaseSocket, allocated whether the
+ * feature is used or not. The defaults on Arduino keep a socket small and
+ * leave out batching, acknowledged writes and resync. Define them before
+ * including this header to change them.
+ */
+
+#ifndef FLOW_SERIAL_TX_BUFFER_SIZE
+/**
+ * Size of the outgoing buffer that frames are coalesced in when batching is
+ * enabled. 0 sends every frame on its own. See
+ * FlowSerial::BaseSocket::setBatching.
+ */
+#ifdef ARDUINO
+#define FLOW_SERIAL_TX_BUFFER_SIZE 0
+#else
+#define FLOW_SERIAL_TX_BUFFER_SIZE 1024
+#endif
+#endif
+
+#ifndef FLOW_SERIAL_MAX_TAGGED_READS
+/**
+ * Number of tagged reads that can be in flight at the same time. See
+ * FlowSerial::BaseSocket::sendTaggedReadRequest.
+ */
+#ifdef ARDUINO
+#define FLOW_SERIAL_MAX_TAGGED_READS 4
+#else
+#define FLOW_SERIAL_MAX_TAGGED_READS 16
+#endif
+#endif
+
+#ifndef FLOW_SERIAL_READ_STATUS_SLOTS
+/**
+ * Number of finished tagged reads whose status is remembered, those of the
+ * most recent tags. A power of two up to 256. See
+ * FlowSerial::BaseSocket::getReadStatus.
+ */
+#ifdef ARDUINO
+#define FLOW_SERIAL_READ_STATUS_SLOTS 8
+#else
+#define FLOW_SERIAL_READ_STATUS_SLOTS 64
+#endif
+#endif
+
+#ifndef FLOW_SERIAL_RELIABLE_WINDOW
+/**
+ * Number of acknowledged write frames that may be unacknowledged at the same
+ * time. Each holds a copy of up to FLOW_SERIAL_RELIABLE_PAYLOAD bytes. 0
+ * leaves out the sending side of acknowledged writes. See
+ * FlowSerial::BaseSocket::writeReliable.
+ */
+#ifdef ARDUINO
+#define FLOW_SERIAL_RELIABLE_WINDOW 0
+#else
+#define FLOW_SERIAL_RELIABLE_WINDOW 8
+#endif
+#endif
+
+#ifndef FLOW_SERIAL_RELIABLE_PAYLOAD
+/**
+ * Largest payload of an acknowledged write frame, up to 255. Longer writes
+ * take more frames of the window. See FlowSerial::BaseSocket::writeReliable.
+ */
+#ifdef ARDUINO
+#define FLOW_SERIAL_RELIABLE_PAYLOAD 32
+#else
+#define FLOW_SERIAL_RELIABLE_PAYLOAD 255
+#endif
+#endif
+
+#ifndef FLOW_SERIAL_RESYNC
+/**
+ * 1 to keep the buffer that the bytes of a broken frame are scanned again
+ * from, 0 to leave resync out. See FlowSerial::BaseSocket::setResync.
+ */
+#ifdef ARDUINO
+#define FLOW_SERIAL_RESYNC 0
+#else
+#define FLOW_SERIAL_RESYNC 1
+#endif
+#endif
+
+#ifndef FLOW_SERIAL_LATENCY_BUCKETS
+/**
+ * Number of buckets of each latency histogram of the statistics, bucket n
+ * counting 2^n microseconds. See FlowSerial::BaseSocket::getStatistics.
+ */
+#ifdef ARDUINO
+#define FLOW_SERIAL_LATENCY_BUCKETS 16
+#else
+#define FLOW_SERIAL_LATENCY_BUCKETS 32
+#endif
+#endif
+
+#ifndef FLOW_SERIAL_MAX_SUBSCRIPTIONS
+/**
+ * Number of subscriptions a socket serves to its peer and, separately, holds
+ * at its peer. See FlowSerial::BaseSocket::subscribe.
+ */
+#ifdef ARDUINO
+#define FLOW_SERIAL_MAX_SUBSCRIPTIONS 2
+#else
+#define FLOW_SERIAL_MAX_SUBSCRIPTIONS 8
+#endif
+#endif
+
+#ifndef FLOW_SERIAL_BULK_QUEUE
+/**
+ * Number of bulk transfers that can wait at the same time. See
+ * FlowSerial::BaseSocket::writeBulk.
+ */
+#ifdef ARDUINO
+#define FLOW_SERIAL_BULK_QUEUE 2
+#else
+#define FLOW_SERIAL_BULK_QUEUE 4
+#endif
+#endif
+
+#ifndef FLOW_SERIAL_HANDOFF_QUEUE
+/**
+ * Number of received frames that can wait to be taken. Must be a power of
+ * two. See FlowSerial::BaseSocket::setFrameHandOff.
+ */
+#ifdef ARDUINO
+#define FLOW_SERIAL_HANDOFF_QUEUE 4
+#else
+#define FLOW_SERIAL_HANDOFF_QUEUE 16
+#endif
+#endif
+
 namespace FlowSerial{
 
 	enum class State{
@@ -38,18 +189,335 @@ namespace FlowSerial{
 		msbChecksumReceived,
 		checksumOk
 	};
+	/**
+	 * Version of the FlowSerial protocol implemented by this library. Version
+	 * 1 knows read, write and returnRequestedData. Version 2 adds the tagged
+	 * read instructions. Version 3 adds the wide instructions with 32-bit
+	 * addresses and 16-bit lengths. Version 4 adds subscriptions. Version 5
+	 * adds acknowledged writes. Version 6 adds run length encoded writes and
+	 * replies. Version 7 adds rangeError, the reply to requests outside the
+	 * register. Version 8 adds the capability exchange. Only send these to
+	 * peers that implement them.
+	 */
+	const uint8_t protocolVersion = 8;
 	enum class Instruction{
 		read,
 		write,
-		returnRequestedData
+		returnRequestedData,
+		readTagged,
+		returnTaggedData,
+		writeWide,
+		readWide,
+		returnWideData,
+		subscribe,
+		unsubscribe,
+		returnSubscribedData,
+		writeReliable,
+		acknowledgeWrite,
+		writeEncoded,
+		returnEncodedData,
+		rangeError,
+		capabilities
 	};
 	
+	/**
+	 * @brief      Points to a contiguous block of bytes that is part of an
+	 *             outgoing frame.
+	 */
+	struct IoVector{
+		const uint8_t* data;
+		size_t size;
+	};
+
+	#ifndef ARDUINO
+	/**
+	 * @brief      What a FlowSerial::CaptureSink is told about.
+	 */
+	enum class CaptureEvent : uint8_t{
+		// Bytes given to BaseSocket::handleData, exactly as they arrived.
+		bytesReceived,
+		// Header and payload of a frame with a good check sum.
+		frameReceived,
+		// Header and payload of a frame with a bad check sum.
+		checksumFailure,
+		// A complete outgoing frame.
+		frameSent
+	};
+	/**
+	 * @brief      Receives every frame and byte a socket handles, see
+	 *             BaseSocket::setCapture and CaptureRing.
+	 */
+	class CaptureSink{
+	public:
+		virtual ~CaptureSink(){}
+		/**
+		 * @brief      Called from the thread that handles or sends the data.
+		 *             Must be quick and must not call back into the socket.
+		 *
+		 * @param[in]  event        What happened.
+		 * @param[in]  instruction  Instruction of the frame, read for
+		 *                          CaptureEvent::bytesReceived.
+		 * @param[in]  micros       BaseSocket::currentMicros of the socket.
+		 * @param[in]  vectors      The bytes, in order.
+		 * @param[in]  count        Number of vectors.
+		 */
+		virtual void capture(CaptureEvent event, Instruction instruction, uint64_t micros, const IoVector vectors[], size_t count) = 0;
+	};
+	#endif
+
+	/**
+	 * @brief      Check sum at the end of every frame. See
+	 *             FlowSerial::BaseSocket::setIntegrity.
+	 */
+	enum class Integrity : uint8_t{
+		// Sum of all bytes modulo 2^16, the original FlowSerial checksum.
+		additive,
+		// CRC-16-CCITT, 2 bytes.
+		crc16,
+		// CRC-32C, 4 bytes.
+		crc32c
+	};
+
+	enum class ReadStatus : uint8_t{
+		pending,
+		done,
+		timeout,
+		cancelled,
+		// The peer answered with Instruction::rangeError.
+		outOfRange
+	};
+	/**
+	 * Called when a read started with FlowSerial::BaseSocket::readAsync
+	 * finished.
+	 *
+	 * @param      context  The context given to readAsync.
+	 * @param[in]  tag      Tag of the read.
+	 * @param[in]  status   ReadStatus::done when the data has been copied into
+	 *                      the array of the read, ReadStatus::outOfRange when
+	 *                      the peer rejected it, ReadStatus::timeout otherwise.
+	 */
+	typedef void (*ReadCallback)(void* context, uint8_t tag, ReadStatus status);
+	/**
+	 * Called from FlowSerial::BaseSocket::handleData after the peer wrote
+	 * into the register.
+	 *
+	 * @param      context       The context given with the handler.
+	 * @param[in]  startAddress  Start of the region that was written.
+	 * @param[in]  data          The region in the register, already updated.
+	 * @param[in]  size          Size of the region.
+	 */
+	typedef void (*RemoteWriteHandler)(void* context, size_t startAddress, const uint8_t data[], size_t size);
+	/**
+	 * Called from FlowSerial::BaseSocket::handleData for data returned by
+	 * the peer. data points into the frame that is being handled and is only
+	 * valid during the call.
+	 *
+	 * @param      context       The context given with the handler.
+	 * @param[in]  tag           Tag of the read, or -1 for replies to
+	 *                           BaseSocket::sendReadRequest.
+	 * @param[in]  startAddress  Start address of the read. 0 when the tag is
+	 *                           -1, untagged replies do not carry it.
+	 * @param[in]  data          The returned data.
+	 * @param[in]  size          Number of bytes.
+	 */
+	typedef void (*ReturnedDataHandler)(void* context, int tag, size_t startAddress, const uint8_t data[], size_t size);
+	/**
+	 * Called from FlowSerial::BaseSocket::handleData when a frame starts with
+	 * an instruction this version does not know. The frame is then dropped,
+	 * its length is unknown.
+	 *
+	 * @param      context      The context given with the handler.
+	 * @param[in]  instruction  The instruction byte.
+	 */
+	typedef void (*UnknownInstructionHandler)(void* context, uint8_t instruction);
+
+	/**
+	 * @brief      What a side of the link supports, exchanged by
+	 *             FlowSerial::BaseSocket::negotiate.
+	 */
+	struct Capabilities{
+		uint8_t version = protocolVersion;
+		// Wide instructions, see BaseSocket::setWideMode.
+		bool wide = true;
+		// Run length encoded frames, see BaseSocket::setCompression.
+		bool compression = true;
+		// One bit per FlowSerial::Integrity, additive is bit 0.
+		uint8_t integrities = 0x07;
+		// Largest payload this side receives, its FLOW_SERIAL_MAX_PAYLOAD.
+		uint16_t maxPayload = FLOW_SERIAL_MAX_PAYLOAD > 0xFFFF ? 0xFFFF : FLOW_SERIAL_MAX_PAYLOAD;
+		// Fastest baud rate this side can switch to, 0 to keep the current.
+		// Only offered by sockets that report their rate, see
+		// BaseSocket::interfaceRate.
+		uint32_t baudRate = 0;
+	};
+	/**
+	 * Called when a negotiation started with
+	 * FlowSerial::BaseSocket::negotiate finished.
+	 *
+	 * @param      context  The context given to negotiate.
+	 * @param[in]  status   ReadStatus::done when the peer committed and the
+	 *                      agreed settings are in use, ReadStatus::timeout
+	 *                      when it did not answer or commit, e.g. because it
+	 *                      is older than protocol version 8,
+	 *                      ReadStatus::cancelled when this side could not
+	 *                      switch. Nothing is changed unless done.
+	 * @param[in]  agreed   The settings both sides now use.
+	 */
+	typedef void (*NegotiationCallback)(void* context, ReadStatus status, const Capabilities& agreed);
+
+	/**
+	 * @brief      Priority class of outgoing frames. See
+	 *             FlowSerial::BaseSocket::writeBulk.
+	 */
+	enum class TxLane : uint8_t{
+		// Everything sent right away: writes, reads, replies.
+		control,
+		// Chunks of BaseSocket::writeBulk, sent by BaseSocket::update.
+		bulk
+	};
+
+	/**
+	 * @brief      Counter that may be read from another thread while it is
+	 *             being updated.
+	 */
+	class StatisticCounter{
+	public:
+		void add(uint32_t n){
+			#ifdef ARDUINO
+			value += n;
+			#else
+			value.fetch_add(n, memory_order_relaxed);
+			#endif
+		}
+		uint32_t get() const{
+			#ifdef ARDUINO
+			return value;
+			#else
+			return value.load(memory_order_relaxed);
+			#endif
+		}
+		void set(uint32_t n){
+			#ifdef ARDUINO
+			value = n;
+			#else
+			value.store(n, memory_order_relaxed);
+			#endif
+		}
+		void reset(){
+			#ifdef ARDUINO
+			value = 0;
+			#else
+			value.store(0, memory_order_relaxed);
+			#endif
+		}
+	private:
+		#ifdef ARDUINO
+		volatile uint32_t value = 0;
+		#else
+		atomic<uint32_t> value{0};
+		#endif
+	};
+
+	/**
+	 * @brief      Counters of a BaseSocket. See BaseSocket::getStatistics.
+	 * @details    Per instruction counters are indexed by the value of the
+	 *             instruction. Byte counts include the start byte, the
+	 *             instruction, the arguments and the checksum.
+	 *
+	 * @tparam     T     uint32_t for a snapshot, StatisticCounter inside the
+	 *                   socket.
+	 */
+	template<typename T>
+	struct BasicStatistics{
+		static const size_t instructionSlots = 32;
+		/**
+		 * Bucket n counts read round trips of 2^n up to 2^(n+1)
+		 * microseconds. Bucket 0 also holds everything below 1 µs, the
+		 * last bucket everything above.
+		 */
+		static const size_t latencyBuckets = FLOW_SERIAL_LATENCY_BUCKETS;
+		static_assert(latencyBuckets > 0, "FlowSerial: FLOW_SERIAL_LATENCY_BUCKETS must be at least 1");
+		static const size_t txLanes = 2;
+		T framesReceived[instructionSlots];
+		T bytesReceived[instructionSlots];
+		T framesSent[instructionSlots];
+		T bytesSent[instructionSlots];
+		// Frames that arrived completely but failed the checksum.
+		T checksumFailures;
+		// Frames dropped because of an unknown instruction or a payload
+		// that does not fit in the argument buffer.
+		T framesDropped;
+		// Times the parser had to skip bytes to find the next start byte.
+		T resyncs;
+		// Bytes skipped while looking for a start byte.
+		T bytesDiscarded;
+		// Partial frames aborted by the inter-byte timeout.
+		T frameTimeouts;
+		// Returned data that did not fit in the returned data buffer.
+		T returnBufferOverflows;
+		T readRetries;
+		T readTimeouts;
+		// Acknowledged write frames sent again.
+		T writeRetransmits;
+		// Acknowledged write frames given up on after all retries.
+		T writeFailures;
+		// Received frames queued for BaseSocket::takeFrame, and those that
+		// were not because the pool or the queue was full.
+		T framesHandedOff;
+		T handOffDrops;
+		// Requests of the peer outside the own register, answered with
+		// Instruction::rangeError, and such answers of the peer.
+		T rangeErrorsSent;
+		T rangeErrorsReceived;
+		T readLatency[latencyBuckets];
+		// Per TxLane, indexed by its value.
+		T laneFramesSent[txLanes];
+		T laneBytesSent[txLanes];
+		// Bytes waiting to be sent right now: in the batching buffer for
+		// TxLane::control, in queued bulk transfers for TxLane::bulk. Not
+		// cleared by BaseSocket::resetStatistics.
+		T laneQueuedBytes[txLanes];
+		// Time from queueing a frame until it was given to the interface,
+		// bucketed like readLatency. Control frames only wait when
+		// batching, others are not counted here. Frames of one batch all
+		// count with the wait of its oldest frame.
+		T laneLatency[txLanes][latencyBuckets];
+	};
+	typedef BasicStatistics<uint32_t> Statistics;
+
+	#ifndef ARDUINO
+	/**
+	 * @brief      Copies part of a register guarded by seqlocks, retrying
+	 *             until no writer overlapped the copy. Used by
+	 *             BaseSocket::readSnapshot and by readers in other processes,
+	 *             see SharedRegister.
+	 *
+	 * @param[in]  sequences      One sequence per region, odd while a region
+	 *                            is written.
+	 * @param[in]  regionSize     Bytes per region.
+	 * @param[in]  data           The register.
+	 * @param[in]  startAddress   Location in data.
+	 * @param      out            Receives size bytes.
+	 * @param[in]  size           Number of bytes.
+	 */
+	void seqlockRead(const atomic<uint32_t> sequences[], size_t regionSize, const uint8_t data[], size_t startAddress, uint8_t out[], size_t size);
+	#endif
+
+	class Reactor;
+	class TraceReader;
+	class FramePool;
+	struct PooledFrame;
+
 	/**
 	 * @brief      Handles FlowSerial data communication.
 	 * @details    This object takes a array of bytes and allows FlowSerial
 	 *             peers to read and write in this register.
 	 */
 	class BaseSocket{
+		// Feeds BaseSocket::handleData from its event loop.
+		friend class Reactor;
+		// Feeds BaseSocket::handleData from a trace.
+		friend class TraceReader;
 	public:
 		/**
 		 * @brief      Constructor
@@ -58,6 +526,7 @@ namespace FlowSerial{
 		 * @param[in]  iregisterLength  The length of the register
 		 */
 		BaseSocket(uint8_t* iflowRegister, size_t iregisterLength);
+		virtual ~BaseSocket(){}
 		/**
 		 * @brief      Request data from the other FlowSerial party register.
 		 *
@@ -78,20 +547,168 @@ namespace FlowSerial{
 		 */
 		void sendReadRequest(uint8_t startAddress, size_t nBytes);
 		/**
-		 * @brief      Reads from peer address. This has a timeout functionality
-		 *             of 500 ms.
+		 * @brief      Request data from the other FlowSerial party register
+		 *             with a tagged read.
+		 * @details    The request and the reply carry a tag and the start
+		 *             address, so replies are matched with their request even
+		 *             when many reads are in flight and answered out of order.
+		 *             When the reply arrives the data is copied into returnData
+		 *             and BaseSocket::isReadPending returns false for the tag.
+		 *             Replies of tagged reads do not end up in the returned
+		 *             data buffer of BaseSocket::getReturnedData.
+		 *
+		 * @note       Requires a peer with protocol version 2 or higher. Like
+		 *             BaseSocket::sendReadRequest this only sends a request.
+		 *
+		 * @param[in]  startAddress  Start address of the register you want to
+		 *                           read.
+		 * @param      returnData    Array that will be filled with the
+		 *                           requested data. Must stay valid until the
+		 *                           read is no longer pending.
+		 * @param[in]  size          Number of bytes to read. The reply must fit
+		 *                           in one frame, see
+		 *                           BaseSocket::setWideMode.
+		 *
+		 * @return     The tag of the read or -1 when
+		 *             FLOW_SERIAL_MAX_TAGGED_READS reads are already pending
+		 *             or size does not fit in one frame.
+		 */
+		int sendTaggedReadRequest(size_t startAddress, uint8_t returnData[], size_t size);
+		/**
+		 * @brief      Checks whether a tagged read still waits for its reply.
+		 *
+		 * @param[in]  tag   Tag returned by BaseSocket::sendTaggedReadRequest.
+		 *
+		 * @return     False when the reply arrived or the read was cancelled.
+		 */
+		bool isReadPending(uint8_t tag);
+		/**
+		 * @brief      Stops waiting for a tagged read, for example after a
+		 *             timeout. A reply arriving later is ignored.
+		 *
+		 * @param[in]  tag   Tag returned by BaseSocket::sendTaggedReadRequest.
+		 */
+		void cancelRead(uint8_t tag);
+		/**
+		 * @brief      Number of tagged reads waiting for a reply.
+		 */
+		size_t pendingReads();
+		/**
+		 * @brief      Starts a read that completes in the background.
+		 * @details    Sends a tagged read and keeps track of it. When the
+		 *             reply arrives, BaseSocket::handleData copies the data into
+		 *             returnData and calls callback with ReadStatus::done. When
+		 *             no reply arrives within the read timeout the request is
+		 *             sent again, up to the number of retries set by
+		 *             BaseSocket::setReadTimeout. After that callback is called
+		 *             with ReadStatus::timeout. A peer of protocol version 7 or
+		 *             higher rejects reads outside its register, callback is
+		 *             then called with ReadStatus::outOfRange. Timeouts are
+		 *             handled by BaseSocket::update, so call it regularly.
+		 *
+		 *             Without a callback, poll BaseSocket::isReadPending and
+		 *             BaseSocket::getReadStatus instead.
+		 *
+		 * @note       Requires a peer with protocol version 2 or higher.
+		 *
+		 * @param[in]  startAddress  Start address of the register you want to
+		 *                           read.
+		 * @param      returnData    Array that will be filled with the
+		 *                           requested data. Must stay valid until the
+		 *                           read is no longer pending.
+		 * @param[in]  size          Number of bytes to read. The reply must fit
+		 *                           in one frame, see
+		 *                           BaseSocket::setWideMode.
+		 * @param[in]  callback      Called once when the read finished. May be
+		 *                           nullptr.
+		 * @param      context       Passed to callback.
+		 *
+		 * @return     The tag of the read or -1 when
+		 *             FLOW_SERIAL_MAX_TAGGED_READS reads are already pending
+		 *             or size does not fit in one frame.
+		 */
+		int readAsync(size_t startAddress, uint8_t returnData[], size_t size, ReadCallback callback = nullptr, void* context = nullptr);
+		/**
+		 * @brief      Status of the last read that used tag.
+		 * @details    Only the last FLOW_SERIAL_READ_STATUS_SLOTS finished
+		 *             tags are remembered, older ones report
+		 *             ReadStatus::cancelled.
 		 *
-		 *             It will try five times with resending of the request
-		 *             before throwing an exception.
+		 * @param[in]  tag   Tag returned by BaseSocket::readAsync or
+		 *                   BaseSocket::sendTaggedReadRequest.
+		 */
+		ReadStatus getReadStatus(uint8_t tag);
+		/**
+		 * @brief      Sets the timeout and retry policy of BaseSocket::read
+		 *             and BaseSocket::readAsync. The default is 500 ms and 5
+		 *             retries.
 		 *
-		 * @todo Implement this function as follows. Step 1: Call
-		 * BaseSocket::sendReadRequest to send a read request. Step 2: Put new
-		 * incoming data from the interface into the BaseSocket::handleData
-		 * function. Step 3: Check if BaseSocket::returnDataSize equals nBytes. Of
-		 * not goto step 2. If yes call BaseSocket::getReturnedData with
-		 * returnData and size as arguments. After this you are done. Make sure
-		 * you implement some sort of timeout when waiting for
-		 * BaseSocket::returnDataSize. After an timeout goto step 1.
+		 * @param[in]  timeout  Time in microseconds to wait for a reply before
+		 *                      the request is sent again. With
+		 *                      BaseSocket::setAdaptiveTimeout only used until
+		 *                      the first round trip is measured.
+		 * @param[in]  retries  Number of times a request is sent again before
+		 *                      giving up.
+		 */
+		void setReadTimeout(uint32_t timeout, uint8_t retries);
+		/**
+		 * @brief      Derives the read timeout from measured round trips.
+		 * @details    Every read that is answered without being sent again
+		 *             updates a smoothed round trip time and its variation,
+		 *             like TCP does (RFC 6298). The timeout becomes the
+		 *             smoothed round trip plus four times the variation,
+		 *             kept between minTimeout and maxTimeout. A fast link
+		 *             then retries after a lost frame within milliseconds,
+		 *             and a slow radio link no longer retries too early.
+		 *
+		 *             Every time a request is sent again it waits twice as
+		 *             long, up to maxTimeout. Replies to those requests are
+		 *             not measured, they may answer an earlier copy. The
+		 *             timeout also applies to acknowledged writes.
+		 *
+		 * @param[in]  enable      True to adapt, false to use the fixed timeout
+		 *                         of BaseSocket::setReadTimeout.
+		 * @param[in]  minTimeout  Lowest timeout in microseconds.
+		 * @param[in]  maxTimeout  Highest timeout in microseconds.
+		 *
+		 * @return     True when applied. A minTimeout above maxTimeout throws
+		 *             std::invalid_argument, on Arduino it returns false and
+		 *             changes nothing.
+		 */
+		bool setAdaptiveTimeout(bool enable, uint32_t minTimeout = 1000, uint32_t maxTimeout = 2000000);
+		/**
+		 * @brief      Time in microseconds a new request waits for its reply.
+		 */
+		uint32_t getReadTimeout() const;
+		/**
+		 * @brief      Smoothed round trip time in microseconds, 0 until one
+		 *             has been measured.
+		 */
+		uint32_t getSmoothedRtt() const;
+		/**
+		 * @brief      Variation of the round trip time in microseconds.
+		 */
+		uint32_t getRttVariation() const;
+		/**
+		 * @brief      Reads from peer address and blocks until the data arrived.
+		 * @details    Sends a read request and passes incoming data to
+		 *             BaseSocket::handleData through
+		 *             BaseSocket::receiveFromInterface until size bytes have
+		 *             been returned. When nothing arrives within the read
+		 *             timeout the request is sent again. After the configured
+		 *             retries a std::runtime_error is thrown. See
+		 *             BaseSocket::setReadTimeout. A std::out_of_range is thrown
+		 *             when the peer rejects the read with
+		 *             Instruction::rangeError. On Arduino, which has no
+		 *             exceptions, read returns instead and the result is in
+		 *             BaseSocket::getLastReadStatus.
+		 *
+		 *             Uses untagged reads so it works with peers of every
+		 *             protocol version. The returned data buffer is cleared
+		 *             first.
+		 *
+		 * @todo Either implement BaseSocket::receiveFromInterface or override
+		 * this function.
 		 *
 		 * @param[in]  startAddress  The start address where to begin to read
 		 *                           from other peer
@@ -101,10 +718,22 @@ namespace FlowSerial{
 		 *                           address. Must be smaller than the size of
 		 *                           returnData.
 		 */
-		virtual void read(uint8_t startAddress, uint8_t returnData[], size_t size) = 0;
+		virtual void read(uint8_t startAddress, uint8_t returnData[], size_t size);
+		/**
+		 * @brief      Result of the last BaseSocket::read: ReadStatus::done,
+		 *             ReadStatus::timeout or ReadStatus::outOfRange.
+		 *             ReadStatus::cancelled before the first.
+		 */
+		ReadStatus getLastReadStatus() const;
 		/**
 		 * @brief      Write to the other FlowSerial party register.
 		 *
+		 * @details    Data is split in as few frames as needed. Frames carry
+		 *             up to 255 bytes, or up to 65535 bytes in wide mode.
+		 *             Start addresses above 255 use the wide instructions.
+		 *             With BaseSocket::setCompression regions that compress
+		 *             are sent as encoded frames.
+		 *
 		 * @note       This function does not guarantee nor check an actual
 		 *             write. It only sends a write appropriate request.
 		 *
@@ -113,7 +742,211 @@ namespace FlowSerial{
 		 * @param[in]  size          The size
 		 * @param      arraySize  Specify the array size of the data array.
 		 */
-		void write(uint8_t startAddress, const uint8_t data[], size_t size);
+		void write(size_t startAddress, const uint8_t data[], size_t size);
+		/**
+		 * @brief      Enables the wide instructions for all writes and tagged
+		 *             reads.
+		 * @details    Wide frames have 32-bit addresses and 16-bit lengths, so
+		 *             large registers are moved in a few frames instead of
+		 *             hundreds. Only enable this when the peer implements
+		 *             protocol version 3 and was built with a
+		 *             FLOW_SERIAL_MAX_PAYLOAD that holds the frames sent to it.
+		 *             Without wide mode the wide instructions are only used
+		 *             when an address or length does not fit in 8 bits.
+		 *
+		 * @param[in]  enable  True to send wide frames.
+		 */
+		void setWideMode(bool enable);
+		/**
+		 * @brief      Configures how the parser recovers from broken frames.
+		 * @details    With resync the bytes of a frame that failed its
+		 *             checksum, has an unknown instruction or a length that
+		 *             does not fit are scanned again for a start byte. A real
+		 *             frame that started inside the broken one is then not
+		 *             lost. Without it those bytes are thrown away. Resync is
+		 *             on by default.
+		 *
+		 *             With an inter-byte timeout a partial frame is aborted
+		 *             when the next data arrives more than timeout
+		 *             microseconds after the previous, so a corrupted length
+		 *             byte can not swallow the frames after it. Timeouts are
+		 *             measured per call of BaseSocket::handleData.
+		 *
+		 *             Built with FLOW_SERIAL_RESYNC 0, the default on
+		 *             Arduino, resync is off and enable is ignored. The
+		 *             inter-byte timeout still works.
+		 *
+		 * @param[in]  enable   True to rescan the bytes of broken frames.
+		 * @param[in]  timeout  Inter-byte timeout in microseconds, 0 is off.
+		 */
+		void setResync(bool enable, uint32_t timeout = 0);
+		/**
+		 * @brief      Selects the check sum that protects every frame.
+		 * @details    The additive checksum of the original protocol misses
+		 *             swapped bytes and many multi-bit errors. CRC-16-CCITT
+		 *             catches those at the same frame size, CRC-32C adds two
+		 *             bytes per frame and catches far more. Both are computed
+		 *             with tables or CPU instructions, see Checksum.hpp.
+		 *
+		 *             Both peers must use the same integrity. A frame that is
+		 *             being received while this is called is dropped.
+		 *
+		 * @param[in]  integrity  The check sum to send and expect.
+		 */
+		void setIntegrity(Integrity integrity);
+		/**
+		 * @brief      Run length encodes writes and replies to untagged
+		 *             reads when that makes them smaller.
+		 * @details    BaseSocket::write then sends regions that are mostly
+		 *             zero or repeat a byte as writeEncoded frames. One such
+		 *             frame may describe up to 65535 register bytes. Replies
+		 *             to BaseSocket::sendReadRequest become returnEncodedData
+		 *             frames. Data that does not compress is sent as before.
+		 *
+		 * @note       Requires a peer with protocol version 6 or higher.
+		 *
+		 * @param[in]  enable  True to encode.
+		 */
+		void setCompression(bool enable);
+		Integrity getIntegrity() const;
+		#ifndef ARDUINO
+		/**
+		 * @brief      Reports all received bytes, all decoded frames,
+		 *             checksum failures and all sent frames to a sink.
+		 * @details    Use a CaptureRing to record a link into a trace file
+		 *             with little overhead. Without a sink this costs one
+		 *             comparison per chunk and frame.
+		 *
+		 * @param      sink  The sink or nullptr to stop capturing.
+		 */
+		void setCapture(CaptureSink* sink);
+		#endif
+		/**
+		 * @brief      Size of a change bitmap for BaseSocket::setChangeTracking.
+		 *
+		 * @param[in]  registerLength  The length of the register.
+		 * @param[in]  granule         Bytes tracked by one bit.
+		 *
+		 * @return     Size of the bitmap in bytes.
+		 */
+		static constexpr size_t changeBitmapSize(size_t registerLength, size_t granule){
+			return ((registerLength + granule - 1) / granule + 7) / 8;
+		}
+		/**
+		 * @brief      Enables tracking of changed register regions.
+		 * @details    Changes are tracked per granule of the register with
+		 *             one bit each. localChanges collects the regions changed
+		 *             through BaseSocket::trackedWrite and BaseSocket::markDirty
+		 *             that BaseSocket::sync still has to send. remoteChanges
+		 *             collects the regions the peer wrote into, see
+		 *             BaseSocket::popRemoteChange. Both bitmaps are cleared.
+		 *
+		 * @param      localChanges   Bitmap of
+		 *                            BaseSocket::changeBitmapSize bytes or
+		 *                            nullptr to not track local changes.
+		 * @param      remoteChanges  Bitmap of
+		 *                            BaseSocket::changeBitmapSize bytes or
+		 *                            nullptr to not track remote changes.
+		 * @param[in]  granule        Bytes tracked by one bit. Rounded up to
+		 *                            a power of two, for example 1 or 8.
+		 */
+		void setChangeTracking(uint8_t localChanges[], uint8_t remoteChanges[], size_t granule);
+		/**
+		 * @brief      Copies data into the own register and marks the region
+		 *             to be sent by BaseSocket::sync.
+		 *
+		 * @param[in]  startAddress  Location in BaseSocket::flowRegister.
+		 * @param[in]  data          The data
+		 * @param[in]  size          Number of bytes.
+		 */
+		void trackedWrite(size_t startAddress, const uint8_t data[], size_t size);
+		/**
+		 * @brief      Marks a region of the own register that was changed in
+		 *             place to be sent by BaseSocket::sync.
+		 */
+		void markDirty(size_t startAddress, size_t size);
+		/**
+		 * @brief      Writes all regions marked by BaseSocket::trackedWrite and
+		 *             BaseSocket::markDirty to the same location in the
+		 *             register of the peer.
+		 * @details    Adjacent regions are coalesced. Regions separated by
+		 *             fewer clean bytes than the overhead of a frame are sent
+		 *             in one frame as well.
+		 *
+		 * @return     The number of write calls made.
+		 */
+		size_t sync();
+		/**
+		 * @brief      Checks whether the peer wrote into a region since the
+		 *             region was popped or cleared.
+		 */
+		bool isRemotelyChanged(size_t startAddress, size_t size);
+		/**
+		 * @brief      Gets and clears the first region the peer wrote into.
+		 *
+		 * @param[out] startAddress  Start of the region.
+		 * @param[out] size          Size of the region.
+		 *
+		 * @return     False when nothing changed.
+		 */
+		bool popRemoteChange(size_t& startAddress, size_t& size);
+		/**
+		 * @brief      Forgets all regions the peer wrote into.
+		 */
+		void clearRemoteChanges();
+		#ifndef ARDUINO
+		/**
+		 * @brief      Number of sequence counters for
+		 *             BaseSocket::setSnapshotRegions.
+		 */
+		static constexpr size_t snapshotRegionCount(size_t registerLength, size_t regionSize){
+			return (registerLength + regionSize - 1) / regionSize;
+		}
+		/**
+		 * @brief      Enables torn-read-free snapshots of the own register.
+		 * @details    The register is divided in regions of regionSize bytes,
+		 *             each guarded by a seqlock. BaseSocket::handleData makes
+		 *             the sequence of every region a remote write touches odd
+		 *             before copying and even again after. Readers on other
+		 *             threads use BaseSocket::readSnapshot, which retries
+		 *             until no remote write overlapped its copy. The receive
+		 *             path never waits for readers.
+		 *
+		 *             Only remote writes are guarded. Changes made locally to
+		 *             BaseSocket::flowRegister are not.
+		 *
+		 * @param      sequences   Array of BaseSocket::snapshotRegionCount
+		 *                         counters or nullptr to disable.
+		 * @param[in]  regionSize  Bytes per region. Smaller regions make
+		 *                         readers retry less often.
+		 * @param      generation  Incremented with release ordering after
+		 *                         every guarded remote write. May be nullptr.
+		 */
+		void setSnapshotRegions(atomic<uint32_t> sequences[], size_t regionSize, atomic<uint32_t>* generation = nullptr);
+		/**
+		 * @brief      Copies part of the own register without tearing remote
+		 *             writes. Safe to call from any thread. See
+		 *             BaseSocket::setSnapshotRegions.
+		 *
+		 * @param[in]  startAddress  Location in BaseSocket::flowRegister.
+		 * @param      out           Receives size bytes.
+		 * @param[in]  size          Number of bytes.
+		 */
+		void readSnapshot(size_t startAddress, uint8_t out[], size_t size);
+		#endif
+		/**
+		 * @brief      Takes a snapshot of the counters of this socket.
+		 * @details    The counters are always kept. They are updated with
+		 *             relaxed atomic operations, so this may be called from
+		 *             another thread, for example a metrics thread, without
+		 *             disturbing the data path. The snapshot is not taken
+		 *             atomically as a whole.
+		 */
+		Statistics getStatistics() const;
+		/**
+		 * @brief      Sets all counters to 0.
+		 */
+		void resetStatistics();
 		/**
 		 * @brief      Check available bytes in the returned data buffer.
 		 *
@@ -122,7 +955,7 @@ namespace FlowSerial{
 		 *
 		 * @return     Number of byte available in input buffer.
 		 */
-		size_t returnDataSize();
+		virtual size_t returnDataSize();
 		/**
 		 * @brief      Copies the input buffer into dataReturn up to size bytes.
 		 * @note       When receiving multiple returns, the data will be
@@ -138,12 +971,264 @@ namespace FlowSerial{
 		 * @return     Size of actual data copied into dataReturn. A number
 		 *             smaller than size indicates the buffer being empty.
 		 */
-		size_t getReturnedData(uint8_t dataReturn[], size_t size);
+		virtual size_t getReturnedData(uint8_t dataReturn[], size_t size);
 		/**
 		 * @brief      Clears all returned data in buffer. I.e.
 		 *             BaseSocket::returnDataSize will return 0;
 		 */
-		void clearReturnedData();
+		virtual void clearReturnedData();
+		/**
+		 * @brief      Enables or disables coalescing of outgoing frames.
+		 * @details    With batching enabled, frames of BaseSocket::write and
+		 *             BaseSocket::sendReadRequest are collected in an
+		 *             outgoing buffer of FLOW_SERIAL_TX_BUFFER_SIZE bytes
+		 *             instead of being sent right away. The buffer is sent in
+		 *             one go by BaseSocket::flush, when it holds flushThreshold
+		 *             bytes or more, or by BaseSocket::update once the oldest
+		 *             frame waited flushDeadline microseconds. Replies to read
+		 *             requests of the peer are sent at the end of each
+		 *             BaseSocket::handleData call. Disabling batching flushes
+		 *             what is waiting. Frames that do not fit in the buffer
+		 *             are sent on their own, all of them when
+		 *             FLOW_SERIAL_TX_BUFFER_SIZE is 0 as on Arduino.
+		 *
+		 * @param[in]  enable          True to enable batching.
+		 * @param[in]  flushThreshold  Send when at least this many bytes
+		 *                             are waiting.
+		 * @param[in]  flushDeadline   Maximum time in microseconds a frame
+		 *                             may wait. 0 means no deadline.
+		 */
+		void setBatching(bool enable, size_t flushThreshold = FLOW_SERIAL_TX_BUFFER_SIZE, uint32_t flushDeadline = 0);
+		/**
+		 * @brief      Sends all frames waiting in the outgoing buffer.
+		 */
+		void flush();
+		/**
+		 * @brief      Runs the time based work of the socket, like the batching
+		 *             deadline. Call this regularly, for example every
+		 *             iteration of the control loop.
+		 */
+		void update();
+		/**
+		 * @brief      Writes to the register of the other peer with
+		 *             guaranteed delivery.
+		 * @details    Each frame carries a sequence number and is kept in a
+		 *             window of FLOW_SERIAL_RELIABLE_WINDOW frames until the
+		 *             peer acknowledges it. The peer applies the frames in
+		 *             order and acknowledges cumulatively, so up to a window
+		 *             of frames is in flight instead of one at a time. When
+		 *             the peer reports a gap or a broken frame, or nothing is
+		 *             acknowledged within the read timeout, every frame not
+		 *             acknowledged yet is sent again. After the read retries
+		 *             of BaseSocket::setReadTimeout the frames are dropped and
+		 *             counted in Statistics::writeFailures.
+		 *
+		 *             Retransmissions are done by BaseSocket::update, so call
+		 *             it regularly.
+		 *
+		 * @note       Requires a peer with protocol version 5 or higher.
+		 *
+		 * @param[in]  startAddress  Start address at the peer.
+		 * @param[in]  data          The data, copied into the window.
+		 * @param[in]  size          Number of bytes.
+		 *
+		 * @return     False, and nothing is sent, when the window has no room
+		 *             for all frames of the write. Always false for data when
+		 *             FLOW_SERIAL_RELIABLE_WINDOW is 0, the default on
+		 *             Arduino.
+		 */
+		bool writeReliable(size_t startAddress, const uint8_t data[], size_t size);
+		/**
+		 * @brief      Number of acknowledged write frames the peer has not
+		 *             acknowledged yet.
+		 */
+		size_t unacknowledgedWrites() const;
+		/**
+		 * @brief      Queues a large write behind all other traffic.
+		 * @details    The transfer is sent in chunks of at most one frame by
+		 *             BaseSocket::update, up to the budget of
+		 *             BaseSocket::setBulkBudget per call. Everything else,
+		 *             like BaseSocket::write, goes out right away and so
+		 *             overtakes the transfer at the next frame boundary.
+		 *             Frames waiting in the batching buffer are flushed
+		 *             before any bulk chunk, bulk chunks never wait in it.
+		 *             Transfers are sent one after the other in order.
+		 *
+		 * @param[in]  startAddress  Start address at the peer.
+		 * @param[in]  data          The data. Not copied, must stay valid
+		 *                           until BaseSocket::pendingBulkBytes has
+		 *                           dropped by size.
+		 * @param[in]  size          Number of bytes.
+		 *
+		 * @return     False when FLOW_SERIAL_BULK_QUEUE transfers are already
+		 *             waiting.
+		 */
+		bool writeBulk(size_t startAddress, const uint8_t data[], size_t size);
+		/**
+		 * @brief      Hands a copy of every received frame out of
+		 *             BaseSocket::handleData.
+		 * @details    Each frame with a good check sum is still handled as
+		 *             usual. It is also copied, header arguments followed by
+		 *             payload, into a frame of pool and queued for
+		 *             BaseSocket::takeFrame. When the pool has no frame or
+		 *             FLOW_SERIAL_HANDOFF_QUEUE frames are waiting, the copy is
+		 *             dropped and counted in Statistics::handOffDrops.
+		 *
+		 *             One thread may take frames while another runs
+		 *             handleData. Do not give the pool PoolExhaustion::block
+		 *             when both are the same thread.
+		 *
+		 * @param      pool  The pool or nullptr to stop.
+		 */
+		void setFrameHandOff(FramePool* pool);
+		/**
+		 * @brief      Takes the oldest handed off frame. Give it back to the
+		 *             pool with FramePool::release when done.
+		 *
+		 * @return     The frame or nullptr when none is waiting.
+		 */
+		PooledFrame* takeFrame();
+		/**
+		 * @brief      Calls handler inline for every remote write, instead
+		 *             of polling BaseSocket::flowRegister for changes.
+		 * @details    Called after change tracking, subscriptions and
+		 *             BaseSocket::remoteWriteApplied are done.
+		 *
+		 * @param[in]  handler  The handler or nullptr.
+		 * @param      context  Passed to handler.
+		 */
+		void setRemoteWriteHandler(RemoteWriteHandler handler, void* context = nullptr);
+		/**
+		 * @brief      Calls handler inline for all data returned by the peer.
+		 * @details    Replies to BaseSocket::sendReadRequest are then no
+		 *             longer stored for BaseSocket::getReturnedData, they
+		 *             only go to the handler, and the blocking
+		 *             BaseSocket::read can not see them. Tagged replies are
+		 *             still copied into the array of the read first and
+		 *             their ReadCallback runs after the handler.
+		 *
+		 * @param[in]  handler  The handler or nullptr to store replies again.
+		 * @param      context  Passed to handler.
+		 */
+		void setReturnedDataHandler(ReturnedDataHandler handler, void* context = nullptr);
+		/**
+		 * @brief      Calls handler for every frame with an unknown
+		 *             instruction.
+		 *
+		 * @param[in]  handler  The handler or nullptr.
+		 * @param      context  Passed to handler.
+		 */
+		void setUnknownInstructionHandler(UnknownInstructionHandler handler, void* context = nullptr);
+		/**
+		 * @brief      Sets what this side offers in a negotiation, and
+		 *             answers with when the peer negotiates. The default is
+		 *             everything this build supports, at the current baud
+		 *             rate.
+		 */
+		void setCapabilities(const Capabilities& capabilities);
+		/**
+		 * @brief      Agrees on the fastest settings both sides support.
+		 * @details    Sends the capabilities of this side in an
+		 *             Instruction::capabilities frame. The peer answers with
+		 *             its own, and both then switch to:
+		 *             - wide mode when both support it,
+		 *             - compression when both support it,
+		 *             - the strongest integrity both support,
+		 *             - frames no larger than the peer receives,
+		 *             - the lower of both baud rates when both offer one,
+		 *               see BaseSocket::changeInterfaceRate.
+		 *
+		 *             The peer switches right after its answer, this side
+		 *             when the answer arrives. This side then confirms with
+		 *             the new settings and the peer commits once the
+		 *             confirmation gets through. A peer that gets no
+		 *             confirmation in time, because the answer or the
+		 *             confirmation was lost or this side could not switch,
+		 *             goes back to the settings it had before. This side
+		 *             does the same when the commit does not arrive. Both
+		 *             the offer and the confirmation are sent again like a
+		 *             read, see BaseSocket::setReadTimeout, so call
+		 *             BaseSocket::update regularly on both sides.
+		 *             Negotiate right after connecting, before other
+		 *             traffic, and from one side only.
+		 *
+		 * @note       Requires a peer with protocol version 8 or higher.
+		 *             Older peers drop the frame and the negotiation times
+		 *             out, nothing is changed then.
+		 * @note       When the peer commits but every commit sent back is
+		 *             lost, the sides disagree until they reconnect. That is
+		 *             as likely as a read failing all its retries.
+		 *
+		 * @param[in]  callback  Called once when done. May be nullptr.
+		 * @param      context   Passed to callback.
+		 *
+		 * @return     False when a negotiation is already pending.
+		 */
+		bool negotiate(NegotiationCallback callback = nullptr, void* context = nullptr);
+		/**
+		 * @brief      ReadStatus::pending while negotiating, otherwise the
+		 *             result of the last negotiation. ReadStatus::cancelled
+		 *             before the first.
+		 */
+		ReadStatus getNegotiationStatus() const;
+		/**
+		 * @brief      Settings agreed by the last negotiation.
+		 */
+		const Capabilities& getAgreedCapabilities() const;
+		/**
+		 * @brief      Sets how much bulk data goes out per
+		 *             BaseSocket::update.
+		 * @details    Smaller chunks let control frames in sooner on a slow
+		 *             link, a smaller budget leaves more of the link to them.
+		 *             At least one chunk is sent per update.
+		 *
+		 * @param[in]  bytesPerUpdate  Payload bytes per call of update.
+		 * @param[in]  chunkSize       Payload bytes per frame, up to 255.
+		 */
+		void setBulkBudget(size_t bytesPerUpdate, size_t chunkSize = 0xFF);
+		/**
+		 * @brief      Bytes of queued bulk transfers not sent yet.
+		 */
+		size_t pendingBulkBytes() const;
+		/**
+		 * @brief      Asks the other peer to push a region of its register
+		 *             without being asked again.
+		 * @details    The peer sends the region every period milliseconds,
+		 *             or, when onChange is set, whenever the region changed,
+		 *             at most once per period. A change is a remote write or
+		 *             a call of BaseSocket::trackedWrite or
+		 *             BaseSocket::markDirty on the peer. Pushes are sent from
+		 *             BaseSocket::update of the peer.
+		 *
+		 *             Each push is copied into destination, after which
+		 *             callback is called with the id and ReadStatus::done.
+		 *
+		 * @note       Requires a peer with protocol version 4 or higher. The
+		 *             request is not acknowledged. When in doubt, subscribe
+		 *             again: a subscription with the same id replaces the old
+		 *             one at the peer.
+		 *
+		 * @param[in]  startAddress  Start address at the peer.
+		 * @param      destination   Receives the pushed data. Must stay
+		 *                           valid until BaseSocket::unsubscribe.
+		 * @param[in]  size          Number of bytes, up to
+		 *                           FLOW_SERIAL_MAX_PAYLOAD.
+		 * @param[in]  period        Period or, with onChange, minimum
+		 *                           interval in milliseconds.
+		 * @param[in]  onChange      Push on change instead of periodically.
+		 * @param[in]  callback      Called for every push. May be nullptr.
+		 * @param      context       Passed to callback.
+		 *
+		 * @return     Id of the subscription or -1 when
+		 *             FLOW_SERIAL_MAX_SUBSCRIPTIONS are already active or size
+		 *             does not fit in a frame.
+		 */
+		int subscribe(size_t startAddress, uint8_t destination[], size_t size, uint16_t period, bool onChange = false, ReadCallback callback = nullptr, void* context = nullptr);
+		/**
+		 * @brief      Ends a subscription made with BaseSocket::subscribe.
+		 *             Pushes still on their way are ignored.
+		 */
+		void unsubscribe(uint8_t id);
 		/**
 		 * Own register which can be read and written to from other party.
 		 *
@@ -190,20 +1275,435 @@ namespace FlowSerial{
 		 *                        that needs to be send.
 		 */
 		virtual void writeToInterface(const uint8_t data[], size_t arraySize) = 0;
+		/**
+		 * @brief      Vectored variant of BaseSocket::writeToInterface. Every
+		 *             outgoing frame is handed to this function.
+		 * @details    A frame is split in a header, the payload and a trailer
+		 *             holding the checksum. The payload points straight into
+		 *             BaseSocket::flowRegister or the buffer given to
+		 *             BaseSocket::write, so it is not copied on the way out.
+		 *             Override this to map the vectors on writev, sendmsg or
+		 *             a DMA descriptor chain. The vectors are only valid
+		 *             during the call.
+		 *
+		 *             The default flattens the vectors and calls
+		 *             BaseSocket::writeToInterface once per frame, for every
+		 *             frame a peer built with the same FLOW_SERIAL_MAX_PAYLOAD
+		 *             receives. Larger frames, like wide writes to a peer
+		 *             with a larger payload, are written in consecutive
+		 *             chunks of that size instead. Transports that frame
+		 *             every write, like UDP, must then override this
+		 *             function, or keep frames small with
+		 *             BaseSocket::negotiate.
+		 *
+		 * @param[in]  vectors  The blocks, 0 is first out.
+		 * @param[in]  count    Number of blocks in vectors.
+		 */
+		virtual void writeVectorToInterface(const IoVector vectors[], size_t count);
+		/**
+		 * @brief      Time source for all time based behavior of the socket.
+		 * @details    The default uses a steady clock. Override this when the
+		 *             platform has a better or cheaper one. Only differences
+		 *             between two values are used.
+		 *
+		 * @return     Monotonic time in microseconds.
+		 */
+		virtual uint64_t currentMicros();
+		/**
+		 * @brief      Waits for data from the interface and puts it into
+		 *             BaseSocket::handleData. Used by BaseSocket::read.
+		 * @details    The default throws std::logic_error, on Arduino it
+		 *             returns at once so BaseSocket::read times out. Derived
+		 *             classes that rely on the default BaseSocket::read must
+		 *             override it.
+		 *
+		 * @param[in]  timeout  Maximum time in microseconds to wait for data.
+		 */
+		virtual void receiveFromInterface(uint32_t timeout);
+		/**
+		 * @brief      Called by BaseSocket::handleData with the data of an
+		 *             untagged read reply.
+		 * @details    The default appends it to the returned data buffer.
+		 *             Override this together with BaseSocket::returnDataSize,
+		 *             BaseSocket::getReturnedData and
+		 *             BaseSocket::clearReturnedData to store it elsewhere.
+		 *
+		 * @return     False when not all data could be stored.
+		 */
+		virtual bool storeReturnedData(const uint8_t data[], size_t size);
+		/**
+		 * @brief      Called by BaseSocket::handleData after the peer wrote
+		 *             into BaseSocket::flowRegister. The default does nothing.
+		 *
+		 * @param[in]  startAddress  Start of the region that was written.
+		 * @param[in]  size          Size of the region.
+		 */
+		virtual void remoteWriteApplied(size_t startAddress, size_t size);
+		/**
+		 * @brief      Called by a negotiation to switch the interface to
+		 *             the agreed baud rate, or back when the agreement
+		 *             fails, after all frames at the old rate have been
+		 *             sent. The default changes nothing.
+		 *
+		 * @param[in]  baudRate  The new baud rate.
+		 *
+		 * @return     True when the interface now runs at baudRate.
+		 */
+		virtual bool changeInterfaceRate(uint32_t baudRate);
+		/**
+		 * @brief      The baud rate the interface runs at, 0 when unknown.
+		 *             A negotiation only changes the rate of sockets that
+		 *             know it, to be able to go back when it fails. The
+		 *             default returns 0.
+		 */
+		virtual uint32_t interfaceRate() const;
+		/**
+		 * When true, the default, replies sent while handling one call of
+		 * BaseSocket::handleData are coalesced in the outgoing buffer. Set it
+		 * to false in the constructor of sockets that coalesce themselves or
+		 * send from several threads.
+		 */
+		bool coalesceReplies = true;
+		/**
+		 * @brief      Forgets a frame that is not complete yet. For
+		 *             interfaces that carry whole frames in each unit, like
+		 *             datagrams, so a lost unit does not join the halves of
+		 *             two frames. Counted as a dropped frame.
+		 */
+		void dropPartialFrame();
+		/**
+		 * Largest payload BaseSocket::write puts in one frame, on top of what
+		 * the peer takes. Sockets that queue frames in slots of a fixed size
+		 * lower it in the constructor.
+		 */
+		size_t maxFramePayload = maxWidePayload;
+		// Most arguments any instruction has in front of its payload.
+		static const size_t maxHeaderArguments = 12;
 	private:
+		/**
+		 * A tagged read waiting for its reply.
+		 */
+		struct TaggedRead{
+			bool pending = false;
+			uint8_t tag;
+			uint32_t startAddress;
+			uint16_t size;
+			bool wide;
+			uint8_t* returnData;
+			uint64_t sentTime;
+			// Only set for BaseSocket::readAsync.
+			bool timed;
+			uint8_t retriesLeft;
+			// Wait for this request, doubled on every retry.
+			uint32_t timeout;
+			ReadCallback callback;
+			void* context;
+		};
+		/**
+		 * A region the other peer asked this socket to push.
+		 */
+		struct ServedSubscription{
+			bool active = false;
+			bool onChange;
+			bool changed;
+			uint8_t id;
+			uint32_t startAddress;
+			uint16_t size;
+			uint32_t period;
+			uint64_t lastSent;
+		};
+		/**
+		 * A region this socket asked the other peer to push.
+		 */
+		struct HeldSubscription{
+			bool active = false;
+			uint32_t startAddress;
+			uint16_t size;
+			uint8_t* destination;
+			ReadCallback callback;
+			void* context;
+		};
+		/**
+		 * A transfer of BaseSocket::writeBulk.
+		 */
+		struct BulkTransfer{
+			size_t startAddress;
+			const uint8_t* data;
+			size_t size;
+			uint64_t queuedTime;
+		};
+		/**
+		 * An acknowledged write frame waiting for its acknowledgement.
+		 */
+		struct ReliableFrame{
+			uint16_t sequence;
+			uint32_t startAddress;
+			uint8_t size;
+			uint8_t data[FLOW_SERIAL_RELIABLE_PAYLOAD];
+		};
+		/**
+		 * Status of a finished tagged read, in the slot of its tag.
+		 */
+		struct FinishedRead{
+			uint8_t tag;
+			ReadStatus status;
+		};
+		static const size_t txBufferSize = FLOW_SERIAL_TX_BUFFER_SIZE;
+		static const size_t reliableWindow = FLOW_SERIAL_RELIABLE_WINDOW;
+		static_assert(FLOW_SERIAL_RELIABLE_PAYLOAD > 0 && FLOW_SERIAL_RELIABLE_PAYLOAD <= 0xFF, "FlowSerial: FLOW_SERIAL_RELIABLE_PAYLOAD must be between 1 and 255");
+		// Arrays and rings of a size that may be configured to 0 keep at
+		// least one element.
+		static const size_t reliableSlots = reliableWindow > 0 ? reliableWindow : 1;
+		static const size_t readStatusSlots = FLOW_SERIAL_READ_STATUS_SLOTS;
+		static_assert(readStatusSlots > 0 && readStatusSlots <= 256 && (readStatusSlots & (readStatusSlots - 1)) == 0, "FlowSerial: FLOW_SERIAL_READ_STATUS_SLOTS must be a power of two up to 256");
+		static const size_t maxTaggedReads = FLOW_SERIAL_MAX_TAGGED_READS;
+		static const size_t maxSubscriptions = FLOW_SERIAL_MAX_SUBSCRIPTIONS;
+		static const size_t bulkQueue = FLOW_SERIAL_BULK_QUEUE;
+		static const size_t handOffQueue = FLOW_SERIAL_HANDOFF_QUEUE;
+		static_assert((handOffQueue & (handOffQueue - 1)) == 0, "FlowSerial: FLOW_SERIAL_HANDOFF_QUEUE must be a power of two");
+		static const size_t maxPayload = FLOW_SERIAL_MAX_PAYLOAD;
+		// Largest payload the 16-bit length of a wide frame can describe.
+		static const size_t maxWidePayload = 0xFFFF;
+		/**
+		 * Number of arguments in front of the payload. 0 for unknown
+		 * instructions.
+		 */
+		static size_t headerArguments(Instruction instruction);
+		/**
+		 * Works out the payload size once all header arguments are in.
+		 */
+		void headerReceived();
+		// Runs the state machine over data. Stops early when a broken frame
+		// has to be scanned again first.
+		size_t parse(const uint8_t data[], size_t arraySize, bool& ret);
+		/**
+		 * Drops the current frame and prepares its bytes after the start
+		 * byte to be scanned again. True when they hold a start byte.
+		 */
+		bool resync(bool instructionReceived, size_t checksumBytes);
+		#ifndef ARDUINO
+		// Gives the frame in argumentBuffer to the capture sink, if any.
+		void captureFrame(CaptureEvent event);
+		#endif
+		uint32_t integrityUpdate(uint32_t state, const uint8_t data[], size_t size) const;
+		uint32_t integrityUpdate(uint32_t state, uint8_t input) const;
+		int startTaggedRead(size_t startAddress, uint8_t returnData[], size_t size, bool timed, ReadCallback callback, void* context);
+		void sendTaggedRead(const TaggedRead& read);
+		void finishTaggedRead(TaggedRead& read, ReadStatus status);
+		TaggedRead* findTaggedRead(uint8_t tag);
+		void completeTaggedRead(uint8_t tag, uint32_t startAddress, const uint8_t data[], size_t size);
+		void returnTaggedData(uint8_t tag, uint8_t startAddress, uint8_t size);
+		void returnWideData(uint8_t tag, uint32_t startAddress, uint16_t size);
+		void sendFrame(const IoVector vectors[], size_t count);
+		// False and nothing applied when the range is outside the register.
+		bool applyRemoteWrite(size_t startAddress, const uint8_t data[], size_t size);
+		bool inRegister(size_t startAddress, size_t size) const{
+			return startAddress <= registerLength && size <= registerLength - startAddress;
+		}
+		void sendRangeError(Instruction rejected, uint8_t tag, size_t startAddress, size_t size);
+		// A round trip of a request that was sent once.
+		void sampleRtt(uint64_t rtt);
+		// Timeout of a request that waited timeout in vain.
+		uint32_t backOff(uint32_t timeout) const;
+		// First argument of Instruction::capabilities.
+		enum class NegotiationPhase : uint8_t{
+			answer,
+			offer,
+			confirm,
+			commit
+		};
+		// What a negotiation switches.
+		struct LinkSettings{
+			Integrity integrity = Integrity::additive;
+			bool wide = false;
+			bool compression = false;
+			size_t peerMaxPayload = maxWidePayload;
+			uint32_t baudRate = 0;
+		};
+		void sendCapabilities(NegotiationPhase phase);
+		void receiveCapabilities(NegotiationPhase phase, const Capabilities& peer, uint32_t commitWindow);
+		Capabilities agreeWith(const Capabilities& peer) const;
+		LinkSettings settingsFor(const Capabilities& agreed, size_t peerMax) const;
+		LinkSettings currentSettings() const;
+		// False when the interface rate could not be changed.
+		bool applySettings(const LinkSettings& settings);
+		void finishNegotiation(ReadStatus status);
+		void receiveRangeError(Instruction rejected, uint8_t tag, uint32_t startAddress, uint16_t size);
+		// Around every change of flowRegister by the peer.
+		void beginRemoteWrite(size_t startAddress, size_t size);
+		void endRemoteWrite(size_t startAddress, size_t size);
+		void receiveEncodedWrite(uint32_t startAddress, size_t decodedSize, uint8_t codec, const uint8_t data[], size_t size);
+		void receiveEncodedData(size_t decodedSize, uint8_t codec, const uint8_t data[], size_t size);
+		// Sends size bytes from data starting at startAddress, encoded where
+		// that is smaller. Returns the number of bytes sent.
+		size_t writeEncodedFrame(size_t startAddress, const uint8_t data[], size_t size);
+		void markChanged(uint8_t bitmap[], size_t startAddress, size_t size);
+		void serveSubscription(uint8_t id, uint32_t startAddress, uint16_t size, uint16_t period, bool onChange);
+		void endServedSubscription(uint8_t id);
+		void completeSubscription(uint8_t id, uint32_t startAddress, const uint8_t data[], size_t size);
+		// Flags on change subscriptions that overlap the region.
+		void notifySubscriptions(size_t startAddress, size_t size);
+		void pushSubscriptions(uint64_t now);
+		void sendReliableFrame(const ReliableFrame& frame);
+		void retransmitWrites(uint64_t now);
+		void receiveReliableWrite(uint8_t session, uint16_t sequence, uint32_t startAddress, const uint8_t data[], size_t size);
+		void receiveAcknowledgement(uint8_t session, uint16_t nextSequence, bool negative);
+		void countReadLatency(uint64_t latency);
+		void countLatency(StatisticCounter buckets[], uint64_t latency, uint32_t frames);
+		void sendBulk(uint64_t now);
+		void handOffFrame();
+		// Gives untagged returned data to the handler or stores it.
+		void deliverReturnedData(const uint8_t data[], size_t size);
+		// Finds and clears the first marked granule at or after from.
+		bool popChange(uint8_t bitmap[], size_t& startAddress, size_t from, size_t& size);
+		// Largest frame the default BaseSocket::writeVectorToInterface
+		// flattens: start byte, instruction, the longest header, a payload
+		// a peer of this build receives and a CRC-32C trailer.
+		static const size_t maxFlatFrameSize = 2 + maxHeaderArguments + maxPayload + 4;
 		void returnData(const uint8_t data[], size_t arraySize);
 		void returnData(uint8_t data);
-		void sendFlowMessage(uint8_t startAddress, const uint8_t data[], size_t arraySize, Instruction instruction);
-		CircularBuffer<uint8_t, 256> inputBuffer;
+		void sendFlowMessage(Instruction instruction, const uint8_t arguments[], size_t argumentsSize, const uint8_t data[], size_t dataSize);
+		CircularBuffer<uint8_t, FLOW_SERIAL_RETURN_BUFFER_SIZE> inputBuffer;
 		// Temporary store argument data into this buffer until the checksum is
-		// read and checked
-		LinearBuffer<uint8_t, 256> argumentBuffer;
-		uint16_t checksum;         // These two will be compared at the and of an package.
-		uint16_t checksumReceived; // These two will be compared at the and of an package.
-		// keeps track how many arguments were received
-		
+		// read and checked. A frame holds up to maxHeaderArguments header
+		// bytes and maxPayload payload bytes.
+		LinearBuffer<uint8_t, maxHeaderArguments + maxPayload> argumentBuffer;
+		uint32_t checksum;         // These two will be compared at the and of an package.
+		uint32_t checksumReceived; // These two will be compared at the and of an package.
+		#ifndef ARDUINO
+		// See BaseSocket::setCapture.
+		CaptureSink* captureSink = nullptr;
+		#endif
+		// See BaseSocket::setIntegrity.
+		Integrity integrity = Integrity::additive;
+		uint8_t trailerSize = 2;
+		uint8_t trailerReceived = 0;
+		// Checksum of a frame holding only the start byte.
+		uint32_t checksumAfterStart = 0xAA;
+		// keeps track how many payload bytes are still expected
+		size_t argumentsRemaining = 0;
 		State flowSerialState = State::idle;
 		Instruction instruction;
+		// Outgoing frames when batching. See BaseSocket::setBatching.
+		uint8_t txBuffer[txBufferSize > 0 ? txBufferSize : 1];
+		size_t txStored = 0;
+		uint32_t txFrames = 0;
+		uint64_t txOldestFrameTime = 0;
+		// Bulk lane. See BaseSocket::writeBulk.
+		BulkTransfer bulkTransfers[bulkQueue];
+		size_t bulkHead = 0;
+		size_t bulkCount = 0;
+		size_t bulkBytes = 0;
+		size_t bulkBudget = FLOW_SERIAL_TX_BUFFER_SIZE;
+		size_t bulkChunk = 0xFF;
+		TxLane lane = TxLane::control;
+		// See BaseSocket::setRemoteWriteHandler and the two after it.
+		RemoteWriteHandler remoteWriteHandler = nullptr;
+		void* remoteWriteContext = nullptr;
+		ReturnedDataHandler returnedDataHandler = nullptr;
+		void* returnedDataContext = nullptr;
+		UnknownInstructionHandler unknownInstructionHandler = nullptr;
+		void* unknownInstructionContext = nullptr;
+		// Received frames for BaseSocket::takeFrame, one producer and one
+		// consumer.
+		FramePool* handOffPool = nullptr;
+		PooledFrame* handOffFrames[handOffQueue];
+		#ifdef ARDUINO
+		size_t handOffHead = 0;
+		size_t handOffTail = 0;
+		#else
+		atomic<size_t> handOffHead{0};
+		atomic<size_t> handOffTail{0};
+		#endif
+		bool batching = false;
+		size_t flushThreshold = FLOW_SERIAL_TX_BUFFER_SIZE;
+		uint32_t flushDeadline = 0;
+		bool wideMode = false;
+		bool compression = false;
+		// Change tracking. See BaseSocket::setChangeTracking.
+		uint8_t* localChanges = nullptr;
+		uint8_t* remoteChanges = nullptr;
+		uint8_t granuleShift = 0;
+		#ifndef ARDUINO
+		// Seqlocks of the register. See BaseSocket::setSnapshotRegions.
+		atomic<uint32_t>* snapshotSequences = nullptr;
+		atomic<uint32_t>* snapshotGeneration = nullptr;
+		size_t snapshotRegionSize = 1;
+		#endif
+		BasicStatistics<StatisticCounter> statistics;
+		// Parser is skipping bytes in the idle state.
+		bool discarding = false;
+		// Resync. See BaseSocket::setResync.
+		bool resyncEnabled = FLOW_SERIAL_RESYNC != 0;
+		bool replaying = false;
+		bool resyncRestarted = false;
+		uint32_t interByteTimeout = 0;
+		uint64_t lastDataTime = 0;
+		const uint8_t* frameStart = nullptr;
+		size_t resyncStart = 0;
+		size_t resyncEnd = 0;
+		// Instruction, arguments and checksum of the broken frame.
+		uint8_t resyncBuffer[FLOW_SERIAL_RESYNC ? 1 + maxHeaderArguments + maxPayload + 4 : 1];
+		TaggedRead taggedReads[maxTaggedReads];
+		uint8_t nextTag = 0;
+		// Status of the last finished reads, by tag modulo readStatusSlots.
+		FinishedRead readStatus[readStatusSlots];
+		uint32_t readTimeout = 500000;
+		uint8_t readRetries = 5;
+		// See BaseSocket::setAdaptiveTimeout. Times in microseconds.
+		bool adaptiveTimeout = false;
+		uint32_t minTimeout = 1000;
+		uint32_t maxTimeout = 2000000;
+		bool rttMeasured = false;
+		uint32_t smoothedRtt = 0;
+		uint32_t rttVariation = 0;
+		// Current timeout, from the estimate or readTimeout.
+		uint32_t retransmissionTimeout = 500000;
+		// See BaseSocket::negotiate.
+		Capabilities localCapabilities;
+		Capabilities agreedCapabilities;
+		ReadStatus negotiationStatus = ReadStatus::cancelled;
+		uint64_t negotiationSentTime = 0;
+		uint32_t negotiationTimeout = 0;
+		uint8_t negotiationRetriesLeft = 0;
+		NegotiationCallback negotiationCallback = nullptr;
+		void* negotiationContext = nullptr;
+		// Switched and waiting for the commit of the peer.
+		bool negotiationConfirming = false;
+		// Settings from before the switch, restored when it fails.
+		LinkSettings baselineSettings;
+		Capabilities switchedCapabilities;
+		// Answering side: switched and waiting up to confirmationWindow
+		// for the confirmation, then committed until the next offer.
+		bool awaitingConfirmation = false;
+		bool agreementCommitted = false;
+		uint64_t confirmationStart = 0;
+		uint64_t confirmationWindow = 0;
+		// Largest payload the peer receives, unknown until negotiated.
+		size_t peerMaxPayload = maxWidePayload;
+		// Sending side of acknowledged writes, a ring of reliableWindow.
+		ReliableFrame reliableFrames[reliableSlots];
+		size_t reliableHead = 0;
+		size_t reliableCount = 0;
+		uint16_t nextSequence = 0;
+		// Sequences start at 0 in every session. A new session starts after
+		// a failure, and its id tells the peer to forget the old sequence.
+		bool sessionStarted = false;
+		bool sessionSeeded = false;
+		uint8_t session = 0;
+		uint64_t reliableSentTime = 0;
+		uint8_t reliableRetriesLeft = 0;
+		// Receiving side of acknowledged writes.
+		bool reliableReceiving = false;
+		// Set when the peer rejected an untagged read. See BaseSocket::read.
+		bool untaggedReadRejected = false;
+		ReadStatus lastReadStatus = ReadStatus::cancelled;
+		uint8_t receiverSession = 0;
+		uint16_t expectedSequence = 0;
+		bool acknowledgePending = false;
+		bool negativePending = false;
+		ServedSubscription servedSubscriptions[maxSubscriptions];
+		HeldSubscription heldSubscriptions[maxSubscriptions];
 	};
 }
 #endif //_FLOWSERIAL_HPP_
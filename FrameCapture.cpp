@@ -0,0 +1,309 @@
+/** \file	FrameCapture.cpp
+ * \author		Jimmy van den Berg at Flow Engineering
+ * \brief		Capture of FlowSerial links into binary trace files, and
+ * 				replay of those traces.
+ */
+
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(ARDUINO)
+
+#include "FrameCapture.hpp"
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+#ifdef _DEBUG_FLOW_SERIAL_
+#include <iostream>
+#endif
+
+using namespace std;
+
+namespace FlowSerial{
+
+	static_assert(sizeof(TraceRecord) == 16, "TraceRecord must match the trace format");
+
+	static const char traceMagic[8] = {'F', 'S', 'T', 'R', 'A', 'C', 'E', '\0'};
+	static const uint32_t traceVersion = 1;
+	static const uint32_t traceHeaderSize = 16;
+	// Size of a ring record that only says the rest of the ring is unused.
+	static const uint32_t paddingMarker = 0xFFFFFFFF;
+
+	static inline size_t recordSpan(size_t recordSize){
+		return (recordSize + 7) & ~static_cast<size_t>(7);
+	}
+
+	CaptureRing::CaptureRing(uint8_t istorage[], size_t icapacity):
+		storage(istorage),
+		capacity(icapacity),
+		head(0),
+		tail(0),
+		droppedEvents(0)
+	{
+		if(capacity < 64 || (capacity & (capacity - 1)) != 0){
+			throw invalid_argument("CaptureRing capacity must be a power of two of at least 64 bytes");
+		}
+		if(reinterpret_cast<uintptr_t>(storage) % 8 != 0){
+			throw invalid_argument("CaptureRing storage must be aligned to 8 bytes");
+		}
+		memset(storage, 0, capacity);
+	}
+
+	atomic<uint32_t>* CaptureRing::sizeAt(size_t offset) const{
+		return reinterpret_cast<atomic<uint32_t>*>(&storage[offset]);
+	}
+
+	void CaptureRing::capture(CaptureEvent event, Instruction instruction, uint64_t micros, const IoVector vectors[], size_t count){
+		size_t recordSize = sizeof(TraceRecord);
+		for (size_t i = 0; i < count; ++i){
+			recordSize += vectors[i].size;
+		}
+		size_t needed = recordSpan(recordSize);
+		// Reserve space. A record never wraps, the end of the ring is
+		// skipped instead.
+		uint64_t reserved = head.load(memory_order_relaxed);
+		size_t padding;
+		while(true){
+			size_t toEnd = capacity - (reserved & (capacity - 1));
+			padding = needed <= toEnd ? 0 : toEnd;
+			if(reserved + padding + needed - tail.load(memory_order_acquire) > capacity){
+				droppedEvents.fetch_add(1, memory_order_relaxed);
+				return;
+			}
+			if(head.compare_exchange_weak(reserved, reserved + padding + needed, memory_order_relaxed)){
+				break;
+			}
+		}
+		if(padding > 0){
+			sizeAt(reserved & (capacity - 1))->store(paddingMarker, memory_order_release);
+		}
+		size_t offset = (reserved + padding) & (capacity - 1);
+		TraceRecord record;
+		record.size = 0;
+		record.event = static_cast<uint8_t>(event);
+		record.instruction = static_cast<uint8_t>(instruction);
+		record.reserved = 0;
+		record.micros = micros;
+		// The size goes in last, it tells drain the record is complete.
+		memcpy(&storage[offset + sizeof(uint32_t)], reinterpret_cast<uint8_t*>(&record) + sizeof(uint32_t), sizeof(TraceRecord) - sizeof(uint32_t));
+		size_t position = offset + sizeof(TraceRecord);
+		for (size_t i = 0; i < count; ++i){
+			if(vectors[i].size > 0){
+				memcpy(&storage[position], vectors[i].data, vectors[i].size);
+				position += vectors[i].size;
+			}
+		}
+		sizeAt(offset)->store(static_cast<uint32_t>(recordSize), memory_order_release);
+	}
+
+	size_t CaptureRing::drain(TraceFile& file){
+		size_t written = 0;
+		uint64_t current = tail.load(memory_order_relaxed);
+		while(true){
+			size_t offset = current & (capacity - 1);
+			size_t span = 0;
+			bool skipToEnd = false;
+			while(offset + span < capacity){
+				uint32_t size = sizeAt(offset + span)->load(memory_order_acquire);
+				if(size == 0){
+					break;
+				}
+				if(size == paddingMarker){
+					skipToEnd = true;
+					break;
+				}
+				span += recordSpan(size);
+			}
+			if(span > 0){
+				file.append(&storage[offset], span);
+				written += span;
+			}
+			size_t consumed = skipToEnd ? capacity - offset : span;
+			if(consumed == 0){
+				return written;
+			}
+			// Producers expect free space to be zero.
+			memset(&storage[offset], 0, consumed);
+			current += consumed;
+			tail.store(current, memory_order_release);
+			if(offset + consumed < capacity){
+				// Stopped at a record that is not complete yet.
+				return written;
+			}
+		}
+	}
+
+	TraceFile::TraceFile(const char* ipath):
+		path(ipath)
+	{
+		fd = open(ipath, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if(fd < 0){
+			throw system_error(errno, system_category(), "Could not open trace " + path);
+		}
+		struct stat status;
+		if(fstat(fd, &status) != 0){
+			int error = errno;
+			close(fd);
+			throw system_error(error, system_category(), "Could not inspect trace " + path);
+		}
+		size_t fileSize = status.st_size;
+		if(fileSize == 0){
+			uint8_t header[traceHeaderSize];
+			memcpy(header, traceMagic, sizeof(traceMagic));
+			memcpy(&header[8], &traceVersion, sizeof(traceVersion));
+			memcpy(&header[12], &traceHeaderSize, sizeof(traceHeaderSize));
+			try{
+				append(header, sizeof(header));
+			}
+			catch(...){
+				close(fd);
+				throw;
+			}
+			return;
+		}
+		uint8_t header[traceHeaderSize];
+		uint32_t headerSize = 0;
+		if(fileSize < traceHeaderSize || pread(fd, header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header))
+			|| memcmp(header, traceMagic, sizeof(traceMagic)) != 0){
+			close(fd);
+			throw runtime_error(path + " is not a FlowSerial trace");
+		}
+		memcpy(&headerSize, &header[12], sizeof(headerSize));
+		// Cut off a record a crash left half written, or new records would
+		// not line up.
+		size_t end = headerSize;
+		TraceRecord record;
+		while(end + sizeof(record) <= fileSize
+			&& pread(fd, &record, sizeof(record), end) == static_cast<ssize_t>(sizeof(record))
+			&& record.size >= sizeof(record) && end + record.size <= fileSize){
+			end += recordSpan(record.size);
+		}
+		if(end < fileSize){
+			#ifdef _DEBUG_FLOW_SERIAL_
+			cout << "trace " << path << " cut from " << fileSize << " to " << end << " bytes" << endl;
+			#endif
+			if(ftruncate(fd, end) != 0){
+				int error = errno;
+				close(fd);
+				throw system_error(error, system_category(), "Could not repair trace " + path);
+			}
+		}
+	}
+
+	TraceFile::~TraceFile(){
+		close(fd);
+	}
+
+	void TraceFile::append(const uint8_t data[], size_t size){
+		while(size > 0){
+			ssize_t written = write(fd, data, size);
+			if(written < 0){
+				if(errno == EINTR){
+					continue;
+				}
+				throw system_error(errno, system_category(), "Could not write trace " + path);
+			}
+			data += written;
+			size -= written;
+		}
+	}
+
+	void TraceFile::sync(){
+		if(fsync(fd) != 0){
+			throw system_error(errno, system_category(), "Could not sync trace " + path);
+		}
+	}
+
+	TraceReader::TraceReader(const char* ipath):
+		path(ipath)
+	{
+		int fd = open(ipath, O_RDONLY | O_CLOEXEC);
+		if(fd < 0){
+			throw system_error(errno, system_category(), "Could not open trace " + path);
+		}
+		struct stat status;
+		if(fstat(fd, &status) != 0){
+			int error = errno;
+			close(fd);
+			throw system_error(error, system_category(), "Could not inspect trace " + path);
+		}
+		if(static_cast<size_t>(status.st_size) < traceHeaderSize){
+			close(fd);
+			throw runtime_error(path + " is not a FlowSerial trace");
+		}
+		void* map = mmap(nullptr, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		int error = errno;
+		close(fd);
+		if(map == MAP_FAILED){
+			throw system_error(error, system_category(), "Could not map trace " + path);
+		}
+		mapping = static_cast<const uint8_t*>(map);
+		mappedSize = status.st_size;
+		uint32_t headerSize;
+		memcpy(&headerSize, &mapping[12], sizeof(headerSize));
+		if(memcmp(mapping, traceMagic, sizeof(traceMagic)) != 0 || headerSize < traceHeaderSize || headerSize > mappedSize){
+			munmap(const_cast<uint8_t*>(mapping), mappedSize);
+			throw runtime_error(path + " is not a FlowSerial trace");
+		}
+		first = headerSize;
+		position = first;
+	}
+
+	TraceReader::~TraceReader(){
+		munmap(const_cast<uint8_t*>(mapping), mappedSize);
+	}
+
+	bool TraceReader::next(TraceEntry& entry){
+		TraceRecord record;
+		if(position + sizeof(record) > mappedSize){
+			return false;
+		}
+		memcpy(&record, &mapping[position], sizeof(record));
+		if(record.size < sizeof(record) || record.size > mappedSize - position){
+			// Cut short, the writer was still busy or crashed.
+			return false;
+		}
+		entry.event = static_cast<CaptureEvent>(record.event);
+		entry.instruction = static_cast<Instruction>(record.instruction);
+		entry.micros = record.micros;
+		entry.data = &mapping[position + sizeof(record)];
+		entry.size = record.size - sizeof(record);
+		position += recordSpan(record.size);
+		return true;
+	}
+
+	void TraceReader::rewind(){
+		position = first;
+	}
+
+	size_t TraceReader::replay(BaseSocket& socket, bool recordedSpeed){
+		typedef chrono::steady_clock Clock;
+		size_t fed = 0;
+		bool started = false;
+		uint64_t firstMicros = 0;
+		Clock::time_point start;
+		TraceEntry entry;
+		while(next(entry)){
+			if(entry.event != CaptureEvent::bytesReceived){
+				continue;
+			}
+			if(recordedSpeed){
+				if(!started){
+					started = true;
+					firstMicros = entry.micros;
+					start = Clock::now();
+				}
+				this_thread::sleep_until(start + chrono::microseconds(entry.micros - firstMicros));
+			}
+			socket.handleData(entry.data, entry.size);
+			fed += entry.size;
+		}
+		return fed;
+	}
+}
+
+#endif
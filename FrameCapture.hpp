@@ -0,0 +1,170 @@
+/** \file	FrameCapture.hpp
+ * \author		Jimmy van den Berg at Flow Engineering
+ * \brief		Capture of FlowSerial links into binary trace files, and
+ * 				replay of those traces.
+ * \details 	A CaptureRing is given to BaseSocket::setCapture. It copies
+ * 				every event into a lock free ring without blocking the link.
+ * 				Another thread drains the ring into a TraceFile now and then.
+ * 				A TraceReader maps a trace into memory and feeds the
+ * 				received bytes back into a socket, at recorded speed or as
+ * 				fast as possible.
+ *
+ * 				Trace file format, all little endian:
+ *
+ * 				    magic "FSTRACE\0", uint32 version, uint32 header size
+ * 				    records, each padded to a multiple of 8 bytes:
+ * 				        uint32 size     header and data, without padding
+ * 				        uint8  event    FlowSerial::CaptureEvent
+ * 				        uint8  instruction
+ * 				        uint16 reserved
+ * 				        uint64 micros   BaseSocket::currentMicros
+ * 				        data
+ *
+ * 				Files are only appended to. A record cut short by a crash
+ * 				is ignored by the reader.
+ */
+
+#ifndef _FLOWSERIAL_FRAMECAPTURE_HPP_
+#define _FLOWSERIAL_FRAMECAPTURE_HPP_
+
+#include "FlowSerial.hpp"
+#include <atomic>
+#include <string>
+
+namespace FlowSerial{
+	/**
+	 * @brief      Header in front of every record of a trace.
+	 */
+	struct TraceRecord{
+		uint32_t size;
+		uint8_t event;
+		uint8_t instruction;
+		uint16_t reserved;
+		uint64_t micros;
+	};
+
+	class TraceFile;
+
+	/**
+	 * @brief      Lock free ring of captured events, in trace format.
+	 * @details    Any number of threads may capture at the same time, one
+	 *             thread drains. Events that do not fit are dropped and
+	 *             counted, capturing never waits. Records are laid out
+	 *             exactly as in the trace file, so draining is a plain
+	 *             write of whole runs of records.
+	 */
+	class CaptureRing : public CaptureSink{
+	public:
+		/**
+		 * @brief      Constructor. Throws std::invalid_argument when the
+		 *             storage is not usable.
+		 *
+		 * @param      storage   Buffer for the ring, aligned to 8 bytes.
+		 * @param[in]  capacity  Size of storage, a power of two of at least
+		 *                       64 bytes.
+		 */
+		CaptureRing(uint8_t storage[], size_t capacity);
+		void capture(CaptureEvent event, Instruction instruction, uint64_t micros, const IoVector vectors[], size_t count);
+		/**
+		 * @brief      Writes all complete records to a trace file. Call from
+		 *             one thread only.
+		 *
+		 * @param      file  The trace.
+		 *
+		 * @return     Number of bytes written.
+		 */
+		size_t drain(TraceFile& file);
+		/**
+		 * @return     Number of events that did not fit.
+		 */
+		uint64_t dropped() const { return droppedEvents.load(memory_order_relaxed); }
+	private:
+		atomic<uint32_t>* sizeAt(size_t offset) const;
+		uint8_t* storage;
+		size_t capacity;
+		atomic<uint64_t> head;
+		atomic<uint64_t> tail;
+		atomic<uint64_t> droppedEvents;
+	};
+
+	/**
+	 * @brief      Trace file opened for appending. Writes the file header
+	 *             when the file is new. Throws std::system_error when the
+	 *             file can not be opened or written and std::runtime_error
+	 *             when an existing file is not a trace.
+	 */
+	class TraceFile{
+	public:
+		explicit TraceFile(const char* path);
+		~TraceFile();
+		TraceFile(const TraceFile&) = delete;
+		TraceFile& operator=(const TraceFile&) = delete;
+		/**
+		 * @brief      Appends whole records.
+		 */
+		void append(const uint8_t data[], size_t size);
+		/**
+		 * @brief      Waits until everything appended is on disk.
+		 */
+		void sync();
+	private:
+		int fd;
+		string path;
+	};
+
+	/**
+	 * @brief      One record of a trace, see TraceReader::next.
+	 */
+	struct TraceEntry{
+		CaptureEvent event;
+		Instruction instruction;
+		uint64_t micros;
+		const uint8_t* data;
+		size_t size;
+	};
+
+	/**
+	 * @brief      Maps a trace file read only. Throws like TraceFile.
+	 */
+	class TraceReader{
+	public:
+		explicit TraceReader(const char* path);
+		~TraceReader();
+		TraceReader(const TraceReader&) = delete;
+		TraceReader& operator=(const TraceReader&) = delete;
+		/**
+		 * @brief      Gets the next record. Its data points into the
+		 *             mapping and stays valid while the reader lives.
+		 *
+		 * @param      entry  Receives the record.
+		 *
+		 * @return     False at the end of the trace.
+		 */
+		bool next(TraceEntry& entry);
+		/**
+		 * @brief      Starts over at the first record.
+		 */
+		void rewind();
+		/**
+		 * @brief      Feeds all CaptureEvent::bytesReceived records, from the
+		 *             current one on, into BaseSocket::handleData.
+		 *
+		 * @param      socket          The socket, usually with its
+		 *                             writeToInterface going nowhere.
+		 * @param[in]  recordedSpeed   True to wait between records as long
+		 *                             as was recorded, false to go as fast
+		 *                             as possible.
+		 *
+		 * @return     Number of bytes fed.
+		 */
+		size_t replay(BaseSocket& socket, bool recordedSpeed);
+	private:
+		string path;
+		const uint8_t* mapping = nullptr;
+		size_t mappedSize = 0;
+		size_t position = 0;
+		size_t first = 0;
+	};
+}
+
+#endif //_FLOWSERIAL_FRAMECAPTURE_HPP_
@@ -0,0 +1,158 @@
+/** \file	FramePool.cpp
+ * \author		Jimmy van den Berg at Flow Engineering
+ * \brief		Fixed capacity pool of frame buffers.
+ */
+
+#include "FramePool.hpp"
+#ifndef ARDUINO
+#include <stdexcept>
+#include <thread>
+#endif
+#ifdef _DEBUG_FLOW_SERIAL_
+#include <iostream>
+#endif
+
+using namespace std;
+
+namespace FlowSerial{
+
+	FramePool::FramePool(uint8_t istorage[], size_t islots, size_t iframeCapacity, PoolExhaustion iexhaustion):
+		storage(istorage),
+		slotCount(islots),
+		capacity(iframeCapacity),
+		stride(slotStride(iframeCapacity)),
+		exhaustion(iexhaustion)
+	{
+		#ifdef ARDUINO
+		// No exceptions, an unusable pool has no slots.
+		if(slotCount >= none || reinterpret_cast<uintptr_t>(storage) % alignof(PooledFrame) != 0){
+			slotCount = 0;
+		}
+		#else
+		if(slotCount >= none){
+			throw invalid_argument("FlowSerial: a frame pool holds at most 65534 frames");
+		}
+		if(reinterpret_cast<uintptr_t>(storage) % alignof(PooledFrame) != 0){
+			throw invalid_argument("FlowSerial: frame pool storage is not aligned");
+		}
+		#endif
+		for (size_t i = 0; i < slotCount; ++i){
+			slot(i)->next = i + 1 < slotCount ? i + 1 : none;
+			slot(i)->size = 0;
+		}
+		#ifdef ARDUINO
+		freeHead = slotCount > 0 ? 0 : none;
+		#else
+		freeHead.store(slotCount > 0 ? 0 : none, memory_order_relaxed);
+		#endif
+	}
+
+	PooledFrame* FramePool::slot(uint16_t index) const{
+		return reinterpret_cast<PooledFrame*>(&storage[index * stride]);
+	}
+
+	bool FramePool::tryAcquire(PooledFrame*& frame){
+		#ifdef ARDUINO
+		if(freeHead == none){
+			return false;
+		}
+		frame = slot(freeHead);
+		freeHead = frame->next;
+		size_t nowUsed = ++used;
+		if(nowUsed > mostUsed){
+			mostUsed = nowUsed;
+		}
+		#else
+		uint32_t head = freeHead.load(memory_order_acquire);
+		while(true){
+			uint16_t index = head & 0xFFFF;
+			if(index == none){
+				return false;
+			}
+			// A stale next only makes the exchange fail, the counter in the
+			// high half changed.
+			uint32_t replacement = ((head & 0xFFFF0000) + 0x10000) | slot(index)->next;
+			if(freeHead.compare_exchange_weak(head, replacement, memory_order_acquire, memory_order_acquire)){
+				frame = slot(index);
+				break;
+			}
+		}
+		size_t nowUsed = used.fetch_add(1, memory_order_relaxed) + 1;
+		size_t most = mostUsed.load(memory_order_relaxed);
+		while(nowUsed > most && !mostUsed.compare_exchange_weak(most, nowUsed, memory_order_relaxed)){
+		}
+		#endif
+		return true;
+	}
+
+	PooledFrame* FramePool::acquire(){
+		PooledFrame* frame = nullptr;
+		if(!tryAcquire(frame)){
+			exhausted.add(1);
+			#ifdef _DEBUG_FLOW_SERIAL_
+			cout << "frame pool exhausted" << endl;
+			#endif
+			switch(exhaustion){
+				case PoolExhaustion::error:
+					#ifndef ARDUINO
+					throw runtime_error("FlowSerial: frame pool exhausted");
+					#endif
+				case PoolExhaustion::block:
+					#ifndef ARDUINO
+					while(!tryAcquire(frame)){
+						this_thread::yield();
+					}
+					break;
+					#endif
+				case PoolExhaustion::drop:
+					return nullptr;
+			}
+		}
+		acquired.add(1);
+		frame->size = 0;
+		return frame;
+	}
+
+	void FramePool::release(PooledFrame* frame){
+		uint16_t index = (reinterpret_cast<uint8_t*>(frame) - storage) / stride;
+		#ifdef ARDUINO
+		frame->next = freeHead;
+		freeHead = index;
+		--used;
+		#else
+		used.fetch_sub(1, memory_order_relaxed);
+		uint32_t head = freeHead.load(memory_order_relaxed);
+		do{
+			frame->next = head & 0xFFFF;
+		} while(!freeHead.compare_exchange_weak(head, ((head & 0xFFFF0000) + 0x10000) | index, memory_order_release, memory_order_relaxed));
+		#endif
+	}
+
+	void FramePool::setExhaustion(PoolExhaustion iexhaustion){
+		exhaustion = iexhaustion;
+	}
+
+	size_t FramePool::inUse() const{
+		#ifdef ARDUINO
+		return used;
+		#else
+		return used.load(memory_order_relaxed);
+		#endif
+	}
+
+	size_t FramePool::highWater() const{
+		#ifdef ARDUINO
+		return mostUsed;
+		#else
+		return mostUsed.load(memory_order_relaxed);
+		#endif
+	}
+
+	uint32_t FramePool::acquisitions() const{
+		return acquired.get();
+	}
+
+	uint32_t FramePool::exhaustions() const{
+		return exhausted.get();
+	}
+}
@@ -0,0 +1,134 @@
+/** \file	FramePool.hpp
+ * \author		Jimmy van den Berg at Flow Engineering
+ * \brief		Fixed capacity pool of frame buffers.
+ * \details 	Frames that outlive the call that made them, like received
+ * 				frames handed out of BaseSocket::handleData, live in a pool
+ * 				with a fixed number of slots in storage given by the caller.
+ * 				Nothing is allocated after construction, so it is safe on
+ * 				real time threads and on microcontrollers.
+ */
+
+#ifndef _FLOWSERIAL_FRAMEPOOL_HPP_
+#define _FLOWSERIAL_FRAMEPOOL_HPP_
+
+#include "FlowSerial.hpp"
+
+namespace FlowSerial{
+	/**
+	 * @brief      What FramePool::acquire does when all slots are in use.
+	 */
+	enum class PoolExhaustion : uint8_t{
+		// Return nullptr. The caller drops the frame.
+		drop,
+		// Wait until another thread releases a slot. Same as drop on
+		// Arduino, where there is no other thread.
+		block,
+		// Throw std::runtime_error. Same as drop on Arduino, which has no
+		// exceptions.
+		error
+	};
+
+	/**
+	 * @brief      A frame in a FramePool. Its data follows the header.
+	 */
+	struct PooledFrame{
+		Instruction instruction;
+		// Free list link, used by the pool.
+		uint16_t next;
+		// Bytes used in data().
+		size_t size;
+		uint8_t* data(){ return reinterpret_cast<uint8_t*>(this + 1); }
+		const uint8_t* data() const { return reinterpret_cast<const uint8_t*>(this + 1); }
+	};
+
+	/**
+	 * @brief      Lock free pool of equally sized frame slots.
+	 * @details    Slots are kept on a free list that any thread may take
+	 *             from and give back to. Counters tell how full the pool
+	 *             got and how often it ran out.
+	 */
+	class FramePool{
+	public:
+		/**
+		 * @brief      Size of one slot in the storage, header included.
+		 */
+		static constexpr size_t slotStride(size_t frameCapacity){
+			return (sizeof(PooledFrame) + frameCapacity + alignof(PooledFrame) - 1) / alignof(PooledFrame) * alignof(PooledFrame);
+		}
+		/**
+		 * @brief      Storage a pool of slots frames needs.
+		 */
+		static constexpr size_t storageSize(size_t slots, size_t frameCapacity){
+			return slots * slotStride(frameCapacity);
+		}
+		/**
+		 * @brief      Constructor. Throws std::invalid_argument for more than
+		 *             65534 slots or misaligned storage. Index 65535 marks the
+		 *             end of the free list. On Arduino the pool gets no
+		 *             slots instead, see FramePool::slots.
+		 *
+		 * @param      storage        FramePool::storageSize bytes, aligned
+		 *                            for PooledFrame.
+		 * @param[in]  slots          Number of frames.
+		 * @param[in]  frameCapacity  Bytes of data per frame.
+		 * @param[in]  exhaustion     Behaviour of acquire on an empty pool.
+		 */
+		FramePool(uint8_t storage[], size_t slots, size_t frameCapacity, PoolExhaustion exhaustion = PoolExhaustion::drop);
+		FramePool(const FramePool&) = delete;
+		FramePool& operator=(const FramePool&) = delete;
+		/**
+		 * @brief      Takes a free frame, with size 0.
+		 *
+		 * @return     The frame or nullptr, see PoolExhaustion.
+		 */
+		PooledFrame* acquire();
+		/**
+		 * @brief      Gives a frame of this pool back.
+		 */
+		void release(PooledFrame* frame);
+		void setExhaustion(PoolExhaustion exhaustion);
+		size_t frameCapacity() const { return capacity; }
+		size_t slots() const { return slotCount; }
+		/**
+		 * @brief      Frames taken and not released.
+		 */
+		size_t inUse() const;
+		/**
+		 * @brief      Most frames that were in use at the same time.
+		 */
+		size_t highWater() const;
+		/**
+		 * @brief      Number of successful acquire calls.
+		 */
+		uint32_t acquisitions() const;
+		/**
+		 * @brief      Times acquire found the pool empty, whatever the policy
+		 *             did about it.
+		 */
+		uint32_t exhaustions() const;
+	private:
+		static const uint16_t none = 0xFFFF;
+		PooledFrame* slot(uint16_t index) const;
+		bool tryAcquire(PooledFrame*& frame);
+		uint8_t* storage;
+		size_t slotCount;
+		size_t capacity;
+		size_t stride;
+		PoolExhaustion exhaustion;
+		#ifdef ARDUINO
+		uint16_t freeHead;
+		size_t used = 0;
+		size_t mostUsed = 0;
+		#else
+		// Index of the first free slot in the low half, a counter against
+		// ABA in the high half.
+		atomic<uint32_t> freeHead;
+		atomic<size_t> used{0};
+		atomic<size_t> mostUsed{0};
+		#endif
+		StatisticCounter acquired;
+		StatisticCounter exhausted;
+	};
+}
+
+#endif //_FLOWSERIAL_FRAMEPOOL_HPP_
@@ -0,0 +1,394 @@
+/** \file	NetworkSocket.cpp
+ * \author		Jimmy van den Berg at Flow Engineering
+ * \brief		FlowSerial over TCP and UDP.
+ */
+
+#ifdef __linux__
+
+#include "NetworkSocket.hpp"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdexcept>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <system_error>
+#include <unistd.h>
+#ifdef _DEBUG_FLOW_SERIAL_
+#include <iostream>
+#endif
+
+using namespace std;
+
+namespace FlowSerial{
+
+	static int waitReadable(int fd, uint32_t timeout){
+		pollfd request = {fd, POLLIN, 0};
+		int ready = poll(&request, 1, static_cast<int>((timeout + 999) / 1000));
+		if(ready < 0 && errno != EINTR){
+			throw system_error(errno, system_category(), "FlowSerial: poll");
+		}
+		return ready;
+	}
+
+	// Blocks until the send buffer has room again.
+	static void waitWritable(int fd){
+		pollfd request = {fd, POLLOUT, 0};
+		if(poll(&request, 1, -1) < 0 && errno != EINTR){
+			throw system_error(errno, system_category(), "FlowSerial: poll");
+		}
+	}
+
+	StreamSocket::StreamSocket(const char* host, uint16_t port, uint8_t* iflowRegister, size_t iregisterLength):
+		BaseSocket(iflowRegister, iregisterLength)
+	{
+		addrinfo hints = {};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		char service[6];
+		snprintf(service, sizeof(service), "%u", port);
+		addrinfo* results;
+		int error = getaddrinfo(host, service, &hints, &results);
+		if(error != 0){
+			throw runtime_error(string("FlowSerial: ") + gai_strerror(error));
+		}
+		fd = -1;
+		int lastError = 0;
+		for (addrinfo* result = results; result != nullptr && fd < 0; result = result->ai_next){
+			fd = socket(result->ai_family, result->ai_socktype | SOCK_CLOEXEC, result->ai_protocol);
+			if(fd >= 0 && connect(fd, result->ai_addr, result->ai_addrlen) < 0){
+				lastError = errno;
+				close(fd);
+				fd = -1;
+			}
+		}
+		freeaddrinfo(results);
+		if(fd < 0){
+			throw system_error(lastError, system_category(), "FlowSerial: connect");
+		}
+		configure();
+	}
+
+	StreamSocket::StreamSocket(int connectedFd, uint8_t* iflowRegister, size_t iregisterLength):
+		BaseSocket(iflowRegister, iregisterLength),
+		fd(connectedFd)
+	{
+		configure();
+	}
+
+	StreamSocket::~StreamSocket(){
+		close(fd);
+	}
+
+	void StreamSocket::configure(){
+		int enable = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+		setBatching(true, FLOW_SERIAL_TX_BUFFER_SIZE, 1000);
+	}
+
+	size_t StreamSocket::receive(uint32_t timeout){
+		flush();
+		if(waitReadable(fd, timeout) <= 0){
+			return 0;
+		}
+		ssize_t received = recv(fd, readBuffer, sizeof(readBuffer), MSG_DONTWAIT);
+		if(received == 0){
+			throw runtime_error("FlowSerial: connection closed");
+		}
+		if(received < 0){
+			if(errno == EINTR || errno == EAGAIN){
+				return 0;
+			}
+			throw system_error(errno, system_category(), "FlowSerial: recv");
+		}
+		handleData(readBuffer, static_cast<size_t>(received));
+		// Send the replies right away.
+		flush();
+		return static_cast<size_t>(received);
+	}
+
+	int StreamSocket::fileDescriptor() const{
+		return fd;
+	}
+
+	void StreamSocket::writeToInterface(const uint8_t data[], size_t size){
+		IoVector vector = {data, size};
+		writeVectorToInterface(&vector, 1);
+	}
+
+	void StreamSocket::writeVectorToInterface(const IoVector vectors[], size_t count){
+		const size_t maxVectors = 16;
+		iovec parts[maxVectors];
+		size_t first = 0;
+		size_t offset = 0;
+		while(first < count){
+			size_t used = 0;
+			for (size_t i = first; i < count && used < maxVectors; ++i, ++used){
+				size_t skip = i == first ? offset : 0;
+				parts[used].iov_base = const_cast<uint8_t*>(vectors[i].data + skip);
+				parts[used].iov_len = vectors[i].size - skip;
+			}
+			msghdr message = {};
+			message.msg_iov = parts;
+			message.msg_iovlen = used;
+			ssize_t written = sendmsg(fd, &message, MSG_NOSIGNAL);
+			if(written < 0){
+				if(errno == EINTR){
+					continue;
+				}
+				if(errno == EAGAIN || errno == EWOULDBLOCK){
+					// The window of the peer is full.
+					waitWritable(fd);
+					continue;
+				}
+				throw system_error(errno, system_category(), "FlowSerial: send");
+			}
+			size_t remaining = static_cast<size_t>(written);
+			while(first < count && remaining >= vectors[first].size - offset){
+				remaining -= vectors[first].size - offset;
+				offset = 0;
+				++first;
+			}
+			offset += remaining;
+		}
+	}
+
+	void StreamSocket::receiveFromInterface(uint32_t timeout){
+		receive(timeout);
+	}
+
+	DatagramEndpoint::DatagramEndpoint(uint16_t port){
+		fd = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if(fd < 0){
+			throw system_error(errno, system_category(), "FlowSerial: socket");
+		}
+		// Accept IPv4 peers too, as mapped addresses.
+		int disable = 0;
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &disable, sizeof(disable));
+		sockaddr_in6 local = {};
+		local.sin6_family = AF_INET6;
+		local.sin6_addr = in6addr_any;
+		local.sin6_port = htons(port);
+		if(bind(fd, reinterpret_cast<sockaddr*>(&local), sizeof(local)) < 0){
+			int error = errno;
+			close(fd);
+			throw system_error(error, system_category(), "FlowSerial: bind");
+		}
+	}
+
+	DatagramEndpoint::~DatagramEndpoint(){
+		close(fd);
+	}
+
+	size_t DatagramEndpoint::poll(uint32_t timeout){
+		flush();
+		size_t received = receive(timeout);
+		for (DatagramSocket* peer : peers){
+			peer->update();
+			peer->flush();
+		}
+		flush();
+		return received;
+	}
+
+	size_t DatagramEndpoint::receive(uint32_t timeout){
+		if(waitReadable(fd, timeout) <= 0){
+			return 0;
+		}
+		mmsghdr messages[FLOW_SERIAL_DATAGRAM_BATCH];
+		iovec parts[FLOW_SERIAL_DATAGRAM_BATCH];
+		sockaddr_storage addresses[FLOW_SERIAL_DATAGRAM_BATCH];
+		for (size_t i = 0; i < FLOW_SERIAL_DATAGRAM_BATCH; ++i){
+			parts[i].iov_base = receiveData[i];
+			parts[i].iov_len = sizeof(receiveData[i]);
+			memset(&messages[i].msg_hdr, 0, sizeof(messages[i].msg_hdr));
+			messages[i].msg_hdr.msg_iov = &parts[i];
+			messages[i].msg_hdr.msg_iovlen = 1;
+			messages[i].msg_hdr.msg_name = &addresses[i];
+			messages[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+		}
+		int count = recvmmsg(fd, messages, FLOW_SERIAL_DATAGRAM_BATCH, MSG_DONTWAIT, nullptr);
+		if(count < 0){
+			if(errno == EINTR || errno == EAGAIN){
+				return 0;
+			}
+			throw system_error(errno, system_category(), "FlowSerial: recvmmsg");
+		}
+		for (int i = 0; i < count; ++i){
+			const msghdr& header = messages[i].msg_hdr;
+			DatagramSocket* from = nullptr;
+			if(lastPeer != nullptr && lastPeer->addressLength == header.msg_namelen
+				&& memcmp(&lastPeer->address, header.msg_name, header.msg_namelen) == 0){
+				from = lastPeer;
+			}
+			for (size_t j = 0; from == nullptr && j < peers.size(); ++j){
+				if(peers[j]->addressLength == header.msg_namelen
+					&& memcmp(&peers[j]->address, header.msg_name, header.msg_namelen) == 0){
+					from = peers[j];
+				}
+			}
+			if(from == nullptr || (header.msg_flags & MSG_TRUNC)){
+				++dropped;
+				continue;
+			}
+			lastPeer = from;
+			from->handleData(receiveData[i], messages[i].msg_len);
+			// The next datagram starts with a new frame.
+			from->dropPartialFrame();
+		}
+		return static_cast<size_t>(count);
+	}
+
+	void DatagramEndpoint::flush(){
+		mmsghdr messages[FLOW_SERIAL_DATAGRAM_BATCH];
+		iovec parts[FLOW_SERIAL_DATAGRAM_BATCH];
+		size_t sent = 0;
+		while(sent < stagedCount){
+			size_t count = 0;
+			for (size_t i = sent; i < stagedCount; ++i, ++count){
+				parts[count].iov_base = stagedData[i];
+				parts[count].iov_len = staged[i].size;
+				memset(&messages[count].msg_hdr, 0, sizeof(messages[count].msg_hdr));
+				messages[count].msg_hdr.msg_iov = &parts[count];
+				messages[count].msg_hdr.msg_iovlen = 1;
+				messages[count].msg_hdr.msg_name = const_cast<sockaddr*>(staged[i].address);
+				messages[count].msg_hdr.msg_namelen = staged[i].addressLength;
+			}
+			int result = sendmmsg(fd, messages, count, 0);
+			if(result < 0){
+				if(errno == EINTR){
+					continue;
+				}
+				// Like a lost datagram, the protocol recovers from this.
+				#ifdef _DEBUG_FLOW_SERIAL_
+				cout << "FlowSerial: sendmmsg failed, dropping " << stagedCount - sent << " datagrams" << endl;
+				#endif
+				break;
+			}
+			sent += static_cast<size_t>(result);
+		}
+		stagedCount = 0;
+	}
+
+	int DatagramEndpoint::fileDescriptor() const{
+		return fd;
+	}
+
+	uint16_t DatagramEndpoint::localPort() const{
+		sockaddr_in6 local = {};
+		socklen_t length = sizeof(local);
+		getsockname(fd, reinterpret_cast<sockaddr*>(&local), &length);
+		return ntohs(local.sin6_port);
+	}
+
+	uint32_t DatagramEndpoint::droppedDatagrams() const{
+		return dropped;
+	}
+
+	void DatagramEndpoint::attach(DatagramSocket* peer){
+		peers.push_back(peer);
+	}
+
+	void DatagramEndpoint::detach(DatagramSocket* peer){
+		for (size_t i = 0; i < peers.size(); ++i){
+			if(peers[i] == peer){
+				peers.erase(peers.begin() + i);
+				break;
+			}
+		}
+		// Staged datagrams point at the address of the peer.
+		size_t kept = 0;
+		for (size_t i = 0; i < stagedCount; ++i){
+			if(staged[i].address != reinterpret_cast<const sockaddr*>(&peer->address)){
+				if(kept != i){
+					staged[kept] = staged[i];
+					memcpy(stagedData[kept], stagedData[i], staged[i].size);
+				}
+				++kept;
+			}
+		}
+		stagedCount = kept;
+		if(lastPeer == peer){
+			lastPeer = nullptr;
+		}
+	}
+
+	void DatagramEndpoint::stage(const sockaddr* address, socklen_t addressLength, const IoVector vectors[], size_t count){
+		size_t frameSize = 0;
+		for (size_t i = 0; i < count; ++i){
+			frameSize += vectors[i].size;
+		}
+		if(frameSize > FLOW_SERIAL_DATAGRAM_SIZE){
+			// The receiver would drop the part in the first datagram.
+			++dropped;
+			return;
+		}
+		// Continue the last datagram when it goes to the same peer and the
+		// whole frame fits.
+		if(stagedCount == 0 || staged[stagedCount - 1].address != address
+			|| staged[stagedCount - 1].size + frameSize > FLOW_SERIAL_DATAGRAM_SIZE){
+			if(stagedCount == FLOW_SERIAL_DATAGRAM_BATCH){
+				flush();
+			}
+			staged[stagedCount++] = Staged{address, addressLength, 0};
+		}
+		Staged& last = staged[stagedCount - 1];
+		for (size_t i = 0; i < count; ++i){
+			memcpy(&stagedData[stagedCount - 1][last.size], vectors[i].data, vectors[i].size);
+			last.size += vectors[i].size;
+		}
+	}
+
+	DatagramSocket::DatagramSocket(DatagramEndpoint& iendpoint, const char* host, uint16_t port, uint8_t* iflowRegister, size_t iregisterLength):
+		BaseSocket(iflowRegister, iregisterLength),
+		endpoint(iendpoint)
+	{
+		// The endpoint is IPv6, IPv4 peers are stored as mapped addresses so
+		// they compare equal to the sender address of received datagrams.
+		sockaddr_in6 peer = {};
+		peer.sin6_family = AF_INET6;
+		peer.sin6_port = htons(port);
+		in_addr ipv4;
+		if(inet_pton(AF_INET, host, &ipv4) == 1){
+			peer.sin6_addr.s6_addr[10] = 0xFF;
+			peer.sin6_addr.s6_addr[11] = 0xFF;
+			memcpy(&peer.sin6_addr.s6_addr[12], &ipv4, sizeof(ipv4));
+		}
+		else if(inet_pton(AF_INET6, host, &peer.sin6_addr) != 1){
+			throw invalid_argument("FlowSerial: not a numeric address");
+		}
+		memset(&address, 0, sizeof(address));
+		memcpy(&address, &peer, sizeof(peer));
+		addressLength = sizeof(peer);
+		// Every call of writeVectorToInterface is one frame, which the
+		// endpoint keeps whole.
+		coalesceReplies = false;
+		maxFramePayload = FLOW_SERIAL_DATAGRAM_SIZE - 2 - maxHeaderArguments - 4;
+		endpoint.attach(this);
+	}
+
+	DatagramSocket::~DatagramSocket(){
+		endpoint.detach(this);
+	}
+
+	void DatagramSocket::writeToInterface(const uint8_t data[], size_t size){
+		IoVector vector = {data, size};
+		writeVectorToInterface(&vector, 1);
+	}
+
+	void DatagramSocket::writeVectorToInterface(const IoVector vectors[], size_t count){
+		endpoint.stage(reinterpret_cast<const sockaddr*>(&address), addressLength, vectors, count);
+	}
+
+	void DatagramSocket::receiveFromInterface(uint32_t timeout){
+		flush();
+		endpoint.flush();
+		endpoint.receive(timeout);
+	}
+}
+
+#endif //__linux__
@@ -0,0 +1,192 @@
+/** \file	NetworkSocket.hpp
+ * \author		Jimmy van den Berg at Flow Engineering
+ * \brief		FlowSerial over TCP and UDP.
+ * \details 	Several frames are packed per segment or datagram using the
+ * 				batching of BaseSocket. UDP peers share one network socket so
+ * 				datagrams of many peers are sent and received with one
+ * 				sendmmsg or recvmmsg call. Linux only.
+ */
+
+#ifndef _FLOWSERIAL_NETWORKSOCKET_HPP_
+#define _FLOWSERIAL_NETWORKSOCKET_HPP_
+
+#include "FlowSerial.hpp"
+#include <sys/socket.h>
+#include <vector>
+
+#ifndef FLOW_SERIAL_DATAGRAM_SIZE
+/**
+ * Largest datagram FlowSerial::DatagramEndpoint sends or receives. Every
+ * frame is sent whole in one datagram, so this also limits the frame size.
+ * Use the same value on both sides. The default fits an ethernet frame.
+ */
+#define FLOW_SERIAL_DATAGRAM_SIZE 1400
+#endif
+
+#ifndef FLOW_SERIAL_DATAGRAM_BATCH
+/**
+ * Number of datagrams FlowSerial::DatagramEndpoint sends or receives per
+ * system call.
+ */
+#define FLOW_SERIAL_DATAGRAM_BATCH 32
+#endif
+
+namespace FlowSerial{
+	/**
+	 * @brief      FlowSerial socket on a TCP connection.
+	 * @details    Frames are collected with BaseSocket::setBatching and sent
+	 *             as one segment when FLOW_SERIAL_TX_BUFFER_SIZE bytes are
+	 *             collected, after one millisecond or on BaseSocket::flush.
+	 *             Call BaseSocket::update regularly or receive from a
+	 *             Reactor. Nagle is turned off since the socket batches
+	 *             itself.
+	 */
+	class StreamSocket : public BaseSocket{
+	public:
+		/**
+		 * @brief      Connects to host:port. Throws std::system_error or
+		 *             std::runtime_error when this fails.
+		 */
+		StreamSocket(const char* host, uint16_t port, uint8_t* iflowRegister, size_t iregisterLength);
+		/**
+		 * @brief      Uses an already connected socket, e.g. from accept. The
+		 *             socket is closed by the destructor.
+		 */
+		StreamSocket(int connectedFd, uint8_t* iflowRegister, size_t iregisterLength);
+		~StreamSocket();
+		StreamSocket(const StreamSocket&) = delete;
+		StreamSocket& operator=(const StreamSocket&) = delete;
+		/**
+		 * @brief      Flushes, then waits up to timeout for data and puts
+		 *             everything that arrived into BaseSocket::handleData.
+		 *             Throws std::runtime_error when the connection closed.
+		 *
+		 * @param[in]  timeout  Maximum time to wait in microseconds.
+		 *
+		 * @return     Number of bytes received.
+		 */
+		size_t receive(uint32_t timeout);
+		int fileDescriptor() const;
+	protected:
+		void writeToInterface(const uint8_t data[], size_t size) override;
+		void writeVectorToInterface(const IoVector vectors[], size_t count) override;
+		void receiveFromInterface(uint32_t timeout) override;
+	private:
+		void configure();
+		int fd;
+		uint8_t readBuffer[16384];
+	};
+
+	class DatagramSocket;
+
+	/**
+	 * @brief      UDP socket shared by the DatagramSocket of every peer.
+	 * @details    Datagrams written by the peers are staged and sent with one
+	 *             sendmmsg call by DatagramEndpoint::flush. Received
+	 *             datagrams are taken in with recvmmsg and given to the peer
+	 *             they came from. Datagrams from unknown addresses and
+	 *             datagrams larger than FLOW_SERIAL_DATAGRAM_SIZE are
+	 *             dropped and counted.
+	 *
+	 *             Frames never straddle datagrams, a lost or reordered
+	 *             datagram only costs the frames in it. A frame that is not
+	 *             complete at the end of a datagram is dropped. Frames larger
+	 *             than FLOW_SERIAL_DATAGRAM_SIZE, e.g. replies to wide reads
+	 *             of more than that, are not sent but counted as dropped.
+	 *
+	 *             Not thread safe, run it from one thread.
+	 */
+	class DatagramEndpoint{
+	public:
+		/**
+		 * @brief      Binds to the given local UDP port, 0 picks any.
+		 *             Throws std::system_error when this fails.
+		 */
+		explicit DatagramEndpoint(uint16_t localPort);
+		~DatagramEndpoint();
+		DatagramEndpoint(const DatagramEndpoint&) = delete;
+		DatagramEndpoint& operator=(const DatagramEndpoint&) = delete;
+		/**
+		 * @brief      Runs one iteration: receives for up to timeout
+		 *             microseconds, updates and flushes all peers and sends
+		 *             the staged datagrams.
+		 *
+		 * @return     Number of datagrams received.
+		 */
+		size_t poll(uint32_t timeout);
+		/**
+		 * @brief      Receives for up to timeout microseconds.
+		 *
+		 * @return     Number of datagrams received.
+		 */
+		size_t receive(uint32_t timeout);
+		/**
+		 * @brief      Sends all staged datagrams.
+		 */
+		void flush();
+		int fileDescriptor() const;
+		/**
+		 * @brief      Local port, useful when bound to port 0.
+		 */
+		uint16_t localPort() const;
+		/**
+		 * @brief      Number of received datagrams that were dropped, and of
+		 *             frames too large to send.
+		 */
+		uint32_t droppedDatagrams() const;
+	private:
+		friend class DatagramSocket;
+		struct Staged{
+			const sockaddr* address;
+			socklen_t addressLength;
+			size_t size;
+		};
+		void attach(DatagramSocket* peer);
+		void detach(DatagramSocket* peer);
+		void stage(const sockaddr* address, socklen_t addressLength, const IoVector vectors[], size_t count);
+		int fd;
+		uint32_t dropped = 0;
+		vector<DatagramSocket*> peers;
+		DatagramSocket* lastPeer = nullptr;
+		size_t stagedCount = 0;
+		Staged staged[FLOW_SERIAL_DATAGRAM_BATCH];
+		uint8_t stagedData[FLOW_SERIAL_DATAGRAM_BATCH][FLOW_SERIAL_DATAGRAM_SIZE];
+		uint8_t receiveData[FLOW_SERIAL_DATAGRAM_BATCH][FLOW_SERIAL_DATAGRAM_SIZE];
+	};
+
+	/**
+	 * @brief      FlowSerial socket for one UDP peer of a DatagramEndpoint.
+	 * @details    The endpoint packs whole frames into datagrams of up to
+	 *             FLOW_SERIAL_DATAGRAM_SIZE bytes, so leave
+	 *             BaseSocket::setBatching off. Writes are split in frames
+	 *             that fit in one datagram. Datagrams are sent by
+	 *             DatagramEndpoint::poll or DatagramEndpoint::flush.
+	 */
+	class DatagramSocket : public BaseSocket{
+	public:
+		/**
+		 * @brief      Attaches a peer to the endpoint.
+		 *
+		 * @param      endpoint         The shared UDP socket.
+		 * @param[in]  host             Numeric address of the peer.
+		 * @param[in]  port             UDP port of the peer.
+		 * @param      iflowRegister    The register.
+		 * @param[in]  iregisterLength  The register length.
+		 */
+		DatagramSocket(DatagramEndpoint& endpoint, const char* host, uint16_t port, uint8_t* iflowRegister, size_t iregisterLength);
+		~DatagramSocket();
+		DatagramSocket(const DatagramSocket&) = delete;
+		DatagramSocket& operator=(const DatagramSocket&) = delete;
+	protected:
+		void writeToInterface(const uint8_t data[], size_t size) override;
+		void writeVectorToInterface(const IoVector vectors[], size_t count) override;
+		void receiveFromInterface(uint32_t timeout) override;
+	private:
+		static_assert(FLOW_SERIAL_DATAGRAM_SIZE > 2 + maxHeaderArguments + 4, "FlowSerial: FLOW_SERIAL_DATAGRAM_SIZE must hold a header and a payload");
+		friend class DatagramEndpoint;
+		DatagramEndpoint& endpoint;
+		sockaddr_storage address;
+		socklen_t addressLength;
+	};
+}
+#endif //_FLOWSERIAL_NETWORKSOCKET_HPP_
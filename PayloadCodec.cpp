@@ -0,0 +1,110 @@
+/** \file	PayloadCodec.cpp
+ * \author		Jimmy van den Berg at Flow Engineering
+ * \brief		Payload encodings of the encoded FlowSerial instructions.
+ */
+
+#include "PayloadCodec.hpp"
+#include <string.h>
+
+namespace FlowSerial{
+
+	static const size_t minRepeat = 3;
+	static const size_t maxRepeat = 0x7F + minRepeat;
+	static const size_t maxLiteral = 0x80;
+
+	size_t runLengthEncode(const uint8_t data[], size_t size, uint8_t out[], size_t capacity, size_t& consumed){
+		size_t in = 0;
+		size_t stored = 0;
+		while(in < size){
+			size_t repeat = 1;
+			while(in + repeat < size && repeat < maxRepeat && data[in + repeat] == data[in]){
+				++repeat;
+			}
+			if(repeat >= minRepeat){
+				if(stored + 2 > capacity){
+					break;
+				}
+				out[stored++] = 0x80 + (repeat - minRepeat);
+				out[stored++] = data[in];
+				in += repeat;
+				continue;
+			}
+			// Literals up to the next run worth encoding.
+			size_t literal = 0;
+			while(in + literal < size && literal < maxLiteral){
+				if(in + literal + 2 < size && data[in + literal] == data[in + literal + 1]
+					&& data[in + literal] == data[in + literal + 2]){
+					break;
+				}
+				++literal;
+			}
+			if(stored + 1 >= capacity){
+				break;
+			}
+			if(stored + 1 + literal > capacity){
+				literal = capacity - stored - 1;
+			}
+			out[stored++] = literal - 1;
+			memcpy(&out[stored], &data[in], literal);
+			stored += literal;
+			in += literal;
+		}
+		consumed = in;
+		return stored;
+	}
+
+	size_t runLengthDecodedSize(const uint8_t data[], size_t size){
+		size_t decoded = 0;
+		size_t i = 0;
+		while(i < size){
+			uint8_t control = data[i++];
+			if(control < 0x80){
+				if(i + control + 1 > size){
+					return SIZE_MAX;
+				}
+				decoded += control + 1;
+				i += control + 1;
+			}
+			else{
+				if(i + 1 > size){
+					return SIZE_MAX;
+				}
+				decoded += control - 0x80 + minRepeat;
+				++i;
+			}
+		}
+		return decoded;
+	}
+
+	size_t runLengthDecode(const uint8_t data[], size_t size, uint8_t out[], size_t capacity){
+		size_t decoded = 0;
+		size_t i = 0;
+		while(i < size && decoded < capacity){
+			uint8_t control = data[i++];
+			size_t length;
+			if(control < 0x80){
+				length = control + 1;
+				if(length > capacity - decoded){
+					length = capacity - decoded;
+				}
+				if(length > size - i){
+					length = size - i;
+				}
+				memcpy(&out[decoded], &data[i], length);
+				i += control + 1;
+			}
+			else{
+				length = control - 0x80 + minRepeat;
+				if(length > capacity - decoded){
+					length = capacity - decoded;
+				}
+				if(i < size){
+					memset(&out[decoded], data[i], length);
+				}
+				++i;
+			}
+			decoded += length;
+		}
+		return decoded;
+	}
+}
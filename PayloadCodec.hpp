@@ -0,0 +1,59 @@
+/** \file	PayloadCodec.hpp
+ * \author		Jimmy van den Berg at Flow Engineering
+ * \brief		Payload encodings of the encoded FlowSerial instructions.
+ * \details 	Register regions are often zero filled or repeat the same
+ * 				byte. Run length encoding sends those in a few bytes. See
+ * 				FlowSerial::BaseSocket::setCompression.
+ */
+
+#ifndef _FLOWSERIAL_PAYLOADCODEC_HPP_
+#define _FLOWSERIAL_PAYLOADCODEC_HPP_
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace FlowSerial{
+	/**
+	 * Encoding of the payload of an encoded frame.
+	 */
+	enum class PayloadCodec : uint8_t{
+		/**
+		 * A control byte c below 0x80 is followed by c + 1 literal bytes.
+		 * From 0x80 it is followed by one byte that repeats c - 0x80 + 3
+		 * times.
+		 */
+		runLength
+	};
+
+	/**
+	 * @brief      Run length encodes as much of data as fits in out.
+	 *
+	 * @param[in]  data      The data
+	 * @param[in]  size      Number of bytes in data.
+	 * @param      out       Receives the encoded bytes.
+	 * @param[in]  capacity  Size of out.
+	 * @param[out] consumed  Number of bytes of data that were encoded.
+	 *
+	 * @return     Number of encoded bytes in out.
+	 */
+	size_t runLengthEncode(const uint8_t data[], size_t size, uint8_t out[], size_t capacity, size_t& consumed);
+	/**
+	 * @brief      Size of the decoded run length data, without decoding.
+	 *
+	 * @return     The size or SIZE_MAX when data is malformed.
+	 */
+	size_t runLengthDecodedSize(const uint8_t data[], size_t size);
+	/**
+	 * @brief      Decodes run length data. Check it first with
+	 *             FlowSerial::runLengthDecodedSize.
+	 *
+	 * @param[in]  data      The encoded data
+	 * @param[in]  size      Number of bytes in data.
+	 * @param      out       Receives the decoded bytes.
+	 * @param[in]  capacity  Size of out. Decoding stops when it is full.
+	 *
+	 * @return     Number of decoded bytes.
+	 */
+	size_t runLengthDecode(const uint8_t data[], size_t size, uint8_t out[], size_t capacity);
+}
+#endif //_FLOWSERIAL_PAYLOADCODEC_HPP_
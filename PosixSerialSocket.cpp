@@ -0,0 +1,278 @@
+/** \file	PosixSerialSocket.cpp
+ * \author		Jimmy van den Berg at Flow Engineering
+ * \brief		BaseSocket on top of a POSIX serial port.
+ */
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#include "PosixSerialSocket.hpp"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdexcept>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <system_error>
+#include <termios.h>
+#include <unistd.h>
+#ifdef _DEBUG_FLOW_SERIAL_
+#include <iostream>
+#endif
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
+
+using namespace std;
+
+namespace FlowSerial{
+
+	static speed_t toSpeed(uint32_t baudRate){
+		switch(baudRate){
+			case 1200: return B1200;
+			case 2400: return B2400;
+			case 4800: return B4800;
+			case 9600: return B9600;
+			case 19200: return B19200;
+			case 38400: return B38400;
+			case 57600: return B57600;
+			case 115200: return B115200;
+			case 230400: return B230400;
+#ifdef B460800
+			case 460800: return B460800;
+#endif
+#ifdef B500000
+			case 500000: return B500000;
+#endif
+#ifdef B921600
+			case 921600: return B921600;
+#endif
+#ifdef B1000000
+			case 1000000: return B1000000;
+#endif
+#ifdef B2000000
+			case 2000000: return B2000000;
+#endif
+#ifdef B3000000
+			case 3000000: return B3000000;
+#endif
+#ifdef B4000000
+			case 4000000: return B4000000;
+#endif
+			default:
+				throw invalid_argument("FlowSerial: unsupported baud rate");
+		}
+	}
+
+	PosixSerialSocket::PosixSerialSocket(const char* device, uint32_t baudRate, uint8_t* iflowRegister, size_t iregisterLength):
+		BaseSocket(iflowRegister, iregisterLength),
+		currentRate(baudRate)
+	{
+		speed_t speed = toSpeed(baudRate);
+		fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+		if(fd < 0){
+			throw system_error(errno, system_category(), "FlowSerial: open");
+		}
+		termios options;
+		if(tcgetattr(fd, &options) < 0){
+			int error = errno;
+			close(fd);
+			throw system_error(error, system_category(), "FlowSerial: tcgetattr");
+		}
+		cfmakeraw(&options);
+		options.c_cflag |= CLOCAL | CREAD;
+		options.c_cflag &= ~(CSTOPB | PARENB);
+#ifdef CRTSCTS
+		options.c_cflag &= ~CRTSCTS;
+#endif
+		options.c_cc[VMIN] = 0;
+		options.c_cc[VTIME] = 0;
+		cfsetispeed(&options, speed);
+		cfsetospeed(&options, speed);
+		if(tcsetattr(fd, TCSANOW, &options) < 0){
+			int error = errno;
+			close(fd);
+			throw system_error(error, system_category(), "FlowSerial: tcsetattr");
+		}
+		tcflush(fd, TCIOFLUSH);
+		setLowLatency(device);
+		// The port stays non blocking. Waiting is done with poll, so no read
+		// takes longer than the timeout given to receive.
+	}
+
+	PosixSerialSocket::~PosixSerialSocket(){
+		close(fd);
+	}
+
+	// Waits up to timeout microseconds for data. False when none arrived.
+	static bool waitReadable(int fd, uint32_t timeout){
+		pollfd request = {fd, POLLIN, 0};
+		int ready = poll(&request, 1, static_cast<int>((timeout + 999) / 1000));
+		if(ready < 0 && errno != EINTR){
+			throw system_error(errno, system_category(), "FlowSerial: poll");
+		}
+		if(ready <= 0){
+			return false;
+		}
+		if(request.revents & (POLLERR | POLLHUP | POLLNVAL)){
+			throw runtime_error("FlowSerial: serial port closed");
+		}
+		return true;
+	}
+
+	void PosixSerialSocket::setReadBatching(uint8_t minBytes, uint8_t interByteTimeout){
+		minimumBytes = minBytes;
+		interByteGap = interByteTimeout * 100000u;
+	}
+
+	size_t PosixSerialSocket::receive(uint32_t timeout){
+		uint64_t start = currentMicros();
+		if(!waitReadable(fd, timeout)){
+			return 0;
+		}
+		size_t received = readAvailable(0);
+		// With read batching keep collecting until minimumBytes arrived, the
+		// line was quiet for interByteGap or the timeout is over.
+		while(received > 0 && received < minimumBytes && received < sizeof(readBuffer)){
+			uint64_t elapsed = currentMicros() - start;
+			if(elapsed >= timeout){
+				break;
+			}
+			uint32_t wait = static_cast<uint32_t>(timeout - elapsed);
+			if(interByteGap > 0 && interByteGap < wait){
+				wait = interByteGap;
+			}
+			if(!waitReadable(fd, wait)){
+				break;
+			}
+			received += readAvailable(received);
+		}
+		if(received == 0){
+			return 0;
+		}
+		handleData(readBuffer, received);
+		return received;
+	}
+
+	size_t PosixSerialSocket::readAvailable(size_t stored){
+		ssize_t received = ::read(fd, &readBuffer[stored], sizeof(readBuffer) - stored);
+		if(received < 0){
+			if(errno == EINTR || errno == EAGAIN){
+				return 0;
+			}
+			throw system_error(errno, system_category(), "FlowSerial: read");
+		}
+		return static_cast<size_t>(received);
+	}
+
+	int PosixSerialSocket::fileDescriptor() const{
+		return fd;
+	}
+
+	void PosixSerialSocket::writeToInterface(const uint8_t data[], size_t size){
+		IoVector vector = {data, size};
+		writeVectorToInterface(&vector, 1);
+	}
+
+	void PosixSerialSocket::writeVectorToInterface(const IoVector vectors[], size_t count){
+		// One writev per call, continued where a partial write stopped.
+		const size_t maxVectors = 16;
+		iovec parts[maxVectors];
+		size_t first = 0;
+		size_t offset = 0;
+		while(first < count){
+			size_t used = 0;
+			for (size_t i = first; i < count && used < maxVectors; ++i, ++used){
+				size_t skip = i == first ? offset : 0;
+				parts[used].iov_base = const_cast<uint8_t*>(vectors[i].data + skip);
+				parts[used].iov_len = vectors[i].size - skip;
+			}
+			ssize_t written = writev(fd, parts, static_cast<int>(used));
+			if(written < 0){
+				if(errno == EINTR){
+					continue;
+				}
+				if(errno == EAGAIN){
+					waitWritable();
+					continue;
+				}
+				throw system_error(errno, system_category(), "FlowSerial: write");
+			}
+			size_t remaining = static_cast<size_t>(written);
+			while(first < count && remaining >= vectors[first].size - offset){
+				remaining -= vectors[first].size - offset;
+				offset = 0;
+				++first;
+			}
+			offset += remaining;
+		}
+	}
+
+	void PosixSerialSocket::receiveFromInterface(uint32_t timeout){
+		receive(timeout);
+	}
+
+	bool PosixSerialSocket::changeInterfaceRate(uint32_t baudRate){
+		speed_t speed;
+		try{
+			speed = toSpeed(baudRate);
+		}
+		catch(const invalid_argument&){
+			return false;
+		}
+		// Frames at the old rate have to be on the line first.
+		if(tcdrain(fd) < 0){
+			throw system_error(errno, system_category(), "FlowSerial: tcdrain");
+		}
+		termios options;
+		if(tcgetattr(fd, &options) < 0){
+			throw system_error(errno, system_category(), "FlowSerial: tcgetattr");
+		}
+		cfsetispeed(&options, speed);
+		cfsetospeed(&options, speed);
+		if(tcsetattr(fd, TCSANOW, &options) < 0){
+			throw system_error(errno, system_category(), "FlowSerial: tcsetattr");
+		}
+		currentRate = baudRate;
+		return true;
+	}
+
+	uint32_t PosixSerialSocket::interfaceRate() const{
+		return currentRate;
+	}
+
+	void PosixSerialSocket::setLowLatency(const char* device){
+#ifdef __linux__
+		serial_struct serial;
+		if(ioctl(fd, TIOCGSERIAL, &serial) == 0){
+			serial.flags |= ASYNC_LOW_LATENCY;
+			ioctl(fd, TIOCSSERIAL, &serial);
+		}
+		// USB serial adapters (FTDI and alike) buffer for up to 16 ms by
+		// default.
+		const char* name = strrchr(device, '/');
+		name = name == nullptr ? device : name + 1;
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "/sys/bus/usb-serial/devices/%s/latency_timer", name);
+		FILE* timer = fopen(path, "w");
+		if(timer != nullptr){
+			fputs("1", timer);
+			fclose(timer);
+		}
+		#ifdef _DEBUG_FLOW_SERIAL_
+		else{
+			cout << "FlowSerial: could not set latency timer of " << device << endl;
+		}
+		#endif
+#endif
+	}
+
+	void PosixSerialSocket::waitWritable(){
+		pollfd request = {fd, POLLOUT, 0};
+		poll(&request, 1, -1);
+	}
+}
+
+#endif //defined(__unix__) || defined(__APPLE__)
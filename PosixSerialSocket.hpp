@@ -0,0 +1,111 @@
+/** \file	PosixSerialSocket.hpp
+ * \author		Jimmy van den Berg at Flow Engineering
+ * \brief		BaseSocket on top of a POSIX serial port.
+ * \details 	Configures the port for low latency raw transfers and reads
+ * 				in large chunks straight into BaseSocket::handleData.
+ */
+
+#ifndef _FLOWSERIAL_POSIXSERIALSOCKET_HPP_
+#define _FLOWSERIAL_POSIXSERIALSOCKET_HPP_
+
+#include "FlowSerial.hpp"
+
+#ifndef FLOW_SERIAL_POSIX_READ_CHUNK
+/**
+ * Number of bytes FlowSerial::PosixSerialSocket reads per system call.
+ */
+#define FLOW_SERIAL_POSIX_READ_CHUNK 4096
+#endif
+
+namespace FlowSerial{
+	/**
+	 * @brief      FlowSerial socket on a serial port like /dev/ttyUSB0 or
+	 *             /dev/ttyACM0.
+	 * @details    The port is put in raw mode: no echo, no line editing, no
+	 *             translation of any byte and 8N1 framing. Where the platform
+	 *             allows it the driver is also asked for low latency:
+	 *             - the ASYNC_LOW_LATENCY flag of the serial driver on Linux,
+	 *             - a latency timer of 1 ms for FTDI and other USB serial
+	 *               adapters that expose one in sysfs.
+	 *
+	 *             Both are best effort, they often need extra permissions.
+	 *
+	 *             Data is read with BaseSocket::read, or by calling
+	 *             PosixSerialSocket::receive from your own loop. The file
+	 *             descriptor may also be given to a Reactor.
+	 */
+	class PosixSerialSocket : public BaseSocket{
+	public:
+		/**
+		 * @brief      Opens and configures the serial port.
+		 * @details    Throws std::system_error when the port can not be
+		 *             opened or configured and std::invalid_argument when the
+		 *             baud rate is not supported.
+		 *
+		 * @param[in]  device           Path of the port, e.g. /dev/ttyUSB0.
+		 * @param[in]  baudRate         Baud rate, e.g. 115200.
+		 * @param      iflowRegister    The register.
+		 * @param[in]  iregisterLength  The register length.
+		 */
+		PosixSerialSocket(const char* device, uint32_t baudRate, uint8_t* iflowRegister, size_t iregisterLength);
+		~PosixSerialSocket();
+		PosixSerialSocket(const PosixSerialSocket&) = delete;
+		PosixSerialSocket& operator=(const PosixSerialSocket&) = delete;
+		/**
+		 * @brief      Collects the data of several reads before it is handled,
+		 *             like the termios VMIN and VTIME.
+		 * @details    PosixSerialSocket::receive keeps reading until
+		 *             minBytes bytes have arrived or no byte arrived for
+		 *             interByteTimeout tenths of a second. The port itself
+		 *             stays non blocking, so the timeout of receive, and with
+		 *             it that of BaseSocket::read, is always kept; what
+		 *             arrived until then is handled. The default 0, 0
+		 *             handles whatever is available. A larger minBytes means
+		 *             fewer calls of BaseSocket::handleData when frames have
+		 *             a known size.
+		 *
+		 * @param[in]  minBytes           Bytes to collect, like VMIN.
+		 * @param[in]  interByteTimeout   Tenths of a second without a byte
+		 *                                after which the bytes so far are
+		 *                                handled, like VTIME. 0 waits for
+		 *                                minBytes up to the timeout.
+		 */
+		void setReadBatching(uint8_t minBytes, uint8_t interByteTimeout);
+		/**
+		 * @brief      Waits up to timeout for data and puts everything that
+		 *             arrived into BaseSocket::handleData.
+		 *
+		 * @param[in]  timeout  Maximum time to wait in microseconds.
+		 *
+		 * @return     Number of bytes received.
+		 */
+		size_t receive(uint32_t timeout);
+		/**
+		 * @brief      The file descriptor of the port.
+		 */
+		int fileDescriptor() const;
+	protected:
+		void writeToInterface(const uint8_t data[], size_t size) override;
+		void writeVectorToInterface(const IoVector vectors[], size_t count) override;
+		void receiveFromInterface(uint32_t timeout) override;
+		/**
+		 * @brief      Waits until all output is sent, then switches the port
+		 *             to baudRate. False when the rate is not supported.
+		 */
+		bool changeInterfaceRate(uint32_t baudRate) override;
+		uint32_t interfaceRate() const override;
+	private:
+		void setLowLatency(const char* device);
+		void waitWritable();
+		// Reads what is available to readBuffer after stored bytes.
+		size_t readAvailable(size_t stored);
+		int fd;
+		uint32_t currentRate;
+		// See PosixSerialSocket::setReadBatching. The gap is in
+		// microseconds.
+		size_t minimumBytes = 0;
+		uint32_t interByteGap = 0;
+		uint8_t readBuffer[FLOW_SERIAL_POSIX_READ_CHUNK];
+	};
+}
+#endif //_FLOWSERIAL_POSIXSERIALSOCKET_HPP_
@@ -0,0 +1,276 @@
+/** \file	Reactor.cpp
+ * \author		Jimmy van den Berg at Flow Engineering
+ * \brief		Event loop that drives many FlowSerial links.
+ */
+
+#ifdef __linux__
+
+#include "Reactor.hpp"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <system_error>
+#include <unistd.h>
+
+using namespace std;
+
+namespace FlowSerial{
+
+	Reactor::Reactor(){
+		epollFd = epoll_create1(EPOLL_CLOEXEC);
+		if(epollFd < 0){
+			throw system_error(errno, system_category(), "FlowSerial: epoll_create1");
+		}
+		wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if(wakeFd < 0){
+			int error = errno;
+			::close(epollFd);
+			throw system_error(error, system_category(), "FlowSerial: eventfd");
+		}
+		epoll_event event = {};
+		event.events = EPOLLIN;
+		event.data.ptr = nullptr;
+		epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event);
+	}
+
+	Reactor::~Reactor(){
+		for (Link* link : links){
+			delete link;
+		}
+		for (Link* link : retired){
+			delete link;
+		}
+		::close(wakeFd);
+		::close(epollFd);
+	}
+
+	void Reactor::add(int fd, BaseSocket& socket, LinkClosedCallback onClosed, void* context){
+		int flags = fcntl(fd, F_GETFL);
+		if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0){
+			throw system_error(errno, system_category(), "FlowSerial: fcntl");
+		}
+		int type = 0;
+		socklen_t typeLength = sizeof(type);
+		bool stream = getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &typeLength) == 0 && type == SOCK_STREAM;
+		Link* link = new Link{fd, &socket, onClosed, context, false, stream};
+		epoll_event event = {};
+		event.events = EPOLLIN;
+		event.data.ptr = link;
+		lock_guard<mutex> lock(linksMutex);
+		if(epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0){
+			int error = errno;
+			delete link;
+			throw system_error(error, system_category(), "FlowSerial: epoll_ctl");
+		}
+		links.push_back(link);
+	}
+
+	void Reactor::remove(int fd){
+		// A socket or callback of this iteration removes a link: the loop
+		// still holds it, so it is only retired. Any other thread waits for
+		// the iteration to end and deletes it right away.
+		bool fromLoop = this_thread::get_id() == dispatchThread.load(memory_order_relaxed);
+		unique_lock<mutex> dispatchLock(dispatchMutex, defer_lock);
+		if(!fromLoop){
+			dispatchLock.lock();
+		}
+		lock_guard<mutex> lock(linksMutex);
+		for (Link* link : links){
+			if(link->fd == fd){
+				detach(link);
+				if(fromLoop){
+					retired.push_back(link);
+				}
+				else{
+					delete link;
+				}
+				return;
+			}
+		}
+	}
+
+	void Reactor::detach(Link* link){
+		epoll_ctl(epollFd, EPOLL_CTL_DEL, link->fd, nullptr);
+		link->removed = true;
+		for (size_t i = 0; i < links.size(); ++i){
+			if(links[i] == link){
+				links.erase(links.begin() + i);
+				break;
+			}
+		}
+	}
+
+	size_t Reactor::size(){
+		lock_guard<mutex> lock(linksMutex);
+		return links.size();
+	}
+
+	void Reactor::setTickInterval(uint32_t microseconds){
+		tickInterval = microseconds;
+	}
+
+	size_t Reactor::runOnce(uint32_t timeout){
+		const int maxEvents = 64;
+		epoll_event events[maxEvents];
+		int ready = epoll_wait(epollFd, events, maxEvents, static_cast<int>((timeout + 999) / 1000));
+		if(ready < 0 && errno != EINTR){
+			throw system_error(errno, system_category(), "FlowSerial: epoll_wait");
+		}
+		size_t active = 0;
+		bool stale[maxEvents];
+		lock_guard<mutex> dispatchLock(dispatchMutex);
+		dispatchThread.store(this_thread::get_id(), memory_order_relaxed);
+		{
+			lock_guard<mutex> lock(linksMutex);
+			dispatchLinks = links;
+			// Links removed by another thread since epoll_wait are gone.
+			for (int i = 0; i < ready; ++i){
+				bool known = events[i].data.ptr == nullptr;
+				for (Link* link : links){
+					known |= link == events[i].data.ptr;
+				}
+				stale[i] = !known;
+			}
+		}
+		for (int i = 0; i < ready; ++i){
+			if(stale[i]){
+				continue;
+			}
+			Link* link = static_cast<Link*>(events[i].data.ptr);
+			if(link == nullptr){
+				uint64_t value;
+				while(::read(wakeFd, &value, sizeof(value)) > 0){}
+				continue;
+			}
+			// The link may have been removed by an earlier event of this round.
+			if(link->removed){
+				continue;
+			}
+			++active;
+			bool hungUp = events[i].events & EPOLLHUP;
+			while(true){
+				ssize_t received = ::read(link->fd, readBuffer, sizeof(readBuffer));
+				if(received > 0){
+					link->socket->handleData(readBuffer, static_cast<size_t>(received));
+					if(link->removed || static_cast<size_t>(received) < sizeof(readBuffer)){
+						break;
+					}
+				}
+				else if(received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+					break;
+				}
+				else if(received < 0 && errno == EINTR){
+					continue;
+				}
+				else if(received == 0 && !link->stream && !hungUp){
+					break;
+				}
+				else{
+					close(link);
+					break;
+				}
+			}
+		}
+		for (Link* link : dispatchLinks){
+			if(!link->removed){
+				link->socket->update();
+			}
+			if(!link->removed){
+				link->socket->flush();
+			}
+		}
+		dispatchThread.store(thread::id(), memory_order_relaxed);
+		lock_guard<mutex> lock(linksMutex);
+		for (Link* link : retired){
+			delete link;
+		}
+		retired.clear();
+		return active;
+	}
+
+	void Reactor::run(){
+		while(!stopRequested){
+			runOnce(tickInterval);
+		}
+		stopRequested = false;
+	}
+
+	void Reactor::stop(){
+		stopRequested = true;
+		uint64_t value = 1;
+		ssize_t ignored = ::write(wakeFd, &value, sizeof(value));
+		(void)ignored;
+	}
+
+	void Reactor::close(Link* link){
+		{
+			lock_guard<mutex> lock(linksMutex);
+			detach(link);
+			retired.push_back(link);
+		}
+		// Without the lock, the callback may add or remove links.
+		if(link->onClosed != nullptr){
+			link->onClosed(link->context, link->fd);
+		}
+	}
+
+	ReactorPool::ReactorPool(size_t threads){
+		if(threads == 0){
+			threads = 1;
+		}
+		for (size_t i = 0; i < threads; ++i){
+			reactors.push_back(new Reactor());
+		}
+	}
+
+	ReactorPool::~ReactorPool(){
+		stop();
+		for (Reactor* reactor : reactors){
+			delete reactor;
+		}
+	}
+
+	void ReactorPool::add(int fd, BaseSocket& socket, LinkClosedCallback onClosed, void* context){
+		Reactor* leastBusy = reactors[0];
+		for (Reactor* reactor : reactors){
+			if(reactor->size() < leastBusy->size()){
+				leastBusy = reactor;
+			}
+		}
+		leastBusy->add(fd, socket, onClosed, context);
+	}
+
+	void ReactorPool::remove(int fd){
+		for (Reactor* reactor : reactors){
+			reactor->remove(fd);
+		}
+	}
+
+	void ReactorPool::start(){
+		if(!threads.empty()){
+			return;
+		}
+		for (Reactor* reactor : reactors){
+			threads.push_back(thread(&Reactor::run, reactor));
+		}
+	}
+
+	void ReactorPool::stop(){
+		// A request without a running thread would end the next start.
+		if(threads.empty()){
+			return;
+		}
+		for (Reactor* reactor : reactors){
+			reactor->stop();
+		}
+		for (thread& worker : threads){
+			worker.join();
+		}
+		threads.clear();
+	}
+}
+
+#endif //__linux__
@@ -0,0 +1,159 @@
+/** \file	Reactor.hpp
+ * \author		Jimmy van den Berg at Flow Engineering
+ * \brief		Event loop that drives many FlowSerial links.
+ * \details 	Instead of one thread per link blocking on read, a Reactor
+ * 				waits on all link file descriptors with epoll, reads what is
+ * 				available and puts it into the BaseSocket of the link. Batching
+ * 				deadlines and read timeouts run on the same loop. Linux only.
+ */
+
+#ifndef _FLOWSERIAL_REACTOR_HPP_
+#define _FLOWSERIAL_REACTOR_HPP_
+
+#include "FlowSerial.hpp"
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace FlowSerial{
+
+	/**
+	 * Called when a link of a Reactor is closed by the other side or fails.
+	 * The link has already been removed from the reactor.
+	 *
+	 * @param      context  The context given to Reactor::add.
+	 * @param[in]  fd       File descriptor of the link.
+	 */
+	typedef void (*LinkClosedCallback)(void* context, int fd);
+
+	/**
+	 * @brief      Drives many BaseSocket instances from one thread.
+	 * @details    Every link is a file descriptor the data of a socket
+	 *             arrives on, for example an opened /dev/ttyACM*. The socket
+	 *             itself still writes to the interface in
+	 *             BaseSocket::writeToInterface. Each iteration of the loop:
+	 *             - waits with epoll until a link is readable or the tick
+	 *               interval passed,
+	 *             - reads each readable link until it would block and puts the
+	 *               data into BaseSocket::handleData,
+	 *             - calls BaseSocket::update and BaseSocket::flush of every
+	 *               link, so batching deadlines and read timeouts are handled.
+	 *
+	 *             Sockets belong to the thread running the reactor. Call
+	 *             their functions from callbacks running on that thread or
+	 *             synchronise yourself. Links are served without holding
+	 *             the lock of the link list, so sockets and
+	 *             LinkClosedCallback may add and remove links, their own
+	 *             included.
+	 */
+	class Reactor{
+	public:
+		Reactor();
+		~Reactor();
+		Reactor(const Reactor&) = delete;
+		Reactor& operator=(const Reactor&) = delete;
+		/**
+		 * @brief      Adds a link. The file descriptor is made non-blocking.
+		 *             May be called from any thread.
+		 *
+		 * @param[in]  fd        File descriptor to read from.
+		 * @param      socket    Socket the data is for.
+		 * @param[in]  onClosed  Called when the link closes. May be nullptr.
+		 * @param      context   Passed to onClosed.
+		 */
+		void add(int fd, BaseSocket& socket, LinkClosedCallback onClosed = nullptr, void* context = nullptr);
+		/**
+		 * @brief      Removes a link. Does not close the file descriptor. May
+		 *             be called from any thread. From another thread it waits
+		 *             until the current iteration is done, so the socket is
+		 *             no longer used when it returns.
+		 */
+		void remove(int fd);
+		/**
+		 * @brief      Number of links.
+		 */
+		size_t size();
+		/**
+		 * @brief      Sets the longest time the loop waits for data before it
+		 *             runs the timers. Default 1000 µs.
+		 */
+		void setTickInterval(uint32_t microseconds);
+		/**
+		 * @brief      Runs one iteration of the loop.
+		 *
+		 * @param[in]  timeout  Longest time to wait for data in microseconds.
+		 *
+		 * @return     Number of links that had data.
+		 */
+		size_t runOnce(uint32_t timeout);
+		/**
+		 * @brief      Runs the loop until Reactor::stop is called.
+		 */
+		void run();
+		/**
+		 * @brief      Makes Reactor::run return. May be called from any
+		 *             thread. When called before run, for example right after
+		 *             starting its thread, that run returns right away.
+		 */
+		void stop();
+	private:
+		struct Link{
+			int fd;
+			BaseSocket* socket;
+			LinkClosedCallback onClosed;
+			void* context;
+			// Set when removed while the loop still holds it.
+			bool removed;
+			// Reading nothing is the end of the stream. Other descriptors,
+			// like a serial port with VMIN 0, read nothing when idle.
+			bool stream;
+		};
+		void close(Link* link);
+		// Takes link out of links. Called with linksMutex held.
+		void detach(Link* link);
+		int epollFd;
+		int wakeFd;
+		uint32_t tickInterval = 1000;
+		// Set by stop, cleared by run when it returns.
+		atomic<bool> stopRequested{false};
+		// Guards links and retired.
+		mutex linksMutex;
+		vector<Link*> links;
+		// Held by runOnce while it serves links, remove waits for it.
+		mutex dispatchMutex;
+		atomic<thread::id> dispatchThread{thread::id()};
+		// Links being served this iteration, a copy taken under linksMutex.
+		vector<Link*> dispatchLinks;
+		// Links removed during the iteration, deleted after it.
+		vector<Link*> retired;
+		// Received data is handled right away, so one buffer serves every link.
+		uint8_t readBuffer[16384];
+	};
+
+	/**
+	 * @brief      Spreads links over several Reactor threads.
+	 * @details    Links are added to the reactor with the fewest links. Each
+	 *             reactor runs in its own thread from ReactorPool::start until
+	 *             ReactorPool::stop.
+	 */
+	class ReactorPool{
+	public:
+		explicit ReactorPool(size_t threads);
+		~ReactorPool();
+		/**
+		 * @brief      Adds a link to the least busy reactor. See Reactor::add.
+		 */
+		void add(int fd, BaseSocket& socket, LinkClosedCallback onClosed = nullptr, void* context = nullptr);
+		/**
+		 * @brief      Removes a link from whichever reactor has it.
+		 */
+		void remove(int fd);
+		void start();
+		void stop();
+	private:
+		vector<Reactor*> reactors;
+		vector<thread> threads;
+	};
+}
+#endif //_FLOWSERIAL_REACTOR_HPP_
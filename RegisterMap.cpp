@@ -0,0 +1,84 @@
+/** \file	RegisterMap.cpp
+ * \author		Jimmy van den Berg at Flow Engineering
+ * \brief		Compile time description of the fields in a register.
+ */
+
+#include "RegisterMap.hpp"
+#ifndef ARDUINO
+#include <stdexcept>
+#endif
+#ifdef _DEBUG_FLOW_SERIAL_
+#include <iostream>
+#endif
+
+using namespace std;
+
+namespace FlowSerial{
+
+	static bool addFrame(RegisterRange plan[], size_t& count, size_t capacity, size_t startAddress, size_t size){
+		if(count == capacity){
+			#ifdef ARDUINO
+			return false;
+			#else
+			throw length_error("FlowSerial: plan is too small for the ranges");
+			#endif
+		}
+		plan[count].startAddress = startAddress;
+		plan[count].size = size;
+		++count;
+		return true;
+	}
+
+	size_t planRanges(RegisterRange ranges[], size_t count, RegisterRange plan[], size_t capacity, size_t maxFrame, size_t maxGap){
+		// Few ranges, insertion sort is fine and needs no library.
+		for (size_t i = 1; i < count; ++i){
+			RegisterRange range = ranges[i];
+			size_t j = i;
+			while(j > 0 && ranges[j - 1].startAddress > range.startAddress){
+				ranges[j] = ranges[j - 1];
+				--j;
+			}
+			ranges[j] = range;
+		}
+		size_t frames = 0;
+		for (size_t i = 0; i < count; ++i){
+			size_t start = ranges[i].startAddress;
+			size_t end = start + ranges[i].size;
+			if(start == end){
+				continue;
+			}
+			if(frames > 0){
+				RegisterRange& last = plan[frames - 1];
+				size_t lastEnd = last.startAddress + last.size;
+				if(start <= lastEnd + maxGap){
+					size_t mergedEnd = end > lastEnd ? end : lastEnd;
+					if(mergedEnd - last.startAddress <= maxFrame){
+						last.size = mergedEnd - last.startAddress;
+						continue;
+					}
+					// Does not fit in the last frame. Only send what it
+					// does not hold yet.
+					if(start < lastEnd){
+						start = lastEnd;
+					}
+					if(start >= end){
+						continue;
+					}
+				}
+			}
+			while(end - start > maxFrame){
+				if(!addFrame(plan, frames, capacity, start, maxFrame)){
+					return 0;
+				}
+				start += maxFrame;
+			}
+			if(!addFrame(plan, frames, capacity, start, end - start)){
+				return 0;
+			}
+		}
+		#ifdef _DEBUG_FLOW_SERIAL_
+		cout << "planned " << count << " ranges into " << frames << " frames" << endl;
+		#endif
+		return frames;
+	}
+}
@@ -0,0 +1,262 @@
+/** \file	RegisterMap.hpp
+ * \author		Jimmy van den Berg at Flow Engineering
+ * \brief		Compile time description of the fields in a register.
+ * \details 	Instead of memcpy with magic offsets, each field of a register
+ * 				is declared once with its type, offset and byte order:
+ *
+ * 				    FLOW_SERIAL_FIELD(Speed, uint16_t, 0, FlowSerial::Endian::little);
+ * 				    FLOW_SERIAL_FIELD(Position, int32_t, 4, FlowSerial::Endian::big);
+ * 				    typedef FlowSerial::RegisterMap<64, Speed, Position> Motor;
+ *
+ * 				    Motor::set<Speed>(reg, 1200);
+ * 				    int32_t position = Motor::get<Position>(mirror);
+ * 				    Motor::read<Speed, Position>(socket, mirror);
+ *
+ * 				Fields that do not fit in the register or overlap are compile
+ * 				errors. Reading or writing a set of fields goes through
+ * 				planRanges, which merges them into as few frames as possible.
+ */
+
+#ifndef _FLOWSERIAL_REGISTERMAP_HPP_
+#define _FLOWSERIAL_REGISTERMAP_HPP_
+
+#include "FlowSerial.hpp"
+#include <string.h>
+#include <type_traits>
+
+/**
+ * Declares a register field called Name, see FlowSerial::Field.
+ */
+#define FLOW_SERIAL_FIELD(Name, Type, Offset, Endianness) \
+	struct Name : FlowSerial::Field<Type, Offset, Endianness>{ \
+		static constexpr const char* name(){ return #Name; } \
+	}
+
+namespace FlowSerial{
+	/**
+	 * @brief      Byte order of a field in the register.
+	 */
+	enum class Endian : uint8_t{
+		little,
+		big
+	};
+
+	/**
+	 * @brief      A field of sizeof(T) bytes at Offset. Derive from it, or use
+	 *             FLOW_SERIAL_FIELD, to give it a name.
+	 *
+	 * @tparam     T           Trivially copyable value type.
+	 * @tparam     Offset      Location in the register.
+	 * @tparam     Endianness  Byte order in the register.
+	 */
+	template<typename T, size_t Offset, Endian Endianness = Endian::little>
+	struct Field{
+		typedef T Type;
+		static const size_t offset = Offset;
+		static const size_t size = sizeof(T);
+		static const Endian endian = Endianness;
+	};
+
+	/**
+	 * @brief      A range of register bytes, see planRanges.
+	 */
+	struct RegisterRange{
+		size_t startAddress;
+		size_t size;
+	};
+
+	/**
+	 * Bytes of a read or write frame that are not payload. Gaps smaller than
+	 * this are cheaper to transfer than to split a frame over.
+	 */
+	static const size_t rangeFrameOverhead = 6;
+
+	/**
+	 * @brief      Merges register ranges into as few frames as possible.
+	 * @details    Ranges that overlap, touch or lie at most maxGap bytes
+	 *             apart end up in one frame, as long as it stays within
+	 *             maxFrame bytes. A range is only split when it is larger
+	 *             than maxFrame on its own, or when it overlaps a frame that
+	 *             is already full. Throws std::length_error when plan is too
+	 *             small, on Arduino it returns 0 then.
+	 *
+	 * @param      ranges    The ranges. Sorted in place by start address.
+	 * @param[in]  count     Number of ranges.
+	 * @param      plan      Receives the frames.
+	 * @param[in]  capacity  Size of plan.
+	 * @param[in]  maxFrame  Largest payload of one frame.
+	 * @param[in]  maxGap    Largest gap between ranges that is transferred
+	 *                       too. Use 0 for writes, the gap would overwrite
+	 *                       the bytes of the peer.
+	 *
+	 * @return     Number of frames in plan.
+	 */
+	size_t planRanges(RegisterRange ranges[], size_t count, RegisterRange plan[], size_t capacity, size_t maxFrame = 255, size_t maxGap = rangeFrameOverhead);
+
+	namespace Detail{
+		template<typename F, typename... Rest>
+		struct OverlapsAny;
+		template<typename F>
+		struct OverlapsAny<F>{
+			static const bool value = false;
+		};
+		template<typename F, typename G, typename... Rest>
+		struct OverlapsAny<F, G, Rest...>{
+			static const bool value = (F::offset < G::offset + G::size && G::offset < F::offset + F::size) || OverlapsAny<F, Rest...>::value;
+		};
+		template<typename... Fields>
+		struct AnyOverlap{
+			static const bool value = false;
+		};
+		template<typename F, typename... Rest>
+		struct AnyOverlap<F, Rest...>{
+			static const bool value = OverlapsAny<F, Rest...>::value || AnyOverlap<Rest...>::value;
+		};
+		template<size_t Length, typename... Fields>
+		struct AllFit{
+			static const bool value = true;
+		};
+		template<size_t Length, typename F, typename... Rest>
+		struct AllFit<Length, F, Rest...>{
+			static const bool value = F::offset + F::size <= Length && AllFit<Length, Rest...>::value;
+		};
+		template<typename F, typename... Fields>
+		struct Contains{
+			static const bool value = false;
+		};
+		template<typename F, typename G, typename... Rest>
+		struct Contains<F, G, Rest...>{
+			static const bool value = std::is_same<F, G>::value || Contains<F, Rest...>::value;
+		};
+		// Most frames planRanges can make of non-overlapping fields.
+		template<size_t MaxFrame, typename... Fs>
+		struct FrameBound{
+			static const size_t value = 0;
+		};
+		template<size_t MaxFrame, typename F, typename... Rest>
+		struct FrameBound<MaxFrame, F, Rest...>{
+			static const size_t value = F::size / MaxFrame + 1 + FrameBound<MaxFrame, Rest...>::value;
+		};
+		template<typename Map, typename... Fs>
+		struct AllContained{
+			static const bool value = true;
+		};
+		template<typename Map, typename F, typename... Rest>
+		struct AllContained<Map, F, Rest...>{
+			static const bool value = Map::template contains<F>() && AllContained<Map, Rest...>::value;
+		};
+
+		#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		static const Endian nativeEndian = Endian::big;
+		#else
+		static const Endian nativeEndian = Endian::little;
+		#endif
+
+		// Copies size bytes, reversed when the byte orders differ.
+		inline void copyOrdered(uint8_t* to, const uint8_t* from, size_t size, bool swap){
+			if(!swap){
+				memcpy(to, from, size);
+				return;
+			}
+			for (size_t i = 0; i < size; ++i){
+				to[i] = from[size - 1 - i];
+			}
+		}
+	}
+
+	/**
+	 * @brief      The fields of a register of Length bytes.
+	 * @details    Only static members: the register itself is the array
+	 *             given to the BaseSocket, or a mirror of the register of the
+	 *             peer. Accessors check at compile time that the field is
+	 *             part of this map.
+	 *
+	 * @tparam     Length  Size of the register in bytes.
+	 * @tparam     Fields  The fields, see FlowSerial::Field.
+	 */
+	template<size_t Length, typename... Fields>
+	class RegisterMap{
+		static_assert(Detail::AllFit<Length, Fields...>::value, "FlowSerial: field does not fit in the register");
+		static_assert(!Detail::AnyOverlap<Fields...>::value, "FlowSerial: fields overlap");
+	public:
+		static const size_t length = Length;
+		static const size_t fieldCount = sizeof...(Fields);
+		template<typename F>
+		static constexpr bool contains(){
+			return Detail::Contains<F, Fields...>::value;
+		}
+		/**
+		 * @brief      Reads a field out of a register.
+		 */
+		template<typename F>
+		static typename F::Type get(const uint8_t flowRegister[]){
+			static_assert(contains<F>(), "FlowSerial: field is not part of this register map");
+			typename F::Type value;
+			Detail::copyOrdered(reinterpret_cast<uint8_t*>(&value), &flowRegister[F::offset], F::size, F::endian != Detail::nativeEndian);
+			return value;
+		}
+		/**
+		 * @brief      Stores a field in a register.
+		 */
+		template<typename F>
+		static void set(uint8_t flowRegister[], typename F::Type value){
+			static_assert(contains<F>(), "FlowSerial: field is not part of this register map");
+			Detail::copyOrdered(&flowRegister[F::offset], reinterpret_cast<const uint8_t*>(&value), F::size, F::endian != Detail::nativeEndian);
+		}
+		/**
+		 * @brief      Plans the frames that transfer some fields, see
+		 *             planRanges.
+		 *
+		 * @tparam     Fs    The fields.
+		 *
+		 * @return     Number of frames in plan.
+		 */
+		template<typename... Fs>
+		static size_t plan(RegisterRange plan[], size_t capacity, size_t maxFrame = 255, size_t maxGap = rangeFrameOverhead){
+			static_assert(sizeof...(Fs) > 0, "FlowSerial: plan at least one field");
+			static_assert(Detail::AllContained<RegisterMap, Fs...>::value, "FlowSerial: field is not part of this register map");
+			RegisterRange ranges[] = {{Fs::offset, Fs::size}...};
+			return planRanges(ranges, sizeof...(Fs), plan, capacity, maxFrame, maxGap);
+		}
+		/**
+		 * @brief      Reads fields of the peer into a mirror of its register
+		 *             with as few BaseSocket::readAsync calls as possible.
+		 *
+		 * @param      socket    The link.
+		 * @param      mirror    Array of Length bytes that receives the fields.
+		 * @param[in]  callback  Called once per read, like readAsync.
+		 * @param      context   Passed to callback.
+		 *
+		 * @return     Number of reads started. Less than planned when more
+		 *             than FLOW_SERIAL_MAX_TAGGED_READS would be pending.
+		 */
+		template<typename... Fs>
+		static size_t read(BaseSocket& socket, uint8_t mirror[], ReadCallback callback = nullptr, void* context = nullptr){
+			RegisterRange frames[Detail::FrameBound<255, Fs...>::value];
+			size_t count = plan<Fs...>(frames, Detail::FrameBound<255, Fs...>::value);
+			for (size_t i = 0; i < count; ++i){
+				if(socket.readAsync(frames[i].startAddress, &mirror[frames[i].startAddress], frames[i].size, callback, context) < 0){
+					return i;
+				}
+			}
+			return count;
+		}
+		/**
+		 * @brief      Writes fields of a register to the peer, merging only
+		 *             fields that touch.
+		 *
+		 * @return     Number of writes.
+		 */
+		template<typename... Fs>
+		static size_t write(BaseSocket& socket, const uint8_t flowRegister[]){
+			RegisterRange frames[Detail::FrameBound<255, Fs...>::value];
+			size_t count = plan<Fs...>(frames, Detail::FrameBound<255, Fs...>::value, 255, 0);
+			for (size_t i = 0; i < count; ++i){
+				socket.write(frames[i].startAddress, &flowRegister[frames[i].startAddress], frames[i].size);
+			}
+			return count;
+		}
+	};
+}
+
+#endif //_FLOWSERIAL_REGISTERMAP_HPP_
@@ -0,0 +1,195 @@
+/** \file	SharedRegister.cpp
+ * \author		Jimmy van den Berg at Flow Engineering
+ * \brief		Register in POSIX shared memory.
+ */
+
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(ARDUINO)
+
+#include "SharedRegister.hpp"
+#include <errno.h>
+#include <fcntl.h>
+#include <new>
+#include <stdexcept>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#ifdef _DEBUG_FLOW_SERIAL_
+#include <iostream>
+#endif
+
+using namespace std;
+
+namespace FlowSerial{
+
+	static_assert(ATOMIC_INT_LOCK_FREE == 2, "SharedRegister needs lock free atomics to share them between processes");
+
+	static size_t alignUp(size_t value, size_t alignment){
+		return (value + alignment - 1) / alignment * alignment;
+	}
+
+	SharedRegister::SharedRegister(const char* iname, size_t iregisterLength, size_t iregionSize, size_t igranule):
+		name(iname),
+		owner(true)
+	{
+		if(iregisterLength == 0 || iregionSize == 0 || igranule == 0){
+			throw invalid_argument("SharedRegister needs a register, region size and granule of at least one byte");
+		}
+		size_t granule = 1;
+		while(granule < igranule){
+			granule <<= 1;
+		}
+		size_t sequencesOffset = alignUp(sizeof(Header), 64);
+		size_t bitmapOffset = sequencesOffset + BaseSocket::snapshotRegionCount(iregisterLength, iregionSize) * sizeof(atomic<uint32_t>);
+		size_t registerOffset = alignUp(bitmapOffset + BaseSocket::changeBitmapSize(iregisterLength, granule), 64);
+		size_t length = registerOffset + iregisterLength;
+
+		// Readers may still map the object of a previous owner. Resizing it
+		// would take their pages away, so it is only unlinked: they keep
+		// the old object and readers that open the name get this one.
+		shm_unlink(iname);
+		int fd = shm_open(iname, O_CREAT | O_EXCL | O_RDWR, 0644);
+		if(fd < 0){
+			throw system_error(errno, system_category(), "Could not create shared memory " + name);
+		}
+		struct stat status;
+		if(fstat(fd, &status) != 0 || ftruncate(fd, length) != 0){
+			int error = errno;
+			close(fd);
+			shm_unlink(iname);
+			throw system_error(error, system_category(), "Could not size shared memory " + name);
+		}
+		try{
+			map(fd, length, true);
+		}
+		catch(...){
+			close(fd);
+			shm_unlink(iname);
+			throw;
+		}
+		close(fd);
+		objectDevice = status.st_dev;
+		objectInode = status.st_ino;
+
+		header = new (mapping) Header;
+		header->version = headerVersion;
+		header->registerLength = iregisterLength;
+		header->regionSize = iregionSize;
+		header->granule = granule;
+		header->sequencesOffset = sequencesOffset;
+		header->bitmapOffset = bitmapOffset;
+		header->registerOffset = registerOffset;
+		header->mappedSize = length;
+		header->generation.store(0, memory_order_relaxed);
+		locate();
+		for (size_t i = 0; i < BaseSocket::snapshotRegionCount(iregisterLength, iregionSize); ++i){
+			new (&sequences[i]) atomic<uint32_t>(0);
+		}
+		// Readers check the magic last, so everything above is visible then.
+		reinterpret_cast<atomic<uint32_t>*>(&header->magic)->store(headerMagic, memory_order_release);
+		#ifdef _DEBUG_FLOW_SERIAL_
+		cout << "Created shared register " << name << " of " << iregisterLength << " bytes" << endl;
+		#endif
+	}
+
+	SharedRegister::SharedRegister(const char* iname):
+		name(iname),
+		owner(false)
+	{
+		int fd = shm_open(iname, O_RDONLY, 0);
+		if(fd < 0){
+			throw system_error(errno, system_category(), "Could not open shared memory " + name);
+		}
+		struct stat status;
+		if(fstat(fd, &status) != 0){
+			int error = errno;
+			close(fd);
+			throw system_error(error, system_category(), "Could not inspect shared memory " + name);
+		}
+		if(static_cast<size_t>(status.st_size) < sizeof(Header)){
+			close(fd);
+			throw runtime_error("Shared memory " + name + " is not a SharedRegister");
+		}
+		try{
+			map(fd, status.st_size, false);
+		}
+		catch(...){
+			close(fd);
+			throw;
+		}
+		close(fd);
+		header = static_cast<Header*>(mapping);
+		uint32_t magic = reinterpret_cast<const atomic<uint32_t>*>(&header->magic)->load(memory_order_acquire);
+		if(magic != headerMagic || header->version != headerVersion || header->mappedSize > mappedSize
+			|| header->registerOffset + header->registerLength > header->mappedSize){
+			munmap(mapping, mappedSize);
+			throw runtime_error("Shared memory " + name + " is not a SharedRegister");
+		}
+		locate();
+	}
+
+	SharedRegister::~SharedRegister(){
+		munmap(mapping, mappedSize);
+		if(owner && !replaced()){
+			shm_unlink(name.c_str());
+		}
+	}
+
+	bool SharedRegister::replaced() const{
+		// A later owner may have created a new object under the name.
+		int fd = shm_open(name.c_str(), O_RDONLY, 0);
+		if(fd < 0){
+			return true;
+		}
+		struct stat status;
+		bool same = fstat(fd, &status) == 0 && status.st_dev == objectDevice && status.st_ino == objectInode;
+		close(fd);
+		return !same;
+	}
+
+	void SharedRegister::map(int fd, size_t length, bool writable){
+		mapping = mmap(nullptr, length, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+		if(mapping == MAP_FAILED){
+			mapping = nullptr;
+			throw system_error(errno, system_category(), "Could not map shared memory " + name);
+		}
+		mappedSize = length;
+	}
+
+	void SharedRegister::locate(){
+		uint8_t* base = static_cast<uint8_t*>(mapping);
+		sequences = reinterpret_cast<atomic<uint32_t>*>(base + header->sequencesOffset);
+		remoteChanges = base + header->bitmapOffset;
+		flowRegister = base + header->registerOffset;
+		registerLength = header->registerLength;
+	}
+
+	void SharedRegister::attach(BaseSocket& socket){
+		if(!owner){
+			throw logic_error("Only the owner of shared memory " + name + " can attach a socket");
+		}
+		if(socket.flowRegister != flowRegister || socket.registerLength != registerLength){
+			throw invalid_argument("The socket does not use shared register " + name);
+		}
+		socket.setSnapshotRegions(sequences, header->regionSize, &header->generation);
+		socket.setChangeTracking(nullptr, remoteChanges, header->granule);
+	}
+
+	void SharedRegister::read(size_t startAddress, uint8_t out[], size_t size) const{
+		if(startAddress > registerLength || size > registerLength - startAddress){
+			throw out_of_range("Read outside shared register " + name);
+		}
+		seqlockRead(sequences, header->regionSize, flowRegister, startAddress, out, size);
+	}
+
+	uint32_t SharedRegister::generation() const{
+		return header->generation.load(memory_order_acquire);
+	}
+
+	uint32_t SharedRegister::regionSequence(size_t region) const{
+		return sequences[region].load(memory_order_acquire);
+	}
+}
+
+#endif
@@ -0,0 +1,152 @@
+/** \file	SharedRegister.hpp
+ * \author		Jimmy van den Berg at Flow Engineering
+ * \brief		Register in POSIX shared memory.
+ * \details 	Lets one gateway process own a FlowSerial link while any
+ * 				number of other processes read the register, without copies
+ * 				and without a socket between them.
+ */
+
+#ifndef _FLOWSERIAL_SHAREDREGISTER_HPP_
+#define _FLOWSERIAL_SHAREDREGISTER_HPP_
+
+#include "FlowSerial.hpp"
+#include <atomic>
+#include <string>
+#include <sys/types.h>
+
+namespace FlowSerial{
+	/**
+	 * @brief      A register in a named POSIX shared memory object.
+	 * @details    The object starts with a header, followed by one seqlock
+	 *             sequence per snapshot region, the bitmap of remote changes
+	 *             and the register itself, aligned to a cache line:
+	 *
+	 *                 | header | sequences | change bitmap | register |
+	 *
+	 *             The owner creates the object and gives data() to the
+	 *             BaseSocket of the link, then calls attach. Remote writes
+	 *             then update the sequences, the change bitmap and a
+	 *             generation counter in the header. Readers open the object
+	 *             by name, map it read only and copy consistent ranges with
+	 *             SharedRegister::read. Polling generation() tells them
+	 *             cheaply whether anything changed at all.
+	 *
+	 *             Only the owner writes. Local writes through the socket are
+	 *             not guarded by the seqlocks; write the register through
+	 *             the socket from one thread and let readers in other
+	 *             processes only read.
+	 *
+	 *             Errors are reported as std::system_error, or as
+	 *             std::runtime_error when an object does not look like a
+	 *             SharedRegister.
+	 */
+	class SharedRegister{
+	public:
+		/**
+		 * @brief      Creates the shared memory object as owner.
+		 * @details    An object of a previous owner under the same name is
+		 *             unlinked and replaced by a new one. Readers that still
+		 *             have the old object mapped keep reading it unchanged,
+		 *             readers that open the name afterwards get the new one.
+		 *
+		 *             The object is removed again when the owner is
+		 *             destroyed, unless a later owner replaced it. Readers
+		 *             that still have it mapped keep their mapping.
+		 *
+		 * @param[in]  name            Name for shm_open, e.g. "/flowserial0".
+		 * @param[in]  registerLength  Size of the register in bytes.
+		 * @param[in]  regionSize      Bytes per seqlock region.
+		 * @param[in]  granule         Bytes per bit of the change bitmap.
+		 *                             Rounded up to a power of two.
+		 */
+		SharedRegister(const char* name, size_t registerLength, size_t regionSize = 64, size_t granule = 8);
+		/**
+		 * @brief      Maps an existing object read only.
+		 *
+		 * @param[in]  name  Name the owner used.
+		 */
+		explicit SharedRegister(const char* name);
+		~SharedRegister();
+		SharedRegister(const SharedRegister&) = delete;
+		SharedRegister& operator=(const SharedRegister&) = delete;
+		/**
+		 * @brief      Makes remote writes of a socket update the header,
+		 *             sequences and change bitmap. Owner only.
+		 * @details    The socket must have been constructed on
+		 *             writableData() and size(). Calls
+		 *             BaseSocket::setSnapshotRegions and
+		 *             BaseSocket::setChangeTracking, without local change
+		 *             tracking. Throws std::invalid_argument when the
+		 *             register or length of the socket is not this one.
+		 *
+		 * @param      socket  The socket of the link.
+		 */
+		void attach(BaseSocket& socket);
+		/**
+		 * @brief      Copies a consistent part of the register.
+		 *
+		 * @param[in]  startAddress  Location in the register.
+		 * @param      out           Receives size bytes.
+		 * @param[in]  size          Number of bytes.
+		 */
+		void read(size_t startAddress, uint8_t out[], size_t size) const;
+		/**
+		 * @return     The register. May change while you look at it.
+		 */
+		const uint8_t* data() const { return flowRegister; }
+		/**
+		 * @return     The register, or nullptr when not owner.
+		 */
+		uint8_t* writableData() { return owner ? flowRegister : nullptr; }
+		size_t size() const { return registerLength; }
+		bool isOwner() const { return owner; }
+		size_t regionSize() const { return header->regionSize; }
+		/**
+		 * @return     Number of guarded remote writes so far.
+		 */
+		uint32_t generation() const;
+		/**
+		 * @return     Sequence of a seqlock region. Odd while it is written.
+		 */
+		uint32_t regionSequence(size_t region) const;
+		/**
+		 * @return     Bitmap of remote changes the owner did not collect yet,
+		 *             see BaseSocket::popRemoteChange.
+		 */
+		const uint8_t* changeBitmap() const { return remoteChanges; }
+		size_t changeGranule() const { return header->granule; }
+	private:
+		struct Header{
+			uint32_t magic;
+			uint32_t version;
+			uint64_t registerLength;
+			uint32_t regionSize;
+			uint32_t granule;
+			uint64_t sequencesOffset;
+			uint64_t bitmapOffset;
+			uint64_t registerOffset;
+			uint64_t mappedSize;
+			atomic<uint32_t> generation;
+		};
+		static constexpr uint32_t headerMagic = 0x53574C46;
+		static constexpr uint32_t headerVersion = 1;
+		void map(int fd, size_t length, bool writable);
+		void locate();
+		// True when the name no longer refers to the object of this owner.
+		bool replaced() const;
+		string name;
+		bool owner;
+		// Identity of the object of this owner.
+		dev_t objectDevice = 0;
+		ino_t objectInode = 0;
+		void* mapping = nullptr;
+		size_t mappedSize = 0;
+		Header* header = nullptr;
+		atomic<uint32_t>* sequences = nullptr;
+		uint8_t* remoteChanges = nullptr;
+		uint8_t* flowRegister = nullptr;
+		size_t registerLength = 0;
+	};
+}
+
+#endif //_FLOWSERIAL_SHAREDREGISTER_HPP_
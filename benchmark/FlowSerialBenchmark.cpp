@@ -0,0 +1,314 @@
+/** \file	FlowSerialBenchmark.cpp
+ * \brief		Throughput and latency benchmarks of FlowSerial.
+ * \details 	Uses an in memory loopback: what one socket writes to the
+ * 				interface is put into BaseSocket::handleData of its peer. Run
+ * 				it before and after a change to catch regressions.
+ *
+ * 				Usage: flowserial-benchmark [encoder|parser|latency|noisy|integrity|capture|all]
+ * 				       flowserial-benchmark replay <trace>
+ *
+ * 				replay feeds the received bytes of a trace recorded with
+ * 				FlowSerial::CaptureRing into a socket as fast as possible.
+ */
+
+#include "../FlowSerial.hpp"
+#include "../FrameCapture.hpp"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <new>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+using namespace std;
+
+namespace{
+	size_t allocations = 0;
+}
+
+void* operator new(size_t size){
+	++allocations;
+	void* ret = malloc(size);
+	if(ret == nullptr){
+		throw bad_alloc();
+	}
+	return ret;
+}
+void operator delete(void* pointer) noexcept{
+	free(pointer);
+}
+
+namespace{
+	typedef chrono::steady_clock Clock;
+
+	double secondsSince(Clock::time_point start){
+		return chrono::duration<double>(Clock::now() - start).count();
+	}
+
+	/**
+	 * Socket of an in memory link. Frames written to the interface are
+	 * either captured or passed straight into the peer.
+	 */
+	class LoopbackSocket : public FlowSerial::BaseSocket{
+	public:
+		LoopbackSocket(uint8_t* iflowRegister, size_t iregisterLength):
+			BaseSocket(iflowRegister, iregisterLength)
+		{}
+		bool feed(const uint8_t data[], size_t arraySize){
+			return handleData(data, arraySize);
+		}
+		// Peer that gets everything written. Captured in output when nullptr.
+		LoopbackSocket* peer = nullptr;
+		// Chance per byte that one of its bits is flipped on the way.
+		double byteErrorRate = 0;
+		vector<uint8_t> output;
+		size_t interfaceCalls = 0;
+	protected:
+		void writeToInterface(const uint8_t data[], size_t arraySize){
+			++interfaceCalls;
+			if(peer == nullptr){
+				output.insert(output.end(), data, data + arraySize);
+				return;
+			}
+			if(byteErrorRate == 0){
+				peer->feed(data, arraySize);
+				return;
+			}
+			noisy.assign(data, data + arraySize);
+			for (size_t i = 0; i < noisy.size(); ++i){
+				if(chance(random) < byteErrorRate){
+					noisy[i] ^= 1 << (random() % 8);
+				}
+			}
+			peer->feed(noisy.data(), noisy.size());
+		}
+	private:
+		vector<uint8_t> noisy;
+		mt19937 random{1234};
+		uniform_real_distribution<double> chance{0, 1};
+	};
+
+	const size_t payloadSizes[] = {1, 8, 32, 64, 128, 255};
+	uint8_t registerA[256];
+	uint8_t registerB[256];
+
+	void benchmarkEncoder(){
+		cout << "encoder" << endl;
+		for (size_t payloadSize : payloadSizes){
+			LoopbackSocket socket(registerA, sizeof(registerA));
+			const size_t frames = 200000;
+			size_t bytes = 0;
+			size_t allocationsBefore = allocations;
+			Clock::time_point start = Clock::now();
+			for (size_t i = 0; i < frames; ++i){
+				socket.write(0, registerA, payloadSize);
+				bytes += socket.output.size();
+				socket.output.clear();
+			}
+			double elapsed = secondsSince(start);
+			cout << "  payload " << payloadSize << " B: "
+				<< frames / elapsed / 1e6 << " Mframes/s, "
+				<< bytes / elapsed / 1e6 << " MB/s, "
+				<< static_cast<double>(allocations - allocationsBefore) / frames << " allocations/frame, "
+				<< static_cast<double>(socket.interfaceCalls) / frames << " interface calls/frame" << endl;
+		}
+	}
+
+	void benchmarkParser(){
+		cout << "parser" << endl;
+		for (size_t payloadSize : payloadSizes){
+			LoopbackSocket encoder(registerA, sizeof(registerA));
+			LoopbackSocket parser(registerB, sizeof(registerB));
+			const size_t framesPerStream = 1024;
+			for (size_t i = 0; i < framesPerStream; ++i){
+				encoder.write(0, registerA, payloadSize);
+			}
+			const vector<uint8_t>& stream = encoder.output;
+			const size_t repetitions = 20000000 / stream.size() + 1;
+			const size_t chunkSize = 512;
+			size_t allocationsBefore = allocations;
+			Clock::time_point start = Clock::now();
+			for (size_t r = 0; r < repetitions; ++r){
+				for (size_t i = 0; i < stream.size(); i += chunkSize){
+					parser.feed(&stream[i], min(chunkSize, stream.size() - i));
+				}
+			}
+			double elapsed = secondsSince(start);
+			double frames = static_cast<double>(framesPerStream) * repetitions;
+			cout << "  payload " << payloadSize << " B: "
+				<< frames / elapsed / 1e6 << " Mframes/s, "
+				<< stream.size() * repetitions / elapsed / 1e6 << " MB/s, "
+				<< (allocations - allocationsBefore) / frames << " allocations/frame" << endl;
+		}
+	}
+
+	void benchmarkLatency(){
+		cout << "read round trip" << endl;
+		LoopbackSocket a(registerA, sizeof(registerA));
+		LoopbackSocket b(registerB, sizeof(registerB));
+		a.peer = &b;
+		b.peer = &a;
+		for (size_t payloadSize : payloadSizes){
+			const size_t reads = 100000;
+			vector<double> latencies;
+			latencies.reserve(reads);
+			uint8_t returnData[255];
+			for (size_t i = 0; i < reads; ++i){
+				Clock::time_point start = Clock::now();
+				int tag = a.readAsync(0, returnData, payloadSize);
+				if(tag < 0 || a.isReadPending(tag)){
+					cout << "  read did not complete" << endl;
+					return;
+				}
+				latencies.push_back(secondsSince(start) * 1e9);
+			}
+			sort(latencies.begin(), latencies.end());
+			cout << "  payload " << payloadSize << " B: p50 "
+				<< latencies[reads / 2] << " ns, p90 "
+				<< latencies[reads * 9 / 10] << " ns, p99 "
+				<< latencies[reads * 99 / 100] << " ns, max "
+				<< latencies.back() << " ns" << endl;
+		}
+	}
+
+	void benchmarkNoisy(){
+		cout << "noisy channel, 64 B payload" << endl;
+		const double byteErrorRates[] = {0, 1e-5, 1e-4, 1e-3, 1e-2};
+		for (double byteErrorRate : byteErrorRates){
+			LoopbackSocket a(registerA, sizeof(registerA));
+			LoopbackSocket b(registerB, sizeof(registerB));
+			a.peer = &b;
+			a.byteErrorRate = byteErrorRate;
+			const size_t frames = 200000;
+			Clock::time_point start = Clock::now();
+			for (size_t i = 0; i < frames; ++i){
+				a.write(0, registerA, 64);
+			}
+			double elapsed = secondsSince(start);
+			FlowSerial::Statistics statistics = b.getStatistics();
+			uint32_t received = statistics.framesReceived[static_cast<size_t>(FlowSerial::Instruction::write)];
+			cout << "  byte error rate " << byteErrorRate << ": "
+				<< 100.0 * received / frames << " % delivered, "
+				<< statistics.checksumFailures << " checksum failures, "
+				<< statistics.resyncs << " resyncs, "
+				<< statistics.bytesDiscarded << " bytes discarded, "
+				<< frames / elapsed / 1e6 << " Mframes/s" << endl;
+		}
+	}
+
+	void benchmarkIntegrity(){
+		cout << "integrity, encode and parse" << endl;
+		const FlowSerial::Integrity integrities[] = {
+			FlowSerial::Integrity::additive, FlowSerial::Integrity::crc16, FlowSerial::Integrity::crc32c};
+		const char* names[] = {"additive", "crc16", "crc32c"};
+		const size_t sizes[] = {8, 255};
+		for (size_t n = 0; n < 3; ++n){
+			for (size_t payloadSize : sizes){
+				LoopbackSocket a(registerA, sizeof(registerA));
+				LoopbackSocket b(registerB, sizeof(registerB));
+				a.setIntegrity(integrities[n]);
+				b.setIntegrity(integrities[n]);
+				a.peer = &b;
+				const size_t frames = 1000000;
+				Clock::time_point start = Clock::now();
+				for (size_t i = 0; i < frames; ++i){
+					a.write(0, registerA, payloadSize);
+				}
+				double elapsed = secondsSince(start);
+				cout << "  " << names[n] << ", payload " << payloadSize << " B: "
+					<< frames / elapsed / 1e6 << " Mframes/s" << endl;
+			}
+		}
+	}
+
+	void benchmarkReplay(const char* path){
+		FlowSerial::TraceReader reader(path);
+		LoopbackSocket socket(registerB, sizeof(registerB));
+		Clock::time_point start = Clock::now();
+		size_t bytes = reader.replay(socket, false);
+		double elapsed = secondsSince(start);
+		FlowSerial::Statistics statistics = socket.getStatistics();
+		uint64_t frames = 0;
+		for (size_t i = 0; i < FlowSerial::Statistics::instructionSlots; ++i){
+			frames += statistics.framesReceived[i];
+		}
+		cout << "  " << bytes << " B, " << frames << " frames: "
+			<< frames / elapsed / 1e6 << " Mframes/s, "
+			<< bytes / elapsed / 1e6 << " MB/s, "
+			<< statistics.checksumFailures << " checksum failures" << endl;
+	}
+
+	void benchmarkCapture(){
+		cout << "capture, 64 B payload" << endl;
+		const char* path = "flowserial-benchmark.trace";
+		remove(path);
+		alignas(8) static uint8_t storage[1 << 20];
+		{
+			FlowSerial::CaptureRing ring(storage, sizeof(storage));
+			FlowSerial::TraceFile file(path);
+			for (int captured = 0; captured < 2; ++captured){
+				LoopbackSocket a(registerA, sizeof(registerA));
+				LoopbackSocket b(registerB, sizeof(registerB));
+				a.peer = &b;
+				if(captured){
+					b.setCapture(&ring);
+				}
+				const size_t frames = 1000000;
+				size_t traceBytes = 0;
+				Clock::time_point start = Clock::now();
+				for (size_t i = 0; i < frames; ++i){
+					a.write(0, registerA, 64);
+					if(captured && i % 1024 == 0){
+						traceBytes += ring.drain(file);
+					}
+				}
+				traceBytes += ring.drain(file);
+				double elapsed = secondsSince(start);
+				cout << "  " << (captured ? "captured" : "not captured") << ": "
+					<< frames / elapsed / 1e6 << " Mframes/s";
+				if(captured){
+					cout << ", " << traceBytes << " B of trace, " << ring.dropped() << " events dropped";
+				}
+				cout << endl;
+			}
+		}
+		cout << "replay of that trace" << endl;
+		benchmarkReplay(path);
+		remove(path);
+	}
+}
+
+int main(int argc, char* argv[]){
+	string which = argc > 1 ? argv[1] : "all";
+	bool all = which == "all";
+	if(all || which == "encoder"){
+		benchmarkEncoder();
+	}
+	if(all || which == "parser"){
+		benchmarkParser();
+	}
+	if(all || which == "latency"){
+		benchmarkLatency();
+	}
+	if(all || which == "noisy"){
+		benchmarkNoisy();
+	}
+	if(all || which == "integrity"){
+		benchmarkIntegrity();
+	}
+	if(all || which == "capture"){
+		benchmarkCapture();
+	}
+	if(which == "replay"){
+		if(argc < 3){
+			cout << "Usage: flowserial-benchmark replay <trace>" << endl;
+			return 1;
+		}
+		cout << "replay of " << argv[2] << endl;
+		benchmarkReplay(argv[2]);
+	}
+	return 0;
+}
@@ -8,6 +8,15 @@ INC_PATH_INSTALL=/usr/local/include/
 
 LIBNAME=libflowserial
 
+# Headers in the order the amalgamation needs them, FlowSerial.hpp first.
+HEADERS="FlowSerial.hpp Checksum.hpp PayloadCodec.hpp FramePool.hpp BasicSocket.hpp ConcurrentSocket.hpp RegisterMap.hpp Reactor.hpp PosixSerialSocket.hpp NetworkSocket.hpp SharedRegister.hpp FrameCapture.hpp"
+AMALGAMATION=FlowSerialAll.hpp
+
+CXXFLAGS="-Wall -std=c++11 -O2"
+# Fat objects so the static library also links without LTO.
+LTOFLAGS="-flto -ffat-lto-objects"
+LIBS="-pthread -lrt"
+
 function install-dependencies {
 	git submodule update --init --recursive
 	cd CircularBuffer &&
@@ -28,9 +37,113 @@ function remove-dependencies {
 function compile-shared {
 	echo compiling..
 	# Compile local cpp files
-	g++ -Wall -std=c++11 -fPIC -c *.cpp &&
+	g++ $CXXFLAGS $LTOFLAGS -fPIC -c *.cpp &&
 	# Make a dynamic library
-	g++ -Wall -shared -Wl,-soname,$LIBNAME.so.$MAJOR -o $LIBNAME.so.$MAJOR.$MINOR *.o
+	g++ $CXXFLAGS $LTOFLAGS -shared -Wl,-soname,$LIBNAME.so.$MAJOR -o $LIBNAME.so.$MAJOR.$MINOR *.o $LIBS
+}
+
+function compile-static {
+	echo compiling static library..
+	g++ $CXXFLAGS $LTOFLAGS -c *.cpp &&
+	# gcc-ar keeps the LTO symbol table of the objects.
+	rm -f $LIBNAME.a &&
+	gcc-ar rcs $LIBNAME.a *.o &&
+	rm *.o
+}
+
+# Static library tuned with a profile of the benchmark. Each object is
+# built in pgo/ twice, so the profile of an object is found by its path.
+function compile-pgo {
+	echo compiling instrumented benchmark..
+	rm -rf pgo && mkdir pgo &&
+	for source in *.cpp; do
+		g++ $CXXFLAGS -fprofile-generate -c $source -o pgo/${source%.cpp}.o || return 1
+	done &&
+	g++ $CXXFLAGS -fprofile-generate -o pgo/flowserial-benchmark benchmark/FlowSerialBenchmark.cpp pgo/*.o $LIBS &&
+	echo running benchmark for the profile.. &&
+	./pgo/flowserial-benchmark > /dev/null &&
+	rm pgo/*.o &&
+	echo compiling with the profile.. &&
+	for source in *.cpp; do
+		g++ $CXXFLAGS $LTOFLAGS -fprofile-use -fprofile-correction -Wno-missing-profile -c $source -o pgo/${source%.cpp}.o || return 1
+	done &&
+	rm -f $LIBNAME.a &&
+	gcc-ar rcs $LIBNAME.a pgo/*.o &&
+	rm -r pgo
+}
+
+function compile-benchmark {
+	echo compiling benchmark..
+	g++ $CXXFLAGS -o flowserial-benchmark benchmark/FlowSerialBenchmark.cpp *.cpp $LIBS
+}
+
+function compile-test {
+	echo compiling tests..
+	g++ $CXXFLAGS -o flowserial-test test/ConcurrentSocketTest.cpp *.cpp $LIBS
+}
+
+# Prints the path of the header of a dependency, from its submodule or
+# from an earlier install-dep.
+function find-dependency {
+	for candidate in "$1/$1" "$1/$1.hpp" "$1/$1.h" "$INC_PATH_INSTALL$1"; do
+		if [[ -f "$candidate" ]]; then
+			echo "$candidate"
+			return 0
+		fi
+	done
+	echo "Could not find $1, run $0 install-dep first." >&2
+	return 1
+}
+
+# Writes one header with the dependencies, all headers and, behind
+# FLOW_SERIAL_IMPLEMENTATION, all sources. Define it in exactly one file
+# before including the header.
+function amalgamate {
+	echo amalgamating into $AMALGAMATION..
+	local circular linear
+	circular=$(find-dependency CircularBuffer) &&
+	linear=$(find-dependency LinearBuffer) || return 1
+	{
+		echo "/** \file	$AMALGAMATION"
+		echo " * \brief		FlowSerial $MAJOR.$MINOR and its dependencies in one header."
+		echo " * \details 	Generated by library-control.sh amalgamate. Define"
+		echo " * 				FLOW_SERIAL_IMPLEMENTATION in one source file before"
+		echo " * 				including it, the other files only get the declarations."
+		echo " */"
+		echo "#ifndef _FLOWSERIAL_ALL_HPP_"
+		echo "#define _FLOWSERIAL_ALL_HPP_"
+		for header in $HEADERS; do
+			echo "// $header"
+			# Local includes are part of this file already.
+			awk -v circular="$circular" -v linear="$linear" '
+				/^#include <CircularBuffer>/ { while((getline line < circular) > 0) print line; next }
+				/^#include <LinearBuffer>/ { while((getline line < linear) > 0) print line; next }
+				/^#include "/ { next }
+				{ print }' "$header" || return 1
+		done
+		echo "#ifdef FLOW_SERIAL_IMPLEMENTATION"
+		for source in *.cpp; do
+			echo "// $source"
+			awk '/^#include "/ { next } { print }' "$source" || return 1
+		done
+		echo "#endif //FLOW_SERIAL_IMPLEMENTATION"
+		echo "#endif //_FLOWSERIAL_ALL_HPP_"
+	} > $AMALGAMATION
+}
+
+function install-headers {
+	echo "Installing header file(s)"
+	sudo cp -v FlowSerial.hpp "$INC_PATH_INSTALL"FlowSerial &&
+	for header in $HEADERS $AMALGAMATION; do
+		sudo cp -v $header "$INC_PATH_INSTALL" || return 1
+	done
+}
+
+function remove-headers {
+	sudo rm -v "$INC_PATH_INSTALL"FlowSerial &&
+	for header in $HEADERS $AMALGAMATION; do
+		sudo rm -fv "$INC_PATH_INSTALL""$header"
+	done
 }
 
 case "$1" in
@@ -48,10 +161,13 @@ case "$1" in
 		echo "Making symbolic links for running and for development."
 		sudo ln -sfv "$LIB_PATH_INSTALL""$LIBNAME".so.$MAJOR.$MINOR "$LIB_PATH_INSTALL""$LIBNAME".so.$MAJOR &&
 		sudo ln -sfv "$LIB_PATH_INSTALL""$LIBNAME".so.$MAJOR "$LIB_PATH_INSTALL""$LIBNAME".so &&
-		echo "Installing header file(s)"
-		sudo cp -v -n FlowSerial.hpp "$INC_PATH_INSTALL"FlowSerial &&
+		compile-static &&
+		echo "Installing static library.."
+		sudo cp -v "$LIBNAME.a" "$LIB_PATH_INSTALL" &&
+		amalgamate &&
+		install-headers &&
 		echo "Cleanup"
-		rm *.so* *.o &&
+		rm *.so* *.a $AMALGAMATION &&
 		echo "Updating ld cache"
 		sudo ldconfig
 		echo "Install successful. Have a nice day!"
@@ -60,13 +176,15 @@ case "$1" in
 		sudo rm -v "$LIB_PATH_INSTALL""$LIBNAME.so.$MAJOR.$MINOR" &&
 		sudo rm -v "$LIB_PATH_INSTALL""$LIBNAME.so.$MAJOR" &&
 		sudo rm -v "$LIB_PATH_INSTALL""$LIBNAME.so" &&
-		sudo rm -v "$INC_PATH_INSTALL"FlowSerial
+		sudo rm -fv "$LIB_PATH_INSTALL""$LIBNAME.a" &&
+		remove-headers
 		;;
 	remove-all)
 		sudo rm -v "$LIB_PATH_INSTALL""$LIBNAME.so.$MAJOR.$MINOR" &&
 		sudo rm -v "$LIB_PATH_INSTALL""$LIBNAME.so.$MAJOR" &&
 		sudo rm -v "$LIB_PATH_INSTALL""$LIBNAME.so" &&
-		sudo rm -v "$INC_PATH_INSTALL"FlowSerial &&
+		sudo rm -fv "$LIB_PATH_INSTALL""$LIBNAME.a" &&
+		remove-headers &&
 		remove-dependencies
 		;;
 	reinstall)
@@ -76,10 +194,13 @@ case "$1" in
 		# Make links for running and for development.
 		sudo ln -sf "$LIB_PATH_INSTALL"$LIBNAME.so.$MAJOR.$MINOR "$LIB_PATH_INSTALL"$LIBNAME.so.$MAJOR &&
 		sudo ln -sf "$LIB_PATH_INSTALL"$LIBNAME.so.$MAJOR "$LIB_PATH_INSTALL"$LIBNAME.so &&
+		compile-static &&
+		sudo cp -v "$LIBNAME.a" "$LIB_PATH_INSTALL" &&
 		# Install header file(s)
-		sudo cp -v FlowSerial.hpp "$INC_PATH_INSTALL"FlowSerial &&
+		amalgamate &&
+		install-headers &&
 		# cleanup
-		rm *.so *.o
+		rm *.so* *.a $AMALGAMATION
 		;;
 	install-dep)
 		install-dependencies
@@ -87,7 +208,26 @@ case "$1" in
 	remove-dep)
 		remove-dependencies
 		;;
+	static)
+		compile-static
+		;;
+	pgo)
+		compile-pgo
+		;;
+	amalgamate)
+		amalgamate
+		;;
+	benchmark)
+		compile-benchmark &&
+		./flowserial-benchmark $2 &&
+		rm flowserial-benchmark
+		;;
+	test)
+		compile-test &&
+		./flowserial-test &&
+		rm flowserial-test
+		;;
 	*)
-		echo $"Usage: $0 {install|remove|remove-all|reinstall|install-dep|remove-dep}"
+		echo $"Usage: $0 {install|remove|remove-all|reinstall|install-dep|remove-dep|static|pgo|amalgamate|benchmark [encoder|parser|latency|noisy]|test}"
 		exit 1
 esac
@@ -0,0 +1,123 @@
+/** \file	ConcurrentSocketTest.cpp
+ * \brief		Sends every kind of large frame through a ConcurrentSocket.
+ * \details 	What the ConcurrentSocket writes to the interface is put into
+ * 				BaseSocket::handleData of a plain peer and the other way
+ * 				around. Prints ok and returns 0 when all checks pass.
+ *
+ * 				Usage: flowserial-test
+ */
+
+#include "../ConcurrentSocket.hpp"
+#include <iostream>
+#include <string.h>
+#include <vector>
+
+using namespace std;
+
+namespace{
+	const size_t registerSize = 1024;
+
+	class PeerSocket : public FlowSerial::BaseSocket{
+	public:
+		PeerSocket(uint8_t* iflowRegister, size_t iregisterLength):
+			BaseSocket(iflowRegister, iregisterLength)
+		{}
+		bool feed(const uint8_t data[], size_t arraySize){
+			return handleData(data, arraySize);
+		}
+		vector<uint8_t> sent;
+	protected:
+		void writeToInterface(const uint8_t data[], size_t arraySize) override{
+			sent.insert(sent.end(), data, data + arraySize);
+		}
+	};
+
+	class QueuedSocket : public FlowSerial::ConcurrentSocket{
+	public:
+		QueuedSocket(uint8_t* iflowRegister, size_t iregisterLength):
+			ConcurrentSocket(iflowRegister, iregisterLength)
+		{}
+		bool feed(const uint8_t data[], size_t arraySize){
+			return handleData(data, arraySize);
+		}
+		vector<uint8_t> sent;
+	protected:
+		void writeToInterface(const uint8_t data[], size_t arraySize) override{
+			sent.insert(sent.end(), data, data + arraySize);
+		}
+	};
+
+	// Moves everything both sides wrote to the other side.
+	void exchange(QueuedSocket& queued, PeerSocket& peer){
+		while(true){
+			queued.flushTransmitQueue();
+			if(queued.sent.empty() && peer.sent.empty()){
+				return;
+			}
+			vector<uint8_t> data;
+			data.swap(queued.sent);
+			peer.feed(data.data(), data.size());
+			data.clear();
+			data.swap(peer.sent);
+			queued.feed(data.data(), data.size());
+		}
+	}
+
+	bool check(bool condition, const char* what){
+		if(!condition){
+			cout << "failed: " << what << endl;
+		}
+		return condition;
+	}
+}
+
+int main(){
+	static uint8_t queuedRegister[registerSize];
+	static uint8_t peerRegister[registerSize];
+	QueuedSocket queued(queuedRegister, registerSize);
+	PeerSocket peer(peerRegister, registerSize);
+	queued.flushTransmitQueue();
+	for (size_t i = 0; i < registerSize; ++i){
+		queuedRegister[i] = static_cast<uint8_t>(i * 7 + 3);
+	}
+	bool ok = true;
+
+	// The longest header with the longest checksum.
+	queued.setIntegrity(FlowSerial::Integrity::crc32c);
+	peer.setIntegrity(FlowSerial::Integrity::crc32c);
+	ok &= check(queued.writeReliable(0, queuedRegister, 255), "reliable write queued");
+	exchange(queued, peer);
+	ok &= check(memcmp(peerRegister, queuedRegister, 255) == 0, "reliable write applied");
+	ok &= check(queued.unacknowledgedWrites() == 0, "reliable write acknowledged");
+
+	// Run length encoded frames.
+	memset(peerRegister, 0, registerSize);
+	memset(&queuedRegister[256], 0x55, 255);
+	queued.setCompression(true);
+	queued.write(256, &queuedRegister[256], 255);
+	exchange(queued, peer);
+	queued.setCompression(false);
+	ok &= check(memcmp(&peerRegister[256], &queuedRegister[256], 255) == 0, "encoded write applied");
+	ok &= check(peer.getStatistics().framesReceived[static_cast<size_t>(FlowSerial::Instruction::writeEncoded)] > 0, "encoded frame sent");
+
+	// Wide frames at high addresses.
+	memset(peerRegister, 0, registerSize);
+	queued.write(700, &queuedRegister[700], 255);
+	exchange(queued, peer);
+	ok &= check(memcmp(&peerRegister[700], &queuedRegister[700], 255) == 0, "wide write applied");
+
+	// Wide mode allows more than a slot holds.
+	memset(peerRegister, 0, registerSize);
+	queued.setWideMode(true);
+	peer.setWideMode(true);
+	queued.write(0, queuedRegister, 400);
+	exchange(queued, peer);
+	ok &= check(memcmp(peerRegister, queuedRegister, 400) == 0, "write larger than a slot applied");
+
+	ok &= check(peer.getStatistics().framesDropped == 0, "no frame dropped");
+	if(!ok){
+		return 1;
+	}
+	cout << "ok" << endl;
+	return 0;
+}